@@ -1,5 +1,6 @@
 #include "scxtest/scx_test.h"
 #include <scx/common.bpf.h>
+#include <scx/bpf_atomic.h>
 #include <lib/sdt_task.h>
 
 #include <lib/atq.h>
@@ -8,18 +9,68 @@
  * Arena task queue implementation.
  */
 
+/* Give up on a contended ring push after this many attempts. */
+#define SCX_ATQ_FIFO_RETRIES	8
+
+/*
+ * Size the ring for @capacity. Keep twice the capacity so that tombstones
+ * left by cancelled tasks don't immediately push inserts into the tree.
+ */
+static u64 scx_atq_fifo_slots(u64 capacity)
+{
+	u64 nr_slots = SCX_ATQ_FIFO_SLOTS;
+	int i;
+
+	if (capacity >= SCX_ATQ_FIFO_SLOTS / 2)
+		return nr_slots;
+
+	bpf_for(i, 0, 32) {
+		if (nr_slots <= 2 || nr_slots / 2 < 2 * capacity)
+			break;
+		nr_slots /= 2;
+	}
+
+	return nr_slots;
+}
+
+static int scx_atq_fifo_init(scx_atq_t *atq, u64 capacity)
+{
+	u64 nr_slots = scx_atq_fifo_slots(capacity);
+	int i;
+
+	atq->ring = scx_dyn_alloc(nr_slots * sizeof(*atq->ring));
+	if (!atq->ring)
+		return -ENOMEM;
+
+	atq->ring_mask = nr_slots - 1;
+
+	/* Cell i is free for the push at position i. */
+	bpf_for(i, 0, nr_slots)
+		atq->ring[i & atq->ring_mask].seq = i;
+
+	return 0;
+}
+
 __weak
 u64 scx_atq_create_internal(bool fifo, size_t capacity)
 {
 	scx_atq_t *atq;
 
-	atq = scx_static_alloc(sizeof(*atq), 1);
+	atq = scx_dyn_alloc(sizeof(*atq));
 	if (!atq)
 		return (u64)NULL;
 
 	atq->tree = rb_create(RB_NOALLOC, RB_DUPLICATE);
-	if (!atq->tree)
+	if (!atq->tree) {
+		scx_dyn_free(atq);
+		return (u64)NULL;
+	}
+
+	if (fifo && scx_atq_fifo_init(atq, capacity)) {
+		rb_destroy(atq->tree);
+		scx_dyn_free(atq);
 		return (u64)NULL;
+	}
 
 	atq->fifo = fifo;
 	atq->capacity = capacity;
@@ -28,24 +79,217 @@ u64 scx_atq_create_internal(bool fifo, size_t capacity)
 	return (u64)atq;
 }
 
+/*
+ * Free an ATQ. The queue must be empty, the nodes belong to the tasks and
+ * would otherwise be left pointing at freed memory.
+ */
+__weak
+int scx_atq_destroy(scx_atq_t __arg_arena *atq)
+{
+	int ret;
+
+	if (unlikely(!atq))
+		return -EINVAL;
+
+	ret = arena_spin_lock(&atq->lock);
+	if (ret)
+		return ret;
+
+	if (atq->size) {
+		arena_spin_unlock(&atq->lock);
+		return -EBUSY;
+	}
+
+	arena_spin_unlock(&atq->lock);
+
+	ret = rb_destroy(atq->tree);
+	if (ret)
+		return ret;
+
+	/* Tombstones may still sit in the ring, they own nothing. */
+	if (atq->ring)
+		scx_dyn_free(atq->ring);
+
+	scx_dyn_free(atq);
+
+	return 0;
+}
+
+/*
+ * Reserve room for one more task. FIFO producers don't hold the lock, so
+ * the size is only ever updated atomically.
+ */
+static __always_inline int scx_atq_reserve(scx_atq_t *atq)
+{
+	if (__sync_fetch_and_add(&atq->size, 1) < atq->capacity)
+		return 0;
+
+	__sync_fetch_and_sub(&atq->size, 1);
+	return -ENOSPC;
+}
+
+/*
+ * Append @taskc to the ring without taking the lock. The ring position
+ * doubles as the task's key, so that consumers can tell a live cell from
+ * one the task has since been cancelled or requeued out of.
+ */
+static __always_inline
+int scx_atq_fifo_push(scx_atq_t *atq, scx_task_common *taskc)
+{
+	scx_atq_cell_t *cell;
+	u64 pos, seq;
+	int i;
+
+	bpf_for(i, 0, SCX_ATQ_FIFO_RETRIES) {
+		pos = READ_ONCE(atq->tail);
+		cell = &atq->ring[pos & atq->ring_mask];
+
+		seq = smp_load_acquire(&cell->seq);
+		if ((s64)(seq - pos) < 0)
+			return -ENOSPC;		/* full */
+		if (seq != pos)
+			continue;		/* another producer got it */
+
+		if (cmpxchg(&atq->tail, pos, pos + 1) != pos)
+			continue;
+
+		/*
+		 * The caller checked nr_overflow without the lock, and a task
+		 * may have overflowed into the tree since. The ring pops first,
+		 * so a task queued here now would jump ahead of it. Leave the
+		 * cell behind as an empty tombstone and queue in the tree.
+		 */
+		if (READ_ONCE(atq->nr_overflow)) {
+			cell->taskc = (u64)NULL;
+			smp_store_release(&cell->seq, pos + 1);
+			return -EAGAIN;
+		}
+
+		taskc->node.key = pos;
+		taskc->node.value = (u64)taskc;
+		/* Publish the key before the ATQ, consumers check both. */
+		smp_store_release(&taskc->atq, atq);
+
+		cell->taskc = (u64)taskc;
+		smp_store_release(&cell->seq, pos + 1);
+		return 0;
+	}
+
+	return -EBUSY;
+}
+
+/* Queue a FIFO task in the tree. Must hold the lock. */
+static __always_inline
+int scx_atq_fifo_overflow(scx_atq_t *atq, scx_task_common *taskc)
+{
+	rbnode_t *node = &taskc->node;
+	int ret;
+
+	/*
+	 * "Leak" the seq on error. We only want sequence numbers
+	 * to be monotonic, not consecutive.
+	 */
+	node->key = SCX_ATQ_OVERFLOW_KEY | atq->seq++;
+	node->value = (u64)taskc;
+
+	ret = rb_insert_node(atq->tree, node);
+	if (ret)
+		return ret;
+
+	taskc->atq = atq;
+	WRITE_ONCE(atq->nr_overflow, atq->nr_overflow + 1);
+
+	return 0;
+}
+
+static int scx_atq_fifo_insert(scx_atq_t *atq, scx_task_common *taskc, bool locked)
+{
+	int ret;
+
+	ret = scx_atq_reserve(atq);
+	if (ret)
+		return ret;
+
+	/*
+	 * Once tasks have overflowed into the tree, queue behind them
+	 * until the consumers drain it, or we would jump ahead of them.
+	 */
+	if (!READ_ONCE(atq->nr_overflow) && !scx_atq_fifo_push(atq, taskc))
+		return 0;
+
+	if (locked) {
+		ret = scx_atq_fifo_overflow(atq, taskc);
+	} else {
+		ret = arena_spin_lock(&atq->lock);
+		if (!ret) {
+			ret = scx_atq_fifo_overflow(atq, taskc);
+			arena_spin_unlock(&atq->lock);
+		}
+	}
+
+	if (ret)
+		__sync_fetch_and_sub(&atq->size, 1);
+
+	return ret;
+}
+
+/* Retire the cell at the head of the ring. Must hold the lock. */
+static __always_inline void scx_atq_fifo_advance(scx_atq_t *atq)
+{
+	u64 pos = atq->head;
+	scx_atq_cell_t *cell = &atq->ring[pos & atq->ring_mask];
+
+	/* Hand the cell to the push one lap ahead. */
+	smp_store_release(&cell->seq, pos + atq->ring_mask + 1);
+	WRITE_ONCE(atq->head, pos + 1);
+}
+
+/*
+ * Find the oldest live task in the ring, dropping any tombstones in front
+ * of it. Must hold the lock. A producer that claimed the head cell but has
+ * yet to fill it makes the ring look empty, which is fine as its insert
+ * hasn't completed.
+ */
+static u64 scx_atq_fifo_first(scx_atq_t *atq)
+{
+	scx_task_common *taskc;
+	scx_atq_cell_t *cell;
+	u64 pos;
+	int i;
+
+	bpf_for(i, 0, SCX_ATQ_FIFO_SLOTS) {
+		pos = atq->head;
+		cell = &atq->ring[pos & atq->ring_mask];
+		if (smp_load_acquire(&cell->seq) != pos + 1)
+			return (u64)NULL;
+
+		taskc = (scx_task_common *)cell->taskc;
+		if (taskc && smp_load_acquire(&taskc->atq) == atq && taskc->node.key == pos)
+			return (u64)taskc;
+
+		/* Cancelled, requeued since, or never filled: drop the cell. */
+		scx_atq_fifo_advance(atq);
+	}
+
+	return (u64)NULL;
+}
+
 __hidden __inline
 int scx_atq_insert_vtime_unlocked(scx_atq_t __arg_arena *atq, scx_task_common __arg_arena *taskc, u64 vtime)
 {
 	rbnode_t *node = &taskc->node;
 	int ret;
 
-	if (unlikely(atq->size == atq->capacity))
-		return -ENOSPC;
-
 	if ((vtime == SCX_ATQ_FIFO) != atq->fifo)
 		return -EINVAL;
 
-	/*
-	 * For FIFO, "Leak" the seq on error. We only want
-	 * sequence numbers to be monotonic, not
-	 * consecutive.
-	 */
-	node->key = (vtime == SCX_ATQ_FIFO) ? atq->seq++ : vtime;
+	if (atq->fifo)
+		return scx_atq_fifo_insert(atq, taskc, true);
+
+	if (unlikely(atq->size == atq->capacity))
+		return -ENOSPC;
+
+	node->key = vtime;
 	node->value = (u64)taskc;
 
 	ret = rb_insert_node(atq->tree, node);
@@ -53,7 +297,7 @@ int scx_atq_insert_vtime_unlocked(scx_atq_t __arg_arena *atq, scx_task_common __
 		return ret;
 
 	taskc->atq = atq;
-	atq->size += 1;
+	__sync_fetch_and_add(&atq->size, 1);
 
 	return 0;
 }
@@ -69,6 +313,10 @@ int scx_atq_insert_vtime(scx_atq_t __arg_arena *atq, scx_task_common __arg_arena
 {
 	int ret;
 
+	/* FIFO inserts only take the lock if they overflow. */
+	if (atq->fifo && vtime == SCX_ATQ_FIFO)
+		return scx_atq_fifo_insert(atq, taskc, false);
+
 	ret = arena_spin_lock(&atq->lock);
 	if (ret)
 		return ret;
@@ -101,7 +349,19 @@ int scx_atq_remove_unlocked(scx_atq_t *atq, scx_task_common __arg_arena *taskc)
        if (taskc->atq != atq)
 	       return -EINVAL;
 
+       /* Leave the ring cell behind, consumers skip it. */
+       if (atq->fifo && !(taskc->node.key & SCX_ATQ_OVERFLOW_KEY)) {
+	       taskc->atq = NULL;
+	       __sync_fetch_and_sub(&atq->size, 1);
+	       return 0;
+       }
+
        ret = rb_remove_node(atq->tree, &taskc->node);
+       if (!ret) {
+	       __sync_fetch_and_sub(&atq->size, 1);
+	       if (atq->fifo)
+		       WRITE_ONCE(atq->nr_overflow, atq->nr_overflow - 1);
+       }
        taskc->atq = NULL;
 
        return ret;
@@ -139,12 +399,27 @@ u64 scx_atq_pop(scx_atq_t *atq)
 		return (u64)NULL;
 	}
 
+	/* Everything in the ring was queued before the tree overflowed. */
+	if (atq->fifo && (taskc_ptr = scx_atq_fifo_first(atq))) {
+		scx_atq_fifo_advance(atq);
+		__sync_fetch_and_sub(&atq->size, 1);
+
+		taskc = (scx_task_common *)taskc_ptr;
+		taskc->atq = NULL;
+
+		arena_spin_unlock(&atq->lock);
+		return taskc_ptr;
+	}
+
 	ret = rb_pop(atq->tree, &vtime, &taskc_ptr);
-	if (!ret)
-		atq->size -= 1;
+	if (!ret) {
+		__sync_fetch_and_sub(&atq->size, 1);
+		if (atq->fifo)
+			WRITE_ONCE(atq->nr_overflow, atq->nr_overflow - 1);
 
-	taskc = (scx_task_common *)taskc_ptr;
-	taskc->atq = NULL;
+		taskc = (scx_task_common *)taskc_ptr;
+		taskc->atq = NULL;
+	}
 
 	arena_spin_unlock(&atq->lock);
 
@@ -172,17 +447,26 @@ u64 scx_atq_peek(scx_atq_t *atq)
 		return (u64)NULL;
 	}
 
+	if (atq->fifo && (taskc_ptr = scx_atq_fifo_first(atq))) {
+		arena_spin_unlock(&atq->lock);
+		return taskc_ptr;
+	}
+
+	/* O(1), the tree caches its leftmost node. */
 	ret = rb_least(atq->tree, &vtime, &taskc_ptr);
 
 	arena_spin_unlock(&atq->lock);
 
+	if (ret)
+		return (u64)NULL;
+
 	return taskc_ptr;
 }
 
 __hidden
 int scx_atq_nr_queued(scx_atq_t *atq)
 {
-	return atq->size;
+	return READ_ONCE(atq->size);
 }
 
 /*
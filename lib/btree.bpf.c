@@ -55,14 +55,16 @@ static bt_node *btnode_alloc(btree_t *btree, bt_node __arg_arena *parent, u64 fl
 	} while (cmpxchg(&btree->freelist, btn, btn->parent) != btn && can_loop);
 
 	if (!btn)
-		btn = scx_static_alloc(sizeof(*btn), 1);
+		btn = scx_dyn_alloc(sizeof(*btn));
 	if (!btn)
 		return NULL;
 
 	arrzero(&btn->keys[0], BT_LEAFSZ);
 
 	btn->flags = flags;
+	btn->numkeys = 0;
 	btn->parent = parent;
+	btn->next = NULL;
 
 	return btn;
 }
@@ -92,14 +94,13 @@ u64 bt_create_internal(void)
 {
 	btree_t __arg_arena *btree;
 
-	btree = scx_static_alloc(sizeof(*btree), 1);
+	btree = scx_dyn_alloc(sizeof(*btree));
 	if (!btree)
 		return (u64)NULL;
 
 	btree->root = btnode_alloc(btree, NULL, BT_F_LEAF);
 	if (!btree->root) {
-		/* XXX Fix once we use the buddy allocator. */
-		//scx_buddy_free(buddy, btree);
+		scx_dyn_free(btree);
 		return (u64)NULL;
 	}
 
@@ -162,6 +163,37 @@ static bt_node *bt_find_leaf(btree_t __arg_arena *btree, u64 key)
 	return btn;
 }
 
+/* The leaf before @btn in key order, NULL if it is the first one. */
+static bt_node *bt_prev_leaf(bt_node *btn)
+{
+	bt_node *parent;
+	u64 ind;
+
+	/* Climb until we are not the leftmost child... */
+	while (can_loop) {
+		parent = btn->parent;
+		if (!parent)
+			return NULL;
+
+		ind = btn_node_index_by_val(parent, btn);
+		if (unlikely(ind > parent->numkeys))
+			return NULL;
+
+		if (ind > 0) {
+			btn = (bt_node *)parent->values[ind - 1];
+			break;
+		}
+
+		btn = parent;
+	}
+
+	/* ... then descend along the right edge of the left sibling. */
+	while (!btnode_isleaf(btn) && can_loop)
+		btn = (bt_node *)btn->values[btn->numkeys];
+
+	return btn;
+}
+
 __weak
 int btnode_remove_internal(bt_node __arg_arena *btn, u64 ind)
 {
@@ -296,6 +328,10 @@ u64 btnode_split_leaf(bt_node __arg_arena *btn_new, bt_node __arg_arena *btn_old
 	arrzero(&btn_old->values[off], nelems);
 	btn_old->numkeys = off;
 
+	/* The upper half follows the old node in the leaf list. */
+	btn_new->next = btn_old->next;
+	btn_old->next = btn_new;
+
 	return key;
 }
 
@@ -583,7 +619,7 @@ int bt_rebalance(btree_t __arg_arena *btree, bt_node __arg_arena *parent, bt_nod
 __weak
 int bt_remove(btree_t __arg_arena *btree, u64 key)
 {
-	bt_node *btn, *parent;
+	bt_node *btn, *parent, *prev;
 	u64 ind;
 	int ret;
 
@@ -591,9 +627,8 @@ int bt_remove(btree_t __arg_arena *btree, u64 key)
 	if (!btn)
 		return -EINVAL;
 
-	/* Update in place. */
 	ind = btn_leaf_index(btn, key);
-	if (unlikely(ind >= btn->numkeys))
+	if (ind >= btn->numkeys || btn->keys[ind] != key)
 		return -ENOENT;
 
 	ret = btnode_remove_leaf(btn, ind);
@@ -609,6 +644,11 @@ int bt_remove(btree_t __arg_arena *btree, u64 key)
 	if (unlikely(ind > parent->numkeys || parent->values[ind] != (u64)btn))
 		return -EINVAL;
 
+	/* Unlink the empty leaf before the tree around it changes shape. */
+	prev = bt_prev_leaf(btn);
+	if (prev)
+		prev->next = btn->next;
+
 	ret = btnode_remove_internal(parent, ind);
 	if (unlikely(ret))
 		return ret;
@@ -656,10 +696,285 @@ int bt_find(btree_t __arg_arena *btree, u64 key, u64 *value)
 	return 0;
 }
 
+/* Position @it at the first key no lower than @key. */
+__weak
+int bt_iter_seek(btree_t __arg_arena *btree, u64 key, struct bt_iter *it)
+{
+	bt_node *btn;
+
+	if (unlikely(!btree || !it))
+		return -EINVAL;
+
+	btn = bt_find_leaf(btree, key);
+	it->leaf = (u64)btn;
+	it->ind = btn_leaf_index(btn, key);
+
+	return 0;
+}
+
+/* Return the pair under @it and advance it. Returns -ENOENT at the end. */
+__weak
+int bt_iter_next(struct bt_iter *it, u64 *key, u64 *value)
+{
+	bt_node *btn;
+
+	if (unlikely(!it || !key || !value))
+		return -EINVAL;
+
+	btn = (bt_node *)it->leaf;
+
+	/* Only the root leaf can be empty, but don't count on it. */
+	while (btn && it->ind >= btn->numkeys && can_loop) {
+		btn = btn->next;
+		it->ind = 0;
+	}
+
+	it->leaf = (u64)btn;
+	if (!btn)
+		return -ENOENT;
+
+	*key = btn->keys[it->ind];
+	*value = btn->values[it->ind];
+	it->ind += 1;
+
+	return 0;
+}
+
+/* Smallest key under @btn, the separator to the left of it in its parent. */
+static u64 btnode_min_key(bt_node *btn)
+{
+	while (!btnode_isleaf(btn) && can_loop)
+		btn = (bt_node *)btn->values[0];
+
+	return btn->keys[0];
+}
+
+/*
+ * Free @root and every node below it. Each child is detached from its parent
+ * before being descended into, so the walk needs no stack: it climbs back up
+ * through the parent pointers and finds the next child still attached.
+ */
+static void btnode_free_subtree(bt_node *root)
+{
+	bt_node *btn = root, *child, *parent;
+
+	while (btn && can_loop) {
+		if (!btnode_isleaf(btn) && btn->values[0]) {
+			child = (bt_node *)btn->values[btn->numkeys];
+			btn->values[btn->numkeys] = 0;
+			if (btn->numkeys)
+				btn->numkeys -= 1;
+
+			btn = child;
+			continue;
+		}
+
+		parent = btn->parent;
+		scx_dyn_free(btn);
+		if (btn == root)
+			break;
+
+		btn = parent;
+	}
+}
+
+/* Free the nodes on the sibling chain at @head, along with their subtrees. */
+static void btnode_free_chain(bt_node *head)
+{
+	bt_node *next;
+
+	while (head && can_loop) {
+		next = head->next;
+		btnode_free_subtree(head);
+		head = next;
+	}
+}
+
+/*
+ * Build a level of the tree over the @nr nodes starting at @head, linked
+ * through their next pointers. Every parent takes up to BT_LEAFSZ - 1
+ * children, the most an internal node holds without splitting, and the
+ * children are spread evenly so that no parent is left nearly empty.
+ * Returns the first parent, whose siblings are again linked through next.
+ */
+static bt_node *bt_bulk_load_level(btree_t *btree, bt_node *head, u64 nr, u64 *nr_parents)
+{
+	bt_node *parent, *prev = NULL, *first = NULL;
+	bt_node *child = head, *next;
+	u64 nr_parent, per_parent, extra;
+	u64 cnt;
+	int i, j;
+
+	nr_parent = div_round_up(nr, BT_LEAFSZ - 1);
+	per_parent = nr / nr_parent;
+	extra = nr % nr_parent;
+
+	bpf_for(i, 0, nr_parent) {
+		parent = btnode_alloc(btree, NULL, 0);
+		if (!parent)
+			goto err;
+
+		cnt = per_parent + (i < extra ? 1 : 0);
+
+		bpf_for(j, 0, BT_LEAFSZ - 1) {
+			if (j >= cnt || !child)
+				break;
+
+			next = child->next;
+
+			if (j > 0)
+				parent->keys[j - 1] = btnode_min_key(child);
+			parent->values[j] = (u64)child;
+			child->parent = parent;
+
+			child = next;
+		}
+
+		parent->numkeys = cnt - 1;
+
+		if (prev)
+			prev->next = parent;
+		else
+			first = parent;
+		prev = parent;
+	}
+
+	/*
+	 * Sibling links are only kept between leaves. They are dropped only now
+	 * so that the children stay on one chain if the level cannot be built.
+	 */
+	for (child = head; child && !btnode_isleaf(child) && can_loop; child = next) {
+		next = child->next;
+		child->next = NULL;
+	}
+
+	*nr_parents = nr_parent;
+
+	return first;
+
+err:
+	/* The children are still on the chain at @head, free the parents only. */
+	for (parent = first; parent && can_loop; parent = next) {
+		next = parent->next;
+		btnode_free(btree, parent);
+	}
+
+	return NULL;
+}
+
+/*
+ * Build a tree from the @nr pairs in @keys and @values, which must be sorted
+ * by strictly increasing key. The leaves are packed to BT_LEAFSZ - 1 pairs,
+ * so the tree is as shallow as possible and scans touch as few lines as
+ * possible, at the cost of a split on the first insertion into each leaf.
+ */
+__weak
+u64 bt_bulk_load_internal(u64 __arena *keys __arg_arena, u64 __arena *values __arg_arena, u64 nr)
+{
+	u64 nr_leaves, per_leaf, extra, cnt;
+	bt_node *btn, *prev = NULL, *head;
+	btree_t *btree;
+	u64 ind = 0;
+	int i, j;
+
+	btree = bt_create();
+	if (!btree)
+		return (u64)NULL;
+
+	if (!nr)
+		return (u64)btree;
+
+	nr_leaves = div_round_up(nr, BT_LEAFSZ - 1);
+	per_leaf = nr / nr_leaves;
+	extra = nr % nr_leaves;
+
+	/* The empty root leaf becomes the first leaf. */
+	head = btree->root;
+
+	bpf_for(i, 0, nr_leaves) {
+		btn = prev ? btnode_alloc(btree, NULL, BT_F_LEAF) : head;
+		if (!btn)
+			goto err;
+
+		/* Chain the leaf first so that it is freed on an error. */
+		if (prev)
+			prev->next = btn;
+		prev = btn;
+
+		cnt = per_leaf + (i < extra ? 1 : 0);
+
+		bpf_for(j, 0, BT_LEAFSZ - 1) {
+			if (j >= cnt || ind >= nr)
+				break;
+
+			if (ind > 0 && keys[ind] <= keys[ind - 1]) {
+				bpf_printk("bulk load input not sorted at %ld", ind);
+				goto err;
+			}
+
+			btn->keys[j] = keys[ind];
+			btn->values[j] = values[ind];
+			ind += 1;
+		}
+
+		btn->numkeys = cnt;
+	}
+
+	/* Each level has at most half as many nodes as the one below. */
+	bpf_for(i, 0, BTREE_MAX_DEPTH) {
+		if (nr_leaves <= 1)
+			break;
+
+		btn = bt_bulk_load_level(btree, head, nr_leaves, &nr_leaves);
+		if (!btn)
+			goto err;
+
+		head = btn;
+	}
+
+	if (unlikely(nr_leaves > 1)) {
+		bpf_printk("bulk load exceeded the maximum depth");
+		goto err;
+	}
+
+	if (!btnode_isleaf(head))
+		head->next = NULL;
+	head->parent = NULL;
+	btree->root = head;
+
+	return (u64)btree;
+
+err:
+	/* Everything built so far hangs off the chain at @head, not the root. */
+	btnode_free_chain(head);
+	btree->root = NULL;
+	bt_destroy(btree);
+
+	return (u64)NULL;
+}
+
+/*
+ * Free the tree and all its nodes, including those cached on the freelist.
+ * The caller must ensure nothing else is using the tree.
+ */
 __weak
 int bt_destroy(btree_t __arg_arena *btree)
 {
-	return -EOPNOTSUPP;
+	bt_node *btn;
+
+	if (!btree)
+		return -EINVAL;
+
+	btnode_free_subtree(btree->root);
+
+	while ((btn = btree->freelist) && can_loop) {
+		btree->freelist = btn->parent;
+		scx_dyn_free(btn);
+	}
+
+	scx_dyn_free(btree);
+
+	return 0;
 }
 
 __weak
@@ -670,6 +985,12 @@ int btnode_print(u64 depth, u64 ind, bt_node __arg_arena *btn)
 	bpf_printk("==== [%ld/%ld] BTREE %s %p PARENT %p====", depth, ind,
 			isleaf ? "LEAF" : "NODE", btn, btn->parent);
 
+#if BT_NODE_CACHELINES != 3
+	int i;
+
+	for (i = 0; i < BT_LEAFSZ && can_loop; i++)
+		bpf_printk("[%d] KEY %ld VAL 0x%lx", i, btn->keys[i], btn->values[i]);
+#else
 	/* Hardcode it for now make it nicer once we use streams. */
 	_Static_assert(BT_LEAFSZ == 10, "Unexpected btree fanout");
 
@@ -696,6 +1017,7 @@ int btnode_print(u64 depth, u64 ind, bt_node __arg_arena *btn)
 				(bt_node *)btn->values[6], (bt_node *)btn->values[7],
 				(bt_node *)btn->values[8], (bt_node *)btn->values[9]);
 	}
+#endif
 
 	bpf_printk("");
 
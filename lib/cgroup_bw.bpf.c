@@ -1233,7 +1233,7 @@ static
 int cbw_get_current_llc_id(void)
 {
 	u32 cpu = bpf_get_smp_processor_id();
-	return topo_cpu_to_llc_id(cpu);
+	return topo_cpu_llc_id(cpu);
 }
 
 int cbw_cgroup_bw_throttled(struct cgroup *cgrp __arg_trusted, int llc_id)
@@ -7,6 +7,8 @@
 #include <scx/common.bpf.h>
 
 #include <lib/sdt_task.h>
+#include <lib/cpumask.h>
+#include <lib/topology.h>
 #include <lib/lvqueue.h>
 
 static inline
@@ -51,13 +53,41 @@ int lvq_order_init(lv_queue_t __arg_arena *lvq, int order)
 	if (arr->data)
 		return 0;
 
-	arr->data = (u64 __arena *)scx_static_alloc((LV_ARR_BASESZ << order) * sizeof(*arr->data), 1);
+	arr->data = (u64 __arena *)scx_dyn_alloc((LV_ARR_BASESZ << order) * sizeof(*arr->data));
 	if (!arr->data)
 		return -ENOMEM;
 
 	return 0;
 }
 
+static inline
+s64 lvq_nr_queued(lv_queue_t *lvq)
+{
+	return (s64)(lvq->bottom - lvq->top);
+}
+
+/*
+ * Move the elements in [t, b) to the next smaller array. The larger array
+ * stays allocated and keeps its contents, so thieves that loaded the old
+ * lvq->cur still read valid values.
+ */
+static inline
+void lvq_shrink(lv_queue_t *lvq, lv_arr_t *arr, u64 b, u64 t)
+{
+	lv_arr_t *newarr;
+
+	if (arr->order == 0)
+		return;
+
+	/* Grown through, so already allocated. */
+	newarr = &lvq->arr[arr->order - 1];
+	if (unlikely(!newarr->data))
+		return;
+
+	lv_arr_copy(newarr, arr, b, t);
+	lvq->cur = newarr;
+}
+
 __weak
 int lvq_push(lv_queue_t __arg_arena *lvq, u64 val)
 {
@@ -84,6 +114,7 @@ int lvq_push(lv_queue_t __arg_arena *lvq, u64 val)
 
 		lv_arr_copy(newarr, arr, b, t);
 		lvq->cur = newarr;
+		arr = newarr;
 	}
 
 	lv_arr_put(arr, b, val);
@@ -118,7 +149,15 @@ int lvq_pop(lv_queue_t __arg_arena *lvq, u64 *val)
 
 	value = lv_arr_get(arr, b);
 	if (sz > 0) {
-		/* XXXETSAL Check for shrinking */
+		if (arr->order > 0 && sz < lv_arr_size(arr) / LV_ARR_SHRINK_RATIO) {
+			if (++lvq->nr_low >= LV_ARR_SHRINK_DELAY) {
+				lvq_shrink(lvq, arr, b, t);
+				lvq->nr_low = 0;
+			}
+		} else {
+			lvq->nr_low = 0;
+		}
+
 		*val = value;
 		return 0;
 	}
@@ -174,11 +213,12 @@ u64 lvq_create_internal(void)
 	volatile lv_queue_t *lvq;
 	int ret, i;
 
-	lvq = scx_static_alloc(sizeof(*lvq), 1);
+	lvq = scx_dyn_alloc(sizeof(*lvq));
 	if (!lvq)
 		return (u64)NULL;
 
 	lvq->bottom = lvq->top = 0;
+	lvq->nr_low = 0;
 
 	for (i = 0; i < LV_ARR_ORDERS && can_loop; i++) {
 		lvq->arr[i].data = NULL;
@@ -187,7 +227,7 @@ u64 lvq_create_internal(void)
 
 	ret = lvq_order_init((lv_queue_t *)lvq, 0);
 	if (ret) {
-		/* XXX Free when migrating from the static allocator. */
+		scx_dyn_free(lvq);
 		return (u64)NULL;
 	}
 
@@ -196,11 +236,281 @@ u64 lvq_create_internal(void)
 	return (u64)(lvq);
 }
 
+/*
+ * Free the queue. The arrays outgrown by lvq_push() are kept around until
+ * now, as concurrent stealers may still be reading from them. No other CPU
+ * may be using the queue by the time it is destroyed.
+ */
 __weak
 int lvq_destroy(lv_queue_t __arg_arena *lvq)
 {
+	int i;
+
 	if (unlikely(!lvq))
 		return -EINVAL;
 
-	return -EOPNOTSUPP;
+	for (i = 0; i < LV_ARR_ORDERS && can_loop; i++) {
+		scx_dyn_free(lvq->arr[i].data);
+		lvq->arr[i].data = NULL;
+	}
+
+	scx_dyn_free(lvq);
+
+	return 0;
+}
+
+/*
+ * Steal up to half of @victim's elements, at most LVQ_STEAL_MAX, into
+ * @thief, which must be owned by the caller. A single compare-and-swap of top
+ * over several elements could race with the owner popping from the bottom,
+ * so the elements are taken one at a time, but the victim only has to be
+ * found once. Returns the number of elements moved.
+ */
+__weak
+int lvq_steal_half(lv_queue_t __arg_arena *victim, lv_queue_t __arg_arena *thief)
+{
+	s64 nr, room;
+	int ret, i, moved = 0;
+	u64 val;
+
+	if (unlikely(!victim || !thief))
+		return -EINVAL;
+
+	nr = lvq_nr_queued(victim);
+	if (nr <= 0)
+		return 0;
+
+	nr = (nr + 1) / 2;
+
+	/*
+	 * A stolen element can't be handed back, so only take what fits in
+	 * the thief's array without growing it, which could fail.
+	 */
+	room = lv_arr_size(thief->cur) - 2 - lvq_nr_queued(thief);
+	if (nr > room)
+		nr = room;
+
+	bpf_for(i, 0, LVQ_STEAL_MAX) {
+		if (i >= nr)
+			break;
+
+		ret = lvq_steal(victim, &val);
+		if (ret)
+			break;
+
+		ret = lvq_push(thief, val);
+		if (unlikely(ret)) {
+			bpf_printk("lvq: lost stolen element, error %d", ret);
+			break;
+		}
+
+		moved += 1;
+	}
+
+	return moved;
+}
+
+__weak
+u64 lvq_pool_create_internal(u32 nr_queues)
+{
+	lvq_pool_t *pool;
+	lv_queue_t *lvq;
+	int i;
+
+	if (unlikely(!nr_queues))
+		return (u64)NULL;
+
+	pool = scx_dyn_alloc(sizeof(*pool));
+	if (!pool)
+		return (u64)NULL;
+
+	pool->queues = scx_dyn_alloc(nr_queues * sizeof(*pool->queues));
+	if (!pool->queues) {
+		scx_dyn_free(pool);
+		return (u64)NULL;
+	}
+
+	bpf_for(i, 0, nr_queues) {
+		lvq = lvq_create();
+		if (!lvq) {
+			lvq_pool_destroy(pool);
+			return (u64)NULL;
+		}
+
+		pool->queues[i] = (u64)lvq;
+		pool->nr_queues = i + 1;
+	}
+
+	return (u64)pool;
+}
+
+/* Like lvq_destroy(), no CPU may be using the pool anymore. */
+__weak
+int lvq_pool_destroy(lvq_pool_t __arg_arena *pool)
+{
+	int i;
+
+	if (unlikely(!pool))
+		return -EINVAL;
+
+	bpf_for(i, 0, pool->nr_queues)
+		lvq_destroy((lv_queue_t *)pool->queues[i]);
+
+	scx_dyn_free(pool->queues);
+	scx_dyn_free(pool);
+
+	return 0;
+}
+
+static inline
+lv_queue_t *lvq_pool_queue(lvq_pool_t *pool, u32 cpu)
+{
+	if (unlikely(cpu >= pool->nr_queues))
+		return NULL;
+
+	return (lv_queue_t *)pool->queues[cpu];
+}
+
+__weak
+int lvq_pool_push(lvq_pool_t __arg_arena *pool, u32 cpu, u64 val)
+{
+	lv_queue_t *lvq;
+
+	if (unlikely(!pool))
+		return -EINVAL;
+
+	lvq = lvq_pool_queue(pool, cpu);
+	if (!lvq)
+		return -EINVAL;
+
+	return lvq_push(lvq, val);
+}
+
+/* The topology leaf of @cpu, NULL if there is no topology. */
+static inline
+topo_ptr lvq_pool_cpu_topo(u32 cpu)
+{
+	topo_ptr topo = topo_all, child = NULL;
+	int lvl, i;
+
+	if (!topo || !topo_contains(topo, cpu))
+		return NULL;
+
+	bpf_for(lvl, 0, TOPO_MAX_LEVEL) {
+		if (!topo->nr_children)
+			return topo;
+
+		for (i = 0; i < topo->nr_children && can_loop; i++) {
+			child = topo->children[i];
+			if (topo_contains(child, cpu))
+				break;
+		}
+
+		if (i == topo->nr_children || !child)
+			return NULL;
+
+		topo = child;
+	}
+
+	return topo;
+}
+
+/*
+ * Steal for @cpu from the CPUs inside @topo but outside @skip, the domain
+ * already searched. The scan starts right after @cpu so that thieves in the
+ * same domain spread over different victims.
+ */
+__weak
+int lvq_pool_steal_domain(lvq_pool_t __arg_arena *pool, u32 cpu,
+			  topo_ptr topo __arg_arena, topo_ptr skip __arg_arena)
+{
+	lv_queue_t *thief, *victim;
+	u32 nr = pool->nr_queues;
+	u32 i, victim_cpu;
+	int ret;
+
+	thief = lvq_pool_queue(pool, cpu);
+	if (!thief)
+		return -EINVAL;
+
+	bpf_for(i, 1, nr) {
+		victim_cpu = (cpu + i) % nr;
+
+		if (topo && !topo_contains(topo, victim_cpu))
+			continue;
+
+		if (skip && topo_contains(skip, victim_cpu))
+			continue;
+
+		victim = lvq_pool_queue(pool, victim_cpu);
+		if (!victim || lvq_nr_queued(victim) <= 0)
+			continue;
+
+		ret = lvq_steal_half(victim, thief);
+		if (ret > 0) {
+			__sync_fetch_and_add(&pool->nr_steals, 1);
+			__sync_fetch_and_add(&pool->nr_stolen, ret);
+			return ret;
+		}
+	}
+
+	return 0;
+}
+
+/*
+ * Pop from @cpu's own queue, refilling it from the nearest non-empty queue
+ * if it is empty. Returns -ENOENT if every queue is empty.
+ */
+__weak
+int lvq_pool_pop(lvq_pool_t __arg_arena *pool, u32 cpu, u64 *val)
+{
+	topo_ptr topo, skip = NULL;
+	lv_queue_t *lvq;
+	int ret = 0, lvl;
+
+	if (unlikely(!pool || !val))
+		return -EINVAL;
+
+	lvq = lvq_pool_queue(pool, cpu);
+	if (!lvq)
+		return -EINVAL;
+
+	ret = lvq_pop(lvq, val);
+	if (ret != -ENOENT)
+		return ret;
+
+	/* Without a topology, every other CPU is equally far away. */
+	topo = lvq_pool_cpu_topo(cpu);
+	if (!topo) {
+		ret = lvq_pool_steal_domain(pool, cpu, NULL, NULL);
+		goto out;
+	}
+
+	/* Walk up from the CPU: core, LLC, node, machine. */
+	ret = 0;
+	bpf_for(lvl, 0, TOPO_MAX_LEVEL) {
+		skip = topo;
+		topo = topo->parent;
+		if (!topo)
+			break;
+
+		ret = lvq_pool_steal_domain(pool, cpu, topo, skip);
+		if (ret)
+			break;
+	}
+
+	/* Queues of CPUs the topology doesn't know about come last. */
+	if (!ret)
+		ret = lvq_pool_steal_domain(pool, cpu, NULL, skip);
+
+out:
+	if (ret < 0)
+		return ret;
+
+	if (!ret) {
+		__sync_fetch_and_add(&pool->nr_steal_fails, 1);
+		return -ENOENT;
+	}
+
+	return lvq_pop(lvq, val);
 }
@@ -24,22 +24,36 @@ scx_minheap_swap_elems(struct scx_minheap_elem __arena *a __arg_arena,
         b->weight = tmp_weight;
 }
 
+/*
+ * Element i is stored at helems[i + SCX_MINHEAP_ARITY - 1]. The children of i,
+ * elements ARITY * i + 1 to ARITY * i + ARITY, then start at a multiple of
+ * ARITY in the array. scx_dyn_alloc() aligns buddy blocks to their size and
+ * large allocations to a page, so either way each sibling group sits in its
+ * own aligned cache line(s).
+ */
+#define SCX_MINHEAP_PAD		(SCX_MINHEAP_ARITY - 1)
+#define SCX_MINHEAP_ELEM(heap, i)	((heap)->helems[(i) + SCX_MINHEAP_PAD])
+#define SCX_MINHEAP_PARENT(i)	(((i) - 1) / SCX_MINHEAP_ARITY)
+#define SCX_MINHEAP_CHILD(i)	(SCX_MINHEAP_ARITY * (i) + 1)
+
 __weak
 u64 scx_minheap_alloc_internal(size_t capacity)
 {
 	size_t alloc_size = sizeof(scx_minheap_t);
 	scx_minheap_t *heap;
 
-	heap = scx_static_alloc(alloc_size, 1);
+	if (unlikely(!capacity || capacity > SCX_MINHEAP_MAX_CAPACITY)) {
+		bpf_printk("minheap capacity %lu out of range", capacity);
+		return (u64)NULL;
+	}
+
+	heap = scx_dyn_alloc(alloc_size);
 	if (!heap)
 		return (u64)NULL;
 
-	heap->helems = scx_static_alloc(capacity * sizeof(*heap->helems), 1);
+	heap->helems = scx_dyn_alloc((capacity + SCX_MINHEAP_PAD) * sizeof(*heap->helems));
 	if (!heap->helems) {
-		/* 
-		 * XXXETSAL: Once we move on from the static alloc,
-		 * properly free the initial allocation.
-		 */
+		scx_dyn_free(heap);
 		return (u64)NULL;
 	}
 
@@ -49,6 +63,18 @@ u64 scx_minheap_alloc_internal(size_t capacity)
 	return (u64)heap;
 }
 
+__weak
+int scx_minheap_destroy(scx_minheap_t *heap __arg_arena)
+{
+	if (unlikely(!heap))
+		return -EINVAL;
+
+	scx_dyn_free(heap->helems);
+	scx_dyn_free(heap);
+
+	return 0;
+}
+
 __weak
 int scx_minheap_balance_top_down(void __arena *heap_ptr __arg_arena)
 {
@@ -59,17 +85,13 @@ int scx_minheap_balance_top_down(void __arena *heap_ptr __arg_arena)
 	for (ind = 0; ind < heap->size && can_loop; ind = next) {
 
 		next = ind;
-		for (off = 1; off < 3 && can_loop; off++) {
-			/*
-			 * Correspondence between parent and children is:
-			 * y = 2x + 1, y = 2x + 2
-			 */
-			child = 2 * ind + off;
+		for (off = 0; off < SCX_MINHEAP_ARITY && can_loop; off++) {
+			child = SCX_MINHEAP_CHILD(ind) + off;
 
 			if (child >= heap->size)
-				continue;
+				break;
 
-			if (heap->helems[next].weight <= heap->helems[child].weight)
+			if (SCX_MINHEAP_ELEM(heap, next).weight <= SCX_MINHEAP_ELEM(heap, child).weight)
 				continue;
 
 			next = child;
@@ -78,7 +100,7 @@ int scx_minheap_balance_top_down(void __arena *heap_ptr __arg_arena)
 		if (next == ind)
 			break;
 
-		scx_minheap_swap_elems(&heap->helems[next], &heap->helems[ind]);
+		scx_minheap_swap_elems(&SCX_MINHEAP_ELEM(heap, next), &SCX_MINHEAP_ELEM(heap, ind));
 	}
 
 	return 0;
@@ -92,12 +114,12 @@ int scx_minheap_balance_bottom_up(void __arena *heap_ptr __arg_arena)
 	int ind;
 
 	for (ind = heap->size - 1; ind > 0 && can_loop; ind = parent) {
-		parent = (ind - 1) >> 1;
+		parent = SCX_MINHEAP_PARENT(ind);
 
-		if (heap->helems[parent].weight <= heap->helems[ind].weight)
+		if (SCX_MINHEAP_ELEM(heap, parent).weight <= SCX_MINHEAP_ELEM(heap, ind).weight)
 			break;
 
-		scx_minheap_swap_elems(&heap->helems[parent], &heap->helems[ind]);
+		scx_minheap_swap_elems(&SCX_MINHEAP_ELEM(heap, parent), &SCX_MINHEAP_ELEM(heap, ind));
 	}
 
 	return 0;
@@ -111,8 +133,8 @@ int scx_minheap_insert(void __arena *heap_ptr __arg_arena, u64 elem, u64 weight)
 	if (heap->size == heap->capacity)
 		return -ENOSPC;
 
-	heap->helems[heap->size].elem = elem;
-	heap->helems[heap->size].weight = weight;
+	SCX_MINHEAP_ELEM(heap, heap->size).elem = elem;
+	SCX_MINHEAP_ELEM(heap, heap->size).weight = weight;
 
 	heap->size += 1;
 
@@ -130,11 +152,11 @@ int scx_minheap_pop(void __arena *heap_ptr __arg_arena, struct scx_minheap_elem
 	if (heap->size == 0)
 		return -EINVAL;
 
-	helem->elem = heap->helems[0].elem;
-	helem->weight = heap->helems[0].weight;
+	helem->elem = SCX_MINHEAP_ELEM(heap, 0).elem;
+	helem->weight = SCX_MINHEAP_ELEM(heap, 0).weight;
 
-	heap->helems[0].elem = heap->helems[heap->size - 1].elem;
-	heap->helems[0].weight = heap->helems[heap->size - 1].weight;
+	SCX_MINHEAP_ELEM(heap, 0).elem = SCX_MINHEAP_ELEM(heap, heap->size - 1).elem;
+	SCX_MINHEAP_ELEM(heap, 0).weight = SCX_MINHEAP_ELEM(heap, heap->size - 1).weight;
 
 	heap->size -= 1;
 
@@ -148,9 +170,254 @@ int scx_minheap_dump(scx_minheap_t *heap __arg_arena)
 {
 	int i;
 
-	bpf_printk("HEAP %p SIZE %ld", heap, heap->size);
+	bpf_printk("HEAP %p SIZE %ld ARITY %d", heap, heap->size, SCX_MINHEAP_ARITY);
 	for (i = 0; i < heap->size && can_loop; i++)
-		bpf_printk("[0] (0x%lx, %ld)", heap->helems[i].elem, heap->helems[i].weight);
+		bpf_printk("[%d] (0x%lx, %ld)", i, SCX_MINHEAP_ELEM(heap, i).elem,
+			   SCX_MINHEAP_ELEM(heap, i).weight);
+
+	return 0;
+}
+
+/*
+ * Indexed minheap. Every insert hands out a handle that stays valid until the
+ * element is popped or removed. The heap tracks the position of every handle,
+ * so changing the weight of an element or removing it is O(log n) instead of
+ * needing a scan.
+ */
+
+__weak
+u64 scx_idx_minheap_alloc_internal(size_t capacity)
+{
+	scx_idx_minheap_t *heap;
+
+	if (unlikely(!capacity || capacity > SCX_MINHEAP_MAX_CAPACITY)) {
+		bpf_printk("indexed minheap capacity %lu out of range", capacity);
+		return (u64)NULL;
+	}
+
+	heap = scx_dyn_alloc(sizeof(*heap));
+	if (!heap)
+		return (u64)NULL;
+
+	heap->helems = scx_dyn_alloc(capacity * sizeof(*heap->helems));
+	heap->pos = scx_dyn_alloc(capacity * sizeof(*heap->pos));
+	heap->gens = scx_dyn_alloc(capacity * sizeof(*heap->gens));
+	heap->free_handles = scx_dyn_alloc(capacity * sizeof(*heap->free_handles));
+	if (!heap->helems || !heap->pos || !heap->gens || !heap->free_handles) {
+		scx_idx_minheap_destroy(heap);
+		return (u64)NULL;
+	}
+
+	heap->capacity = capacity;
+	heap->size = 0;
+	heap->nr_handles = 0;
+	heap->nr_free = 0;
+
+	return (u64)heap;
+}
+
+__weak
+int scx_idx_minheap_destroy(scx_idx_minheap_t *heap __arg_arena)
+{
+	if (unlikely(!heap))
+		return -EINVAL;
+
+	scx_dyn_free(heap->free_handles);
+	scx_dyn_free(heap->gens);
+	scx_dyn_free(heap->pos);
+	scx_dyn_free(heap->helems);
+	scx_dyn_free(heap);
 
 	return 0;
 }
+
+/*
+ * Generations stay below 2^31 so that handles are never mistaken for errors
+ * when returned as s64.
+ */
+#define SCX_IDX_MINHEAP_GEN_MASK	0x7fffffffULL
+
+static __always_inline u32 scx_idx_minheap_slot(u64 handle)
+{
+	return (u32)handle;
+}
+
+static __always_inline u64 scx_idx_minheap_handle(scx_idx_minheap_t *heap, u32 slot)
+{
+	return ((u64)heap->gens[slot] << 32) | slot;
+}
+
+static __always_inline
+void scx_idx_minheap_swap(scx_idx_minheap_t *heap, u64 a, u64 b)
+{
+	struct scx_idx_minheap_elem tmp = heap->helems[a];
+
+	heap->helems[a] = heap->helems[b];
+	heap->helems[b] = tmp;
+
+	heap->pos[scx_idx_minheap_slot(heap->helems[a].handle)] = a;
+	heap->pos[scx_idx_minheap_slot(heap->helems[b].handle)] = b;
+}
+
+static
+void scx_idx_minheap_sift_up(scx_idx_minheap_t *heap, u64 ind)
+{
+	u64 parent;
+
+	for (; ind > 0 && can_loop; ind = parent) {
+		parent = (ind - 1) >> 1;
+
+		if (heap->helems[parent].weight <= heap->helems[ind].weight)
+			break;
+
+		scx_idx_minheap_swap(heap, parent, ind);
+	}
+}
+
+static
+void scx_idx_minheap_sift_down(scx_idx_minheap_t *heap, u64 ind)
+{
+	u64 child, next;
+	int off;
+
+	for (; ind < heap->size && can_loop; ind = next) {
+		next = ind;
+		for (off = 1; off < 3 && can_loop; off++) {
+			child = 2 * ind + off;
+
+			if (child >= heap->size)
+				continue;
+
+			if (heap->helems[next].weight <= heap->helems[child].weight)
+				continue;
+
+			next = child;
+		}
+
+		if (next == ind)
+			break;
+
+		scx_idx_minheap_swap(heap, next, ind);
+	}
+}
+
+/*
+ * Returns the heap position of @handle, or SCX_IDX_MINHEAP_INVALID if it was
+ * never handed out or has been released since, even if its slot was reused.
+ */
+static __always_inline
+u64 scx_idx_minheap_pos(scx_idx_minheap_t *heap, u64 handle)
+{
+	u32 slot = scx_idx_minheap_slot(handle);
+	u64 ind;
+
+	if (unlikely(slot >= heap->nr_handles))
+		return SCX_IDX_MINHEAP_INVALID;
+
+	if (unlikely(heap->gens[slot] != handle >> 32))
+		return SCX_IDX_MINHEAP_INVALID;
+
+	ind = heap->pos[slot];
+	if (unlikely(ind >= heap->size))
+		return SCX_IDX_MINHEAP_INVALID;
+
+	return ind;
+}
+
+/* Insert @elem with @weight. Returns its handle, or a negative error. */
+__hidden
+s64 scx_idx_minheap_insert(scx_idx_minheap_t *heap __arg_arena, u64 elem, u64 weight)
+{
+	u64 handle, ind;
+	u32 slot;
+
+	if (heap->size == heap->capacity)
+		return -ENOSPC;
+
+	if (heap->nr_free) {
+		heap->nr_free -= 1;
+		slot = heap->free_handles[heap->nr_free];
+	} else {
+		slot = heap->nr_handles;
+		heap->gens[slot] = 0;
+		heap->nr_handles += 1;
+	}
+
+	handle = scx_idx_minheap_handle(heap, slot);
+
+	ind = heap->size;
+	heap->helems[ind].elem = elem;
+	heap->helems[ind].weight = weight;
+	heap->helems[ind].handle = handle;
+	heap->pos[slot] = ind;
+
+	heap->size += 1;
+
+	scx_idx_minheap_sift_up(heap, ind);
+
+	return handle;
+}
+
+__hidden
+int scx_idx_minheap_update_weight(scx_idx_minheap_t *heap __arg_arena, u64 handle, u64 weight)
+{
+	u64 ind, old;
+
+	ind = scx_idx_minheap_pos(heap, handle);
+	if (ind == SCX_IDX_MINHEAP_INVALID)
+		return -ENOENT;
+
+	old = heap->helems[ind].weight;
+	heap->helems[ind].weight = weight;
+
+	if (weight < old)
+		scx_idx_minheap_sift_up(heap, ind);
+	else
+		scx_idx_minheap_sift_down(heap, ind);
+
+	return 0;
+}
+
+__hidden
+int scx_idx_minheap_remove(scx_idx_minheap_t *heap __arg_arena, u64 handle)
+{
+	u32 slot = scx_idx_minheap_slot(handle);
+	u64 ind, last;
+
+	ind = scx_idx_minheap_pos(heap, handle);
+	if (ind == SCX_IDX_MINHEAP_INVALID)
+		return -ENOENT;
+
+	last = heap->size - 1;
+	if (ind != last)
+		scx_idx_minheap_swap(heap, ind, last);
+
+	heap->size -= 1;
+	heap->pos[slot] = SCX_IDX_MINHEAP_INVALID;
+	heap->gens[slot] = (heap->gens[slot] + 1) & SCX_IDX_MINHEAP_GEN_MASK;
+	heap->free_handles[heap->nr_free] = slot;
+	heap->nr_free += 1;
+
+	/* The element moved into the hole may need to go either way. */
+	if (ind < heap->size) {
+		if (ind > 0 && heap->helems[ind].weight < heap->helems[(ind - 1) >> 1].weight)
+			scx_idx_minheap_sift_up(heap, ind);
+		else
+			scx_idx_minheap_sift_down(heap, ind);
+	}
+
+	return 0;
+}
+
+/* Inlined because we are passing a non-arena pointer argument. */
+__hidden
+int scx_idx_minheap_pop(scx_idx_minheap_t *heap __arg_arena, struct scx_minheap_elem *helem __arg_trusted)
+{
+	if (heap->size == 0)
+		return -EINVAL;
+
+	helem->elem = heap->helems[0].elem;
+	helem->weight = heap->helems[0].weight;
+
+	return scx_idx_minheap_remove(heap, heap->helems[0].handle);
+}
@@ -26,28 +26,46 @@ u64 rb_create_internal(enum rbtree_alloc alloc, enum rbtree_insert_mode insert)
 {
 	rbtree_t *rbtree;
 
-	rbtree = (rbtree_t *)scx_static_alloc(sizeof(*rbtree), 1);
+	rbtree = (rbtree_t *)scx_dyn_alloc(sizeof(*rbtree));
 	if (!rbtree)
 		return (u64)NULL;
 
 	rbtree->root = NULL;
+	rbtree->leftmost = NULL;
+	rbtree->freelist = NULL;
 	rbtree->alloc = alloc;
 	rbtree->insert = insert;
 
 	return (u64)rbtree;
 }
 
+/*
+ * Free the tree and the nodes it allocated. The nodes of RB_NOALLOC trees
+ * belong to the caller and are only unlinked.
+ */
 __weak
 int rb_destroy(rbtree_t *rbtree)
 {
+	rbnode_t *rbnode;
 	int ret;
 
+	if (unlikely(!rbtree))
+		return -EINVAL;
+
 	while (rbtree->root && can_loop) {
-		ret = rb_remove(rbtree, rbtree->root->key);
+		ret = rb_pop(rbtree, NULL, NULL);
 		if (ret)
 			return ret;
 	}
 
+	while (rbtree->freelist && can_loop) {
+		rbnode = rbtree->freelist;
+		rbtree->freelist = rbnode->parent;
+		scx_dyn_free(rbnode);
+	}
+
+	scx_dyn_free(rbtree);
+
 	return 0;
 }
 
@@ -179,7 +197,7 @@ static inline rbnode_t *rb_node_alloc_common(rbtree_t __arg_arena *rbtree, u64 k
 	} while (cmpxchg(&rbtree->freelist, rbnode, rbnode->parent) != rbnode && can_loop);
 
 	if (!rbnode)
-		rbnode = (rbnode_t *)scx_static_alloc(sizeof(*rbnode), 1);
+		rbnode = (rbnode_t *)scx_dyn_alloc(sizeof(*rbnode));
 	if (!rbnode)
 		return NULL;
 
@@ -237,6 +255,7 @@ int rb_node_insert(rbtree_t __arg_arena *rbtree, rbnode_t __arg_arena *node)
 
 	if (!parent) {
 		rbtree->root = node;
+		rbtree->leftmost = node;
 		return 0;
 	}
 
@@ -256,6 +275,9 @@ int rb_node_insert(rbtree_t __arg_arena *rbtree, rbnode_t __arg_arena *node)
 			if (ret)
 				return ret;
 
+			if (rbtree->leftmost == parent)
+				rbtree->leftmost = node;
+
 			/* Only free if called from rb_insert_node. */
 			if (rbtree->alloc == RB_ALLOC)
 				rb_node_free(rbtree, parent);
@@ -274,6 +296,10 @@ int rb_node_insert(rbtree_t __arg_arena *rbtree, rbnode_t __arg_arena *node)
 	else
 		parent->right = node;
 
+	/* Rotations preserve the order, so only the attach point matters. */
+	if (parent == rbtree->leftmost && parent->left == node)
+		rbtree->leftmost = node;
+
 	while (can_loop) {
 		parent = node->parent;
 		if (!parent)
@@ -376,13 +402,95 @@ static inline rbnode_t *rbnode_least(rbnode_t *subtree)
 	return subtree;
 }
 
+static inline rbnode_t *rbnode_greatest(rbnode_t *subtree)
+{
+	while (subtree->right && can_loop)
+		subtree = subtree->right;
+
+	return subtree;
+}
+
+/* In-order successor (dir 1) or predecessor (dir 0) of @node. */
+static inline rbnode_t *rbnode_step(rbnode_t *node, int dir)
+{
+	if (node->child[dir])
+		return dir ? rbnode_least(node->right) : rbnode_greatest(node->left);
+
+	while (node->parent && node == node->parent->child[dir] && can_loop)
+		node = node->parent;
+
+	return node->parent;
+}
+
+/* Leftmost node with a key of at least @key. */
+static inline rbnode_t *rbnode_lower_bound(rbnode_t *node, u64 key)
+{
+	rbnode_t *bound = NULL;
+
+	while (node && can_loop) {
+		if (node->key >= key) {
+			bound = node;
+			node = node->left;
+		} else {
+			node = node->right;
+		}
+	}
+
+	return bound;
+}
+
+__weak
+u64 rb_first_internal(rbtree_t __arg_arena *rbtree)
+{
+	if (unlikely(!rbtree))
+		return (u64)NULL;
+
+	return (u64)rbtree->leftmost;
+}
+
+__weak
+u64 rb_last_internal(rbtree_t __arg_arena *rbtree)
+{
+	if (unlikely(!rbtree) || !rbtree->root)
+		return (u64)NULL;
+
+	return (u64)rbnode_greatest(rbtree->root);
+}
+
+__weak
+u64 rb_lower_bound_internal(rbtree_t __arg_arena *rbtree, u64 key)
+{
+	if (unlikely(!rbtree))
+		return (u64)NULL;
+
+	return (u64)rbnode_lower_bound(rbtree->root, key);
+}
+
+__weak
+u64 rb_next_internal(rbnode_t __arg_arena *node)
+{
+	if (unlikely(!node))
+		return (u64)NULL;
+
+	return (u64)rbnode_step(node, 1);
+}
+
+__weak
+u64 rb_prev_internal(rbnode_t __arg_arena *node)
+{
+	if (unlikely(!node))
+		return (u64)NULL;
+
+	return (u64)rbnode_step(node, 0);
+}
+
 __weak int rb_least(rbtree_t __arg_arena *rbtree, u64 *key, u64 *value)
 {
 	rbnode_t *least;
 	if (!rbtree->root)
 		return -ENOENT;
 
-	least = rbnode_least(rbtree->root);
+	least = rbtree->leftmost;
 	if (key)
 		*key = least->key;
 	if (value)
@@ -548,6 +656,13 @@ int rb_node_remove(rbtree_t __arg_arena *rbtree, rbnode_t __arg_arena *node, boo
 	bool is_red;
 	int dir;
 
+	/*
+	 * The leftmost node has no left child, so it is never switched below
+	 * and its successor can be found before it is unlinked.
+	 */
+	if (node == rbtree->leftmost)
+		rbtree->leftmost = rbnode_step(node, 1);
+
 	/* Both children present, replace with next largest key. */
 	if (node->left && node->right) {
 		/*
@@ -761,11 +876,8 @@ int rb_pop(rbtree_t __arg_arena *rbtree, u64 *key, u64 *value)
 	if (unlikely(!rbtree))
 		return -EINVAL;
 
-	if (!rbtree->root)
-		return -ENOENT;
-
-	node = rbnode_least(rbtree->root);
-	if (unlikely(!node))
+	node = rbtree->leftmost;
+	if (!node)
 		return -ENOENT;
 
 	if (key)
@@ -773,7 +885,75 @@ int rb_pop(rbtree_t __arg_arena *rbtree, u64 *key, u64 *value)
 	if (value)
 		*value = node->value;
 
-	return rb_remove_node(rbtree, node);
+	/* Recycle the node if the tree allocated it. */
+	return rb_node_remove(rbtree, node, rbtree->alloc == RB_ALLOC);
+}
+
+/*
+ * Pop up to @n (at most RB_BATCH_MAX) of the lowest keys into @batch. Returns
+ * the number of pairs popped, 0 if the tree is empty.
+ */
+__weak
+int rb_pop_n(rbtree_t __arg_arena *rbtree, u64 n, struct rb_batch *batch)
+{
+	rbnode_t *node;
+	int ret, i;
+
+	if (unlikely(!rbtree || !batch))
+		return -EINVAL;
+
+	batch->nr = 0;
+
+	bpf_for(i, 0, RB_BATCH_MAX) {
+		if (i >= n)
+			break;
+
+		node = rbtree->leftmost;
+		if (!node)
+			break;
+
+		batch->keys[i] = node->key;
+		batch->values[i] = node->value;
+		batch->nr = i + 1;
+
+		ret = rb_node_remove(rbtree, node, rbtree->alloc == RB_ALLOC);
+		if (ret)
+			return ret;
+	}
+
+	return batch->nr;
+}
+
+/*
+ * Copy the pairs with keys in [@lo, @hi) into @batch without removing them.
+ * Returns the number of pairs copied. A full batch may mean there are more,
+ * continue from rb_lower_bound() and rb_next() in that case.
+ */
+__weak
+int rb_range(rbtree_t __arg_arena *rbtree, u64 lo, u64 hi, struct rb_batch *batch)
+{
+	rbnode_t *node;
+	int i;
+
+	if (unlikely(!rbtree || !batch))
+		return -EINVAL;
+
+	batch->nr = 0;
+
+	node = rbnode_lower_bound(rbtree->root, lo);
+
+	bpf_for(i, 0, RB_BATCH_MAX) {
+		if (!node || node->key >= hi)
+			break;
+
+		batch->keys[i] = node->key;
+		batch->values[i] = node->value;
+		batch->nr = i + 1;
+
+		node = rbnode_step(node, 1);
+	}
+
+	return batch->nr;
 }
 
 inline void rbnode_print(size_t depth, rbnode_t *rbn)
@@ -928,8 +1108,19 @@ int rb_integrity_check(rbtree_t __arg_arena *rbtree)
 	if (unlikely(!rbtree))
 		return -EINVAL;
 
-	if (!rbtree->root)
+	if (!rbtree->root) {
+		if (rbtree->leftmost) {
+			bpf_printk("WARNING: Inconsistent tree. Empty tree has leftmost node %p", rbtree->leftmost);
+			return -EINVAL;
+		}
 		return 0;
+	}
+
+	if (rbtree->leftmost != rbnode_least(rbtree->root)) {
+		bpf_printk("WARNING: Inconsistent tree. Cached leftmost %p is not the least node %p",
+			   rbtree->leftmost, rbnode_least(rbtree->root));
+		return -EINVAL;
+	}
 
 	depth = 0;
 	state = RB_NONE_VISITED;
@@ -10,6 +10,7 @@
 #include <lib/arena_map.h>
 #include <lib/sdt_task.h>
 #include <scx/arena_userspace_interrop.bpf.h>
+#include <scx/bpf_atomic.h>
 
 struct scx_alloc_stack __arena *prealloc_stack;
 
@@ -56,6 +57,16 @@ struct sdt_pool chunk_pool;
 /* Protected by alloc_lock. */
 struct scx_alloc_stats alloc_stats;
 
+/* Per-CPU magazines, indexed by scx_allocator.mag_id. */
+struct {
+	__uint(type, BPF_MAP_TYPE_PERCPU_ARRAY);
+	__uint(max_entries, SDT_TASK_MAG_MAX_ALLOCATORS);
+	__type(key, __u32);
+	__type(value, struct scx_alloc_mag);
+} scx_alloc_mags SEC(".maps");
+
+static __u32 scx_alloc_nr_mags;
+
 static
 u64 scx_next_pow2(__u64 n)
 {
@@ -302,6 +313,9 @@ scx_alloc_init(struct scx_allocator *alloc, __u64 data_size)
 
 	bpf_spin_unlock(&alloc_lock);
 
+	/* Allocators past the magazine limit always go to the tree. */
+	alloc->mag_id = __sync_fetch_and_add(&scx_alloc_nr_mags, 1);
+
 	return 0;
 }
 
@@ -350,80 +364,228 @@ int mark_nodes_avail(sdt_desc_t *lv_desc[SDT_TASK_LEVELS], __u64 lv_pos[SDT_TASK
 	return 0;
 }
 
-__weak
-int scx_alloc_free_idx(struct scx_allocator *alloc, __u64 idx)
+/*
+ * Walk the tree down to the leaf descriptor of @idx, logging the descriptor
+ * and position at every level. The path of an allocated index never changes,
+ * so this is safe without the lock as long as the caller owns @idx.
+ */
+static __noinline
+sdt_desc_t *desc_walk(sdt_desc_t *desc, __u64 idx,
+	sdt_desc_t *lv_desc[SDT_TASK_LEVELS], __u64 lv_pos[SDT_TASK_LEVELS])
 {
 	const __u64 mask = (1 << SDT_TASK_ENTS_PER_PAGE_SHIFT) - 1;
-	sdt_desc_t *lv_desc[SDT_TASK_LEVELS];
 	sdt_desc_t * __arena *desc_children;
 	struct sdt_chunk __arena *chunk;
-	sdt_desc_t *desc;
-	struct sdt_data __arena *data;
 	__u64 level, shift, pos;
-	__u64 lv_pos[SDT_TASK_LEVELS];
-	int ret;
-	int i;
 
-	scx_arena_subprog_init();
+	if (unlikely(!desc))
+		return NULL;
 
-	if (!alloc)
-		return 0;
+	for (level = zero; level < SDT_TASK_LEVELS && can_loop; level++) {
+		shift = (SDT_TASK_LEVELS - 1 - level) * SDT_TASK_ENTS_PER_PAGE_SHIFT;
+		pos = (idx >> shift) & mask;
 
-	bpf_spin_lock(&alloc_lock);
+		lv_desc[level] = desc;
+		lv_pos[level] = pos;
 
-	desc = alloc->root;
-	if (unlikely(!desc)) {
-		bpf_spin_unlock(&alloc_lock);
-		bpf_printk("%s: root not allocated", __func__);
-		return -EINVAL;
+		if (level == SDT_TASK_LEVELS - 1)
+			break;
+
+		chunk = desc->chunk;
+
+		desc_children = (sdt_desc_t * __arena *)chunk->descs;
+		desc = desc_children[pos];
+
+		if (unlikely(!desc))
+			return NULL;
 	}
 
+	return desc;
+}
+
+/* Return @idx to the tree. Called with the alloc spinlock held. */
+static int scx_alloc_release_idx(struct scx_allocator *alloc, __u64 idx)
+{
+	sdt_desc_t *lv_desc[SDT_TASK_LEVELS];
+	__u64 lv_pos[SDT_TASK_LEVELS];
+	__u64 level;
+
 	/* To appease the verifier. */
 	for (level = zero; level < SDT_TASK_LEVELS && can_loop; level++) {
 		lv_desc[level] = NULL;
 		lv_pos[level] = 0;
 	}
 
+	if (unlikely(!desc_walk(alloc->root, idx, lv_desc, lv_pos)))
+		return -EINVAL;
+
+	return mark_nodes_avail(lv_desc, lv_pos);
+}
+
+/* Find the data of allocated @idx. */
+static struct sdt_data __arena *scx_alloc_lookup(struct scx_allocator *alloc, __u64 idx)
+{
+	sdt_desc_t *lv_desc[SDT_TASK_LEVELS];
+	__u64 lv_pos[SDT_TASK_LEVELS];
+	struct sdt_chunk __arena *chunk;
+	sdt_desc_t *desc;
+	__u64 level;
+
 	for (level = zero; level < SDT_TASK_LEVELS && can_loop; level++) {
-		shift = (SDT_TASK_LEVELS - 1 - level) * SDT_TASK_ENTS_PER_PAGE_SHIFT;
-		pos = (idx >> shift) & mask;
+		lv_desc[level] = NULL;
+		lv_pos[level] = 0;
+	}
 
-		lv_desc[level] = desc;
-		lv_pos[level] = pos;
+	desc = desc_walk(alloc->root, idx, lv_desc, lv_pos);
+	if (unlikely(!desc))
+		return NULL;
 
-		if (level == SDT_TASK_LEVELS - 1)
+	chunk = desc->chunk;
+
+	return chunk->data[idx & (SDT_TASK_ENTS_PER_CHUNK - 1)];
+}
+
+/* Bump the generation of freed @data and zero out its payload. */
+static void scx_alloc_data_reset(struct scx_allocator *alloc, struct sdt_data __arena *data)
+{
+	__u64 nr_words = (alloc->pool.elem_size - sizeof(*data)) / 8;
+	int i;
+
+	data->tid.genn += 1;
+
+	/* Zero out one word at a time. */
+	for (i = zero; i < nr_words && can_loop; i++)
+		data->payload[i] = 0;
+}
+
+/*
+ * Claim this CPU's magazine for @alloc. A sleepable caller preempted on this
+ * CPU may still hold it, in which case we go straight to the tree.
+ */
+static struct scx_alloc_mag *scx_alloc_mag_get(struct scx_allocator *alloc)
+{
+	struct scx_alloc_mag *mag;
+	__u32 key = alloc->mag_id;
+
+	if (key >= SDT_TASK_MAG_MAX_ALLOCATORS)
+		return NULL;
+
+	mag = bpf_map_lookup_elem(&scx_alloc_mags, &key);
+	if (!mag)
+		return NULL;
+
+	if (cmpxchg(&mag->busy, 0, 1) != 0)
+		return NULL;
+
+	return mag;
+}
+
+static void scx_alloc_mag_put(struct scx_alloc_mag *mag)
+{
+	smp_store_release(&mag->busy, 0);
+}
+
+/* Called with the alloc spinlock held. */
+static void scx_alloc_mag_fold_stats(struct scx_alloc_mag *mag)
+{
+	alloc_stats.mag_hits += mag->nr_hits;
+	alloc_stats.mag_misses += mag->nr_misses;
+
+	/* Misses are accounted for by the slow path. */
+	alloc_stats.alloc_ops += mag->nr_hits;
+	alloc_stats.free_ops += mag->nr_frees;
+	alloc_stats.active_allocs += mag->nr_hits;
+	alloc_stats.active_allocs -= mag->nr_frees;
+
+	mag->nr_hits = 0;
+	mag->nr_misses = 0;
+	mag->nr_frees = 0;
+}
+
+/*
+ * Return the oldest SDT_TASK_MAG_BATCH entries of a full magazine to the tree.
+ * Stops at the first entry that can't be released, which stays in the
+ * magazine along with everything after it.
+ */
+static int scx_alloc_mag_flush(struct scx_allocator *alloc, struct scx_alloc_mag *mag)
+{
+	struct sdt_data __arena *data;
+	int nr_released;
+	int ret = 0;
+	int i;
+
+	bpf_spin_lock(&alloc_lock);
+
+	for (i = zero; i < SDT_TASK_MAG_BATCH && can_loop; i++) {
+		data = mag->data[i & (SDT_TASK_MAG_SIZE - 1)];
+		ret = scx_alloc_release_idx(alloc, data->tid.idx);
+		if (unlikely(ret != 0))
 			break;
+	}
+	nr_released = i;
 
-		chunk = desc->chunk;
+	scx_alloc_mag_fold_stats(mag);
+	alloc_stats.mag_flushes += 1;
+	if (unlikely(ret))
+		alloc_stats.mag_flush_errors += 1;
 
-		desc_children = (sdt_desc_t * __arena *)chunk->descs;
-		desc = desc_children[pos];
+	bpf_spin_unlock(&alloc_lock);
 
-		if (unlikely(!desc)) {
-			bpf_spin_unlock(&alloc_lock);
-			bpf_printk("%s: freeing nonexistent idx [0x%llx] (level %llu)",
-				__func__, idx, level);
-			return -EINVAL;
-		}
+	/* Slide the entries that are left down. */
+	for (i = zero; i < SDT_TASK_MAG_SIZE - nr_released && can_loop; i++)
+		mag->data[i & (SDT_TASK_MAG_SIZE - 1)] =
+			mag->data[(i + nr_released) & (SDT_TASK_MAG_SIZE - 1)];
+
+	mag->nr = SDT_TASK_MAG_SIZE - nr_released;
+
+	return ret;
+}
+
+__weak
+int scx_alloc_free_idx(struct scx_allocator *alloc, __u64 idx)
+{
+	struct sdt_data __arena *data;
+	struct scx_alloc_mag *mag;
+	int ret;
+
+	scx_arena_subprog_init();
+
+	if (!alloc)
+		return 0;
+
+	data = scx_alloc_lookup(alloc, idx);
+	if (unlikely(!data)) {
+		bpf_printk("%s: freeing nonexistent idx [0x%llx]", __func__, idx);
+		return -EINVAL;
 	}
 
-	chunk = desc->chunk;
+	scx_alloc_data_reset(alloc, data);
 
-	pos = idx & mask;
-	data = chunk->data[pos];
-	if (likely(!data)) {
+	mag = scx_alloc_mag_get(alloc);
+	if (likely(mag)) {
+		/*
+		 * A failed flush is counted in mag_flush_errors. It's not an
+		 * error for this free, which either lands in the magazine or,
+		 * if the flush left no room, goes straight to the tree.
+		 */
+		if (mag->nr >= SDT_TASK_MAG_SIZE)
+			scx_alloc_mag_flush(alloc, mag);
 
-		data[pos] = (struct sdt_data) {
-			.tid.genn = data->tid.genn + 1,
-		};
+		if (mag->nr < SDT_TASK_MAG_SIZE) {
+			mag->data[mag->nr & (SDT_TASK_MAG_SIZE - 1)] = data;
+			mag->nr += 1;
+			mag->nr_frees += 1;
 
-		/* Zero out one word at a time. */
-		for (i = zero; i < alloc->pool.elem_size / 8 && can_loop; i++) {
-			data->payload[i] = 0;
+			scx_alloc_mag_put(mag);
+			return 0;
 		}
+
+		scx_alloc_mag_put(mag);
 	}
 
-	ret = mark_nodes_avail(lv_desc, lv_pos);
+	bpf_spin_lock(&alloc_lock);
+
+	ret = scx_alloc_release_idx(alloc, idx);
 	if (unlikely(ret != 0)) {
 		bpf_spin_unlock(&alloc_lock);
 		return ret;
@@ -503,7 +665,37 @@ static sdt_desc_t * desc_find_empty(sdt_desc_t *desc,
 	return desc;
 }
 
-static void scx_alloc_finish(struct sdt_data __arena *data, __u64 idx)
+/* Back the freshly allocated @idx under leaf @desc with data. */
+static struct sdt_data __arena *scx_alloc_populate(struct scx_allocator *alloc,
+	sdt_desc_t *desc, __u64 idx)
+{
+	struct sdt_data __arena *data;
+	struct sdt_chunk __arena *chunk;
+	__u64 pos;
+
+	chunk = desc->chunk;
+
+	/* Populate the leaf node if necessary. */
+	pos = idx & (SDT_TASK_ENTS_PER_CHUNK - 1);
+	data = chunk->data[pos];
+	if (!data) {
+		data = scx_alloc_from_pool_sleepable(&alloc->pool);
+		if (!data) {
+			bpf_spin_lock(&alloc_lock);
+			scx_alloc_release_idx(alloc, idx);
+			bpf_spin_unlock(&alloc_lock);
+			bpf_printk("%s: failed to allocate data from pool", __func__);
+			return NULL;
+		}
+	}
+
+	chunk->data[pos] = data;
+	data->tid.idx = idx;
+
+	return data;
+}
+
+static void scx_alloc_finish(void)
 {
 	bpf_spin_lock(&alloc_lock);
 
@@ -513,22 +705,23 @@ static void scx_alloc_finish(struct sdt_data __arena *data, __u64 idx)
 	alloc_stats.active_allocs += 1;
 
 	bpf_spin_unlock(&alloc_lock);
-
-	data->tid.idx = idx;
 }
 
-__hidden
-u64 scx_alloc_internal(struct scx_allocator *alloc)
+/*
+ * Allocate from the tree. If @mag is non-NULL, also refill it with up to
+ * SDT_TASK_MAG_BATCH more entries in the same lock acquisition, as long as
+ * the preallocated stack can back them without dropping the lock.
+ */
+static u64 scx_alloc_slow(struct scx_allocator *alloc, struct scx_alloc_mag *mag)
 {
 	struct scx_alloc_stack __arena *stack = prealloc_stack;
-	struct sdt_data __arena *data = NULL;
-	struct sdt_chunk __arena *chunk;
-	sdt_desc_t *desc;
-	__u64 idx, pos;
-	int ret;
-
-	if (!alloc)
-		return (u64)NULL;
+	sdt_desc_t *refill_desc[SDT_TASK_MAG_BATCH];
+	__u64 refill_idx[SDT_TASK_MAG_BATCH];
+	struct sdt_data __arena *data;
+	sdt_desc_t *desc, *next;
+	__u64 idx, next_idx;
+	int nr_refill = 0;
+	int ret, i;
 
 	/* On success, call returns with the lock taken. */
 	ret = scx_alloc_attempt(stack);
@@ -538,6 +731,25 @@ u64 scx_alloc_internal(struct scx_allocator *alloc)
 	/* We unlock if we encounter an error in the function. */
 	desc = desc_find_empty(alloc->root, stack, &idx);
 
+	if (mag && desc) {
+		for (i = zero; i < SDT_TASK_MAG_BATCH && can_loop; i++) {
+			if (stack->idx < SDT_TASK_ALLOC_STACK_MIN)
+				break;
+
+			next = desc_find_empty(alloc->root, stack, &next_idx);
+			if (!next)
+				break;
+
+			refill_desc[i] = next;
+			refill_idx[i] = next_idx;
+			nr_refill = i + 1;
+		}
+
+		scx_alloc_mag_fold_stats(mag);
+		if (nr_refill)
+			alloc_stats.mag_refills += 1;
+	}
+
 	bpf_spin_unlock(&alloc_lock);
 
 	if (unlikely(desc == NULL)) {
@@ -545,27 +757,59 @@ u64 scx_alloc_internal(struct scx_allocator *alloc)
 		return (u64)NULL;
 	}
 
-	chunk = desc->chunk;
+	/* The magazine is empty, so the refill always fits. */
+	for (i = zero; i < nr_refill && i < SDT_TASK_MAG_BATCH && can_loop; i++) {
+		if (!mag)
+			break;
 
-	/* Populate the leaf node if necessary. */
-	pos = idx & (SDT_TASK_ENTS_PER_CHUNK - 1);
-	data = chunk->data[pos];
-	if (!data) {
-		data = scx_alloc_from_pool_sleepable(&alloc->pool);
-		if (!data) {
-			scx_alloc_free_idx(alloc, idx);
-			bpf_printk("%s: failed to allocate data from pool", __func__);
-			return (u64)NULL;
-		}
+		data = scx_alloc_populate(alloc, refill_desc[i], refill_idx[i]);
+		if (!data)
+			continue;
+
+		mag->data[mag->nr & (SDT_TASK_MAG_SIZE - 1)] = data;
+		mag->nr += 1;
 	}
 
-	chunk->data[pos] = data;
+	data = scx_alloc_populate(alloc, desc, idx);
+	if (!data)
+		return (u64)NULL;
 
-	scx_alloc_finish(data, idx);
+	scx_alloc_finish();
 
 	return (u64)data;
 }
 
+__hidden
+u64 scx_alloc_internal(struct scx_allocator *alloc)
+{
+	struct sdt_data __arena *data;
+	struct scx_alloc_mag *mag;
+	u64 ret;
+
+	if (!alloc)
+		return (u64)NULL;
+
+	mag = scx_alloc_mag_get(alloc);
+	if (!mag)
+		return scx_alloc_slow(alloc, NULL);
+
+	if (likely(mag->nr > 0)) {
+		mag->nr -= 1;
+		data = mag->data[mag->nr & (SDT_TASK_MAG_SIZE - 1)];
+		mag->nr_hits += 1;
+
+		scx_alloc_mag_put(mag);
+		return (u64)data;
+	}
+
+	mag->nr_misses += 1;
+	ret = scx_alloc_slow(alloc, mag);
+
+	scx_alloc_mag_put(mag);
+
+	return ret;
+}
+
 
 /*
  * Static allocation module used to allocate arena memory for
@@ -989,25 +1233,35 @@ __u64 scx_stk_alloc(struct scx_stk *stack)
 	return (u64)elem;
 }
 
+/*
+ * Buddy allocator. Chunks of SCX_BUDDY_CHUNK_PAGES pages are carved into
+ * power-of-two blocks of SCX_BUDDY_MIN_ALLOC_BYTES << order bytes. Each chunk
+ * starts with its own metadata: the order of every block, a bitmap of the
+ * blocks that are free, and per-order doubly linked free lists threaded
+ * through the free blocks themselves.
+ *
+ * The helpers below run under the buddy spinlock, so they must not call any
+ * helpers or kfuncs, including bpf_printk().
+ */
+
 static
 int header_set_order(scx_buddy_chunk_t *chunk, u64 offset, u8 order)
 {
-	if (order >= SCX_BUDDY_CHUNK_MAX_ORDER) {
-		bpf_printk("setting invalid order");
+	u8 cur;
+
+	if (order >= SCX_BUDDY_CHUNK_MAX_ORDER)
 		return -EINVAL;
-	}
 
-	if (offset >= SCX_BUDDY_CHUNK_ITEMS) {
-		bpf_printk("setting order of invalid offset");
+	if (offset >= SCX_BUDDY_CHUNK_ITEMS)
 		return -EINVAL;
-	}
 
+	cur = chunk->orders[offset / 2];
 	if (offset & 0x1)
-		order &= 0xf;
+		cur = (cur & 0xf0) | order;
 	else
-		order <<= 4;
+		cur = (cur & 0x0f) | (order << 4);
 
-	chunk->orders[offset / 2] |= order;
+	chunk->orders[offset / 2] = cur;
 
 	return 0;
 }
@@ -1019,23 +1273,41 @@ u8 header_get_order(scx_buddy_chunk_t *chunk, u64 offset)
 
 	_Static_assert(SCX_BUDDY_CHUNK_MAX_ORDER <= 16, "order must fit in 4 bits");
 
-	if (offset >= SCX_BUDDY_CHUNK_ITEMS) {
-		bpf_printk("setting order of invalid offset");
+	if (offset >= SCX_BUDDY_CHUNK_ITEMS)
 		return SCX_BUDDY_CHUNK_MAX_ORDER;
-	}
 
 	result = chunk->orders[offset / 2];
 
 	return (offset & 0x1) ? (result & 0xf) : (result >> 4);
 }
 
+static
+bool chunk_idx_is_free(scx_buddy_chunk_t *chunk, u64 idx)
+{
+	if (idx >= SCX_BUDDY_CHUNK_ITEMS)
+		return false;
+
+	return chunk->free[idx / 64] & (1ULL << (idx % 64));
+}
+
+static
+void chunk_idx_set_free(scx_buddy_chunk_t *chunk, u64 idx, bool free)
+{
+	if (idx >= SCX_BUDDY_CHUNK_ITEMS)
+		return;
+
+	if (free)
+		chunk->free[idx / 64] |= 1ULL << (idx % 64);
+	else
+		chunk->free[idx / 64] &= ~(1ULL << (idx % 64));
+}
+
 static
 u64 size_to_order(size_t size)
 {
 	u64 order;
 
 	if (unlikely(!size)) {
-		bpf_printk("size 0 has no order");
 		bpf_printk("size 0 has no order");
 		return 64;
 	}
@@ -1078,79 +1350,98 @@ scx_buddy_header_t *chunk_get_header(scx_buddy_chunk_t *chunk, size_t idx)
 	return (scx_buddy_header_t *)chunk_idx_to_mem(chunk, idx);
 }
 
+/* Add the free block at @idx to the @order free list. */
 static
-scx_buddy_chunk_t *scx_buddy_chunk_get(struct scx_stk *stk)
+int chunk_list_push(scx_buddy_chunk_t *chunk, u64 order, u64 idx)
 {
-	u64 order, ord, last_order;
-	scx_buddy_header_t *header;
-	scx_buddy_chunk_t *chunk;
-	u32 idx, cur_idx;
-	int i, power2;
-	size_t left;
+	scx_buddy_header_t *header, *next;
+	u64 head;
 
-	chunk = (scx_buddy_chunk_t *)scx_stk_alloc(stk);
-	if (!chunk)
-		return NULL;
+	if (order >= SCX_BUDDY_CHUNK_MAX_ORDER || idx >= SCX_BUDDY_CHUNK_ITEMS)
+		return -EINVAL;
 
-	/*
-	 * Initialize the chunk by carving out the first page to hold the metadata struct above,
-	 * then dumping the rest of the pages into the allocator.
-	 */
+	head = chunk->order_indices[order];
 
-	bpf_for (i, 0, SCX_BUDDY_CHUNK_ITEMS) {
-		header = chunk_get_header(chunk, i);
-		header->prev_index = SCX_BUDDY_CHUNK_ITEMS;
-		header->next_index = SCX_BUDDY_CHUNK_ITEMS;
-		if (header_set_order(chunk, i, SCX_BUDDY_CHUNK_MAX_ORDER))
-			return NULL;
+	header = chunk_get_header(chunk, idx);
+	header->prev_index = SCX_BUDDY_CHUNK_ITEMS;
+	header->next_index = head;
+
+	if (head != SCX_BUDDY_CHUNK_ITEMS) {
+		next = chunk_get_header(chunk, head);
+		next->prev_index = idx;
 	}
 
-	_Static_assert(SCX_BUDDY_CHUNK_PAGES * PAGE_SIZE >= SCX_BUDDY_MIN_ALLOC_BYTES * SCX_BUDDY_CHUNK_ITEMS,
-		"chunk must fit within the stack allocation");
+	chunk->order_indices[order] = idx;
+	chunk_idx_set_free(chunk, idx, true);
 
-	/*
-	 * This reserves a chunk for the chunk metadata, then breaks
-	 * the rest of the full allocation into the different buckets.
-	 * We allocating the memory by grabbing blocks of progressively
-	 * smaller sizes from the allocator, which are guaranteed to be
-	 * continuous.
-	 *
-	 * This operation also populates the allocator.
-	 */
-	last_order = SCX_BUDDY_CHUNK_MAX_ORDER;
-	left = sizeof(*chunk);
-	cur_idx = 0;
-	while(left && can_loop) {
-		power2 = scx_ffs(left);
-		if (unlikely(power2 >= SCX_BUDDY_CHUNK_MAX_ORDER)) {
-			bpf_printk("buddy chunk metadata require allocation of order %d", power2);
-			return NULL;
-		}
+	return header_set_order(chunk, idx, order);
+}
 
-		/* Round up allocations that are too small. */
-		if (power2 < SCX_BUDDY_MIN_ALLOC_SHIFT) {
-			order = 0;
-			left = 0;
-		} else {
-			order = power2 - SCX_BUDDY_MIN_ALLOC_SHIFT;
-			left -= 1 << power2;
-		}
+/* Take the free block at @idx off the @order free list. */
+static
+int chunk_list_remove(scx_buddy_chunk_t *chunk, u64 order, u64 idx)
+{
+	scx_buddy_header_t *header, *tmp;
+
+	if (order >= SCX_BUDDY_CHUNK_MAX_ORDER || idx >= SCX_BUDDY_CHUNK_ITEMS)
+		return -EINVAL;
 
-		idx = cur_idx;
-		bpf_for (ord, order, last_order) {
-			/* Skip to the buddy. */
-			idx += 1 << ord;
+	header = chunk_get_header(chunk, idx);
+
+	if (header->prev_index != SCX_BUDDY_CHUNK_ITEMS) {
+		tmp = chunk_get_header(chunk, header->prev_index);
+		tmp->next_index = header->next_index;
+	} else {
+		chunk->order_indices[order] = header->next_index;
+	}
+
+	if (header->next_index != SCX_BUDDY_CHUNK_ITEMS) {
+		tmp = chunk_get_header(chunk, header->next_index);
+		tmp->prev_index = header->prev_index;
+	}
 
-			/* Mark it free. */
-			chunk->order_indices[ord] = idx;
-			if (header_set_order(chunk, idx, ord))
-				return NULL;
+	header->prev_index = SCX_BUDDY_CHUNK_ITEMS;
+	header->next_index = SCX_BUDDY_CHUNK_ITEMS;
+	chunk_idx_set_free(chunk, idx, false);
+
+	return 0;
+}
+
+/* Get a new chunk from the arena. Must be called without the buddy lock. */
+static
+scx_buddy_chunk_t *scx_buddy_chunk_get(void)
+{
+	scx_buddy_chunk_t *chunk;
+	u64 order, idx;
+
+	chunk = bpf_arena_alloc_pages(&arena, NULL, SCX_BUDDY_CHUNK_PAGES, NUMA_NO_NODE, 0);
+	if (!chunk)
+		return NULL;
+
+	/* Fresh arena pages are zeroed, so no block is marked free yet. */
+	bpf_for(order, 0, SCX_BUDDY_CHUNK_MAX_ORDER)
+		chunk->order_indices[order] = SCX_BUDDY_CHUNK_ITEMS;
+
+	/*
+	 * Reserve the blocks holding the chunk metadata, then release the
+	 * rest of the chunk as the largest naturally aligned blocks that fit.
+	 */
+	idx = div_round_up(sizeof(*chunk), SCX_BUDDY_MIN_ALLOC_BYTES);
+	while (idx < SCX_BUDDY_CHUNK_ITEMS && can_loop) {
+		order = scx_ffs(idx);
+		if (order >= SCX_BUDDY_CHUNK_MAX_ORDER)
+			order = SCX_BUDDY_CHUNK_MAX_ORDER - 1;
+
+		if (chunk_list_push(chunk, order, idx)) {
+			bpf_arena_free_pages(&arena, chunk, SCX_BUDDY_CHUNK_PAGES);
+			return NULL;
 		}
 
-		/* Adjust the index. */
-		cur_idx += 1 << order;
+		idx += 1 << order;
 	}
 
+	chunk->nr_used_items = 0;
+
 	return chunk;
 }
 
@@ -1158,7 +1449,6 @@ __hidden
 int scx_buddy_init(struct scx_buddy *buddy, size_t size)
 {
 	scx_buddy_chunk_t *chunk;
-	int ret;
 
 	/* Set a minimum allocation size. */
 	if (size < SCX_BUDDY_MIN_ALLOC_BYTES)
@@ -1168,104 +1458,103 @@ int scx_buddy_init(struct scx_buddy *buddy, size_t size)
 	if (buddy->min_alloc_bytes)
 		return -EALREADY;
 
-	buddy->min_alloc_bytes = size;
-
 	_Static_assert(SCX_BUDDY_CHUNK_PAGES > 0, "chunk must use one or more pages");
+	_Static_assert(sizeof(struct scx_buddy_chunk) < SCX_BUDDY_CHUNK_PAGES * PAGE_SIZE / 2,
+		"chunk metadata must leave room for allocations");
 
-	/* One allocation per chunk. */
-	ret = scx_stk_init(&buddy->stack, SCX_BUDDY_CHUNK_PAGES * PAGE_SIZE, SCX_BUDDY_CHUNK_PAGES);
-	if (ret) {
-		buddy->min_alloc_bytes = 0;
-		return ret;
-	}
+	chunk = scx_buddy_chunk_get();
+	if (!chunk)
+		return -ENOMEM;
 
-	chunk = scx_buddy_chunk_get(&buddy->stack);
+	bpf_spin_lock(&buddy->lock);
 
-	if (chunk) {
-		/* Put the chunk at the beginning of the list. */
-		chunk->next = buddy->first_chunk;
-		chunk->prev = NULL;
-		buddy->first_chunk = chunk;
-	} else {
-		/* Mark as uninitialized. */
-		buddy->min_alloc_bytes = 0;
-		buddy->first_chunk = NULL;
-	}
+	chunk->next = NULL;
+	chunk->prev = NULL;
+	buddy->first_chunk = chunk;
+	buddy->min_alloc_bytes = size;
+	buddy->nr_chunks = 1;
+	buddy->nr_allocs = 0;
+	buddy->bytes_used = 0;
 
-	return chunk ? 0 : -ENOMEM;
+	bpf_spin_unlock(&buddy->lock);
+
+	return 0;
 }
 
-__weak
-u64 scx_buddy_chunk_alloc(scx_buddy_chunk_t *chunk, int order_req)
+/* Called with the buddy lock held. */
+static
+u64 scx_buddy_chunk_alloc(scx_buddy_chunk_t *chunk, u64 order_req)
 {
-	scx_buddy_header_t *header;
-	u64 address;
-	u64 order = 0;
-	u32 idx;
+	u64 order, idx;
 
-	bpf_for(order, order_req, SCX_BUDDY_CHUNK_MAX_ORDER) {
+	for (order = order_req; order < SCX_BUDDY_CHUNK_MAX_ORDER && can_loop; order++) {
 		if (chunk->order_indices[order] != SCX_BUDDY_CHUNK_ITEMS)
 			break;
 	}
 
-	if (order == SCX_BUDDY_CHUNK_MAX_ORDER)
+	if (order >= SCX_BUDDY_CHUNK_MAX_ORDER)
 		return (u64)NULL;
 
 	idx = chunk->order_indices[order];
-	header = chunk_get_header(chunk, idx);
-	chunk->order_indices[order] = header->next_index;
-
-	header->prev_index = SCX_BUDDY_CHUNK_ITEMS;
-	header->next_index = SCX_BUDDY_CHUNK_ITEMS;
-	if (header_set_order(chunk, idx, order_req))
+	if (chunk_list_remove(chunk, order, idx))
 		return (u64)NULL;
 
-	address = (u64)chunk_idx_to_mem(chunk, idx);
-
-	/* If we allocated from a larger-order chunk, split the buddies. */
-	bpf_for(order, order_req, order) {
-		/* Flip the bit for the current order. */
-		idx ^= 1 << order;
-
-		/* Add the buddy of the allocation to the free list. */
-		header = chunk_get_header(chunk, idx);
-		if (header_set_order(chunk, idx, order))
+	/* If we allocated from a larger block, give back the upper halves. */
+	while (order > order_req && can_loop) {
+		order -= 1;
+		if (chunk_list_push(chunk, order, idx + (1 << order)))
 			return (u64)NULL;
-		header->prev_index = SCX_BUDDY_CHUNK_ITEMS;
-
-		header->next_index = chunk->order_indices[order];
-		chunk->order_indices[order] = idx;
 	}
 
-	return address;
+	if (header_set_order(chunk, idx, order_req))
+		return (u64)NULL;
+
+	chunk->nr_used_items += 1 << order_req;
+
+	return (u64)chunk_idx_to_mem(chunk, idx);
 }
 
 __weak
 u64 scx_buddy_alloc_internal(struct scx_buddy *buddy, size_t size)
 {
 	scx_buddy_chunk_t *chunk;
-	u64 address;
-	int order;
+	u64 address = (u64)NULL;
+	u64 order;
+
+	if (unlikely(!buddy->min_alloc_bytes)) {
+		bpf_printk("using uninitialized buddy allocator");
+		return (u64)NULL;
+	}
+
+	if (size < buddy->min_alloc_bytes)
+		size = buddy->min_alloc_bytes;
 
 	order = size_to_order(size);
-	if (order >= SCX_BUDDY_CHUNK_MAX_ORDER - 1) {
+	if (order >= SCX_BUDDY_CHUNK_MAX_ORDER) {
 		bpf_printk("Allocation size %lu too large", size);
 		return (u64)NULL;
 	}
 
 	bpf_spin_lock(&buddy->lock);
-	chunk = buddy->first_chunk;
-	do {
+
+	for (chunk = buddy->first_chunk; chunk && can_loop; chunk = chunk->next) {
 		address = scx_buddy_chunk_alloc(chunk, order);
-		chunk = chunk->next;
-	} while (address == (u64)NULL && can_loop);
+		if (address)
+			break;
+	}
+
+	if (address) {
+		buddy->nr_allocs += 1;
+		buddy->bytes_used += SCX_BUDDY_MIN_ALLOC_BYTES << order;
+	}
+
 	bpf_spin_unlock(&buddy->lock);
 
 	if (address)
 		return address;
 
 	/* Get a new chunk. */
-	chunk = scx_buddy_chunk_get(&buddy->stack);
+	chunk = scx_buddy_chunk_get();
 	if (!chunk)
 		return (u64)NULL;
 
@@ -1274,9 +1563,16 @@ u64 scx_buddy_alloc_internal(struct scx_buddy *buddy, size_t size)
 	/* Add the chunk into the allocator and retry. */
 	chunk->next = buddy->first_chunk;
 	chunk->prev = NULL;
+	if (buddy->first_chunk)
+		buddy->first_chunk->prev = chunk;
 	buddy->first_chunk = chunk;
+	buddy->nr_chunks += 1;
 
-	address = scx_buddy_chunk_alloc(buddy->first_chunk, order);
+	address = scx_buddy_chunk_alloc(chunk, order);
+	if (address) {
+		buddy->nr_allocs += 1;
+		buddy->bytes_used += SCX_BUDDY_MIN_ALLOC_BYTES << order;
+	}
 
 	bpf_spin_unlock(&buddy->lock);
 
@@ -1286,10 +1582,12 @@ u64 scx_buddy_alloc_internal(struct scx_buddy *buddy, size_t size)
 __weak
 void scx_buddy_free_internal(struct scx_buddy *buddy, u64 addr)
 {
-	scx_buddy_header_t *header, *buddy_header, *tmp_header;
-	scx_buddy_chunk_t *chunk, *target_chunk;
-	u64 idx, buddy_idx;
-	u8 order;
+	const u64 chunk_bytes = SCX_BUDDY_CHUNK_PAGES * PAGE_SIZE;
+	scx_buddy_chunk_t *chunk, *release = NULL;
+	u64 idx, buddy_idx, order;
+
+	if (!addr)
+		return;
 
 	if (addr & (SCX_BUDDY_MIN_ALLOC_BYTES - 1)) {
 		bpf_printk("Freeing unaligned address %llx", addr);
@@ -1298,12 +1596,9 @@ void scx_buddy_free_internal(struct scx_buddy *buddy, u64 addr)
 
 	bpf_spin_lock(&buddy->lock);
 
-	/* Align to the chunk boundary. */
-	target_chunk = (void __arena *)(addr & ~SCX_BUDDY_CHUNK_OFFSET_MASK);
-
-	/* XXX Only necessary for debugging. */
+	/* Chunks are only page aligned, so search by range. */
 	for (chunk = buddy->first_chunk; chunk != NULL && can_loop; chunk = chunk->next) {
-		if (chunk == target_chunk)
+		if (addr >= (u64)chunk && addr < (u64)chunk + chunk_bytes)
 			break;
 	}
 
@@ -1313,52 +1608,190 @@ void scx_buddy_free_internal(struct scx_buddy *buddy, u64 addr)
 		return;
 	}
 
-	/* Get the page idx. */
-	idx = (addr & SCX_BUDDY_CHUNK_OFFSET_MASK) / SCX_BUDDY_MIN_ALLOC_BYTES;
-	header = chunk_get_header(chunk, idx);
+	idx = (addr - (u64)chunk) / SCX_BUDDY_MIN_ALLOC_BYTES;
+	order = header_get_order(chunk, idx);
+	if (order >= SCX_BUDDY_CHUNK_MAX_ORDER || chunk_idx_is_free(chunk, idx)) {
+		bpf_spin_unlock(&buddy->lock);
+		bpf_printk("invalid free of address %llx", addr);
+		return;
+	}
 
-	bpf_for(order, header_get_order(chunk, idx), SCX_BUDDY_CHUNK_MAX_ORDER) {
-		buddy_idx = idx ^= 1 << order;
-		buddy_header = chunk_get_header(chunk, buddy_idx);
+	chunk->nr_used_items -= 1 << order;
+	buddy->nr_allocs -= 1;
+	buddy->bytes_used -= SCX_BUDDY_MIN_ALLOC_BYTES << order;
 
-		/* Check if the buddy is not in the free list. */
-		if (chunk->order_indices[order] != buddy_idx &&
-		    buddy_header->prev_index == SCX_BUDDY_CHUNK_ITEMS &&
-		    buddy_header->next_index == SCX_BUDDY_CHUNK_ITEMS)
+	/* Merge with the buddy for as long as it is free and whole. */
+	for (; order < SCX_BUDDY_CHUNK_MAX_ORDER - 1 && can_loop; order++) {
+		buddy_idx = idx ^ (1 << order);
+
+		if (!chunk_idx_is_free(chunk, buddy_idx) ||
+		    header_get_order(chunk, buddy_idx) != order)
 			break;
 
-		/* Pop off the list head if necessary. */
-		if (chunk->order_indices[order] == buddy_idx)
-			chunk->order_indices[order] = buddy_header->next_index;
+		if (chunk_list_remove(chunk, order, buddy_idx))
+			break;
 
-		/* Pop */
-		if (buddy_header->prev_index != SCX_BUDDY_CHUNK_ITEMS) {
-			tmp_header = chunk_get_header(chunk, buddy_header->prev_index);
-			tmp_header->next_index = buddy_header->next_index;
-			buddy_header->next_index = SCX_BUDDY_CHUNK_ITEMS;
-		}
+		idx = idx < buddy_idx ? idx : buddy_idx;
+	}
 
-		if (buddy_header->next_index != SCX_BUDDY_CHUNK_ITEMS) {
-			tmp_header = chunk_get_header(chunk, buddy_header->next_index);
-			tmp_header->prev_index = buddy_header->prev_index;
-			buddy_header->prev_index = SCX_BUDDY_CHUNK_ITEMS;
-		}
+	chunk_list_push(chunk, order, idx);
 
-		if (header_set_order(chunk, buddy_idx, SCX_BUDDY_CHUNK_MAX_ORDER))
-			return;
+	/* Give empty chunks back to the arena, but keep one around. */
+	if (!chunk->nr_used_items && buddy->nr_chunks > 1) {
+		if (chunk->prev)
+			chunk->prev->next = chunk->next;
+		else
+			buddy->first_chunk = chunk->next;
 
-		idx = idx < buddy_idx ? idx : buddy_idx;
+		if (chunk->next)
+			chunk->next->prev = chunk->prev;
 
-		header = chunk_get_header(chunk, idx);
-		if (header_set_order(chunk, idx, order + 1))
-			return;
+		buddy->nr_chunks -= 1;
+		release = chunk;
 	}
 
-	order = header_get_order(chunk, idx);
-	header->next_index = chunk->order_indices[order];
-	chunk->order_indices[order] = idx;
-
 	bpf_spin_unlock(&buddy->lock);
+
+	if (release)
+		bpf_arena_free_pages(&arena, release, SCX_BUDDY_CHUNK_PAGES);
+}
+
+/*
+ * Reclaimable allocations for library data structures that are created and
+ * destroyed at runtime (minheaps, ATQs, lvqueues, rbtrees), backed by a
+ * library-wide buddy allocator. Unlike static allocations, the memory goes
+ * back to the buddy allocator when the data structure is destroyed.
+ */
+
+private(SCX_DYN_BUDDY) struct scx_buddy scx_dyn_buddy;
+
+enum scx_dyn_state {
+	SCX_DYN_UNINIT,
+	SCX_DYN_INITING,
+	SCX_DYN_READY,
+};
+
+static u32 scx_dyn_state;
+
+/*
+ * Set up the buddy allocator on first use. Callers that race the first
+ * initialization wait for it to finish, and take over if it failed.
+ */
+static int scx_dyn_init(void)
+{
+	u32 state;
+	int ret;
+
+	state = smp_load_acquire(&scx_dyn_state);
+	if (likely(state == SCX_DYN_READY))
+		return 0;
+
+	while (can_loop) {
+		state = smp_load_acquire(&scx_dyn_state);
+		if (state == SCX_DYN_READY)
+			return 0;
+
+		if (state != SCX_DYN_UNINIT ||
+		    cmpxchg(&scx_dyn_state, SCX_DYN_UNINIT, SCX_DYN_INITING) != SCX_DYN_UNINIT)
+			continue;
+
+		ret = scx_buddy_init(&scx_dyn_buddy, SCX_BUDDY_MIN_ALLOC_BYTES);
+		smp_store_release(&scx_dyn_state, ret ? SCX_DYN_UNINIT : SCX_DYN_READY);
+
+		return ret;
+	}
+
+	return -EBUSY;
+}
+
+/*
+ * Requests too large for a buddy block get their own pages, preceded by a
+ * header page recording how many to give back.
+ */
+#define SCX_DYN_LARGE_MAGIC	0x7363786479726765ULL
+
+struct scx_dyn_large_hdr {
+	u64 magic;
+	u64 addr;
+	u64 nr_pages;
+};
+
+static u64 scx_dyn_alloc_large(size_t bytes)
+{
+	struct scx_dyn_large_hdr __arena *hdr;
+	u64 nr_pages;
+
+	nr_pages = div_round_up(bytes, PAGE_SIZE) + 1;
+
+	/* Fresh arena pages are zeroed. */
+	hdr = bpf_arena_alloc_pages(&arena, NULL, nr_pages, NUMA_NO_NODE, 0);
+	if (!hdr) {
+		bpf_printk("no room in the arena for %lu pages", nr_pages);
+		return (u64)NULL;
+	}
+
+	hdr->magic = SCX_DYN_LARGE_MAGIC;
+	hdr->addr = (u64)hdr + PAGE_SIZE;
+	hdr->nr_pages = nr_pages;
+
+	return hdr->addr;
+}
+
+static bool scx_dyn_free_large(u64 addr)
+{
+	struct scx_dyn_large_hdr __arena *hdr;
+
+	if (addr & (PAGE_SIZE - 1))
+		return false;
+
+	hdr = (struct scx_dyn_large_hdr __arena *)(addr - PAGE_SIZE);
+	if (hdr->magic != SCX_DYN_LARGE_MAGIC || hdr->addr != addr)
+		return false;
+
+	hdr->magic = 0;
+	bpf_arena_free_pages(&arena, hdr, hdr->nr_pages);
+
+	return true;
+}
+
+__weak
+u64 scx_dyn_alloc_internal(size_t bytes)
+{
+	u64 __arena *mem;
+	u64 i, nr_words;
+	int ret;
+
+	if (bytes > SCX_DYN_MAX_BUDDY_BYTES)
+		return scx_dyn_alloc_large(bytes);
+
+	ret = scx_dyn_init();
+	if (ret) {
+		bpf_printk("dynamic allocator init failed with %d", ret);
+		return (u64)NULL;
+	}
+
+	mem = (u64 __arena *)scx_buddy_alloc(&scx_dyn_buddy, bytes);
+	if (!mem)
+		return (u64)NULL;
+
+	/* Blocks get recycled, hand them out zeroed like static allocations. */
+	nr_words = div_round_up(bytes, 8);
+	for (i = zero; i < nr_words && can_loop; i++)
+		mem[i] = 0;
+
+	return (u64)mem;
+}
+
+__weak
+void scx_dyn_free_internal(u64 addr)
+{
+	if (!addr)
+		return;
+
+	if (scx_dyn_free_large(addr))
+		return;
+
+	scx_buddy_free_internal(&scx_dyn_buddy, addr);
 }
 
 /**
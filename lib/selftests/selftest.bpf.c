@@ -38,6 +38,12 @@ int arena_selftest(void)
 		return ret;
 	}
 
+	ret = scx_selftest_map_cleanup();
+	if (ret) {
+		bpf_printk("scx_selftest_map_cleanup failed with %d", ret);
+		return ret;
+	}
+
 	ret = scx_selftest_minheap();
 	if (ret) {
 		bpf_printk("scx_selftest_minheap failed with %d", ret);
@@ -5,7 +5,10 @@
  * GNU General Public License version 2.
  */
 
+#define _GNU_SOURCE
 #include <assert.h>
+#include <pthread.h>
+#include <sched.h>
 #include <stdio.h>
 #include <string.h>
 #include <unistd.h>
@@ -285,6 +288,204 @@ selftest(struct selftest *skel)
 	return 0;
 }
 
+static int
+selftest_minheap_bench_one(struct selftest *skel, u64 nr_elems, u64 nr_ops)
+{
+	struct minheap_bench_args args;
+	struct bpf_test_run_opts opts;
+	u64 total_ns;
+	int prog_fd;
+	int ret;
+
+	args = (struct minheap_bench_args) {
+		.nr_elems = nr_elems,
+		.nr_ops = nr_ops,
+	};
+
+	memset(&opts, 0, sizeof(opts));
+	opts = (struct bpf_test_run_opts) {
+		.sz = sizeof(opts),
+		.ctx_in = &args,
+		.ctx_size_in = sizeof(args),
+	};
+
+	prog_fd = bpf_program__fd(skel->progs.minheap_bench);
+	assert(prog_fd >= 0 && "no program found");
+
+	ret = bpf_prog_test_run_opts(prog_fd, &opts);
+	VALIDATE(ret);
+
+	if (opts.retval) {
+		fprintf(stderr, "minheap bench with %llu elems failed with %d\n",
+			nr_elems, opts.retval);
+		return opts.retval;
+	}
+
+	total_ns = args.insert_ns + args.churn_ns + args.pop_ns;
+
+	printf("minheap arity %llu elems %6llu: insert %10.0f ops/s, pop+insert %10.0f ops/s, "
+	       "pop %10.0f ops/s, total %10.0f ops/s\n",
+	       args.arity, nr_elems,
+	       nr_elems * 1e9 / (args.insert_ns ?: 1),
+	       nr_ops * 1e9 / (args.churn_ns ?: 1),
+	       nr_elems * 1e9 / (args.pop_ns ?: 1),
+	       (2 * nr_elems + 2 * nr_ops) * 1e9 / (total_ns ?: 1));
+
+	return 0;
+}
+
+/*
+ * Rebuild with MINHEAP_ARITY=4 or 8 to compare layouts, see "make bench".
+ * The 64K heap is past the largest buddy block and lives in arena pages of
+ * its own. A size that fails is reported without skipping the others.
+ */
+static int
+selftest_minheap_bench(struct selftest *skel)
+{
+	u64 sizes[] = { 1024, 16 * 1024, 64 * 1024 };
+	int i, ret, err = 0;
+
+	for (i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+		ret = selftest_minheap_bench_one(skel, sizes[i], 4 * sizes[i]);
+		if (ret)
+			err = ret;
+	}
+
+	return err;
+}
+
+#define LVQ_STRESS_MAX_THREADS	64
+#define LVQ_STRESS_OPS		(1 << 16)
+
+struct lvq_stress_thread {
+	pthread_t thread;
+	int prog_fd;
+	int err;
+	struct lvq_stress_args args;
+};
+
+static int
+lvq_stress_run(int prog_fd, struct lvq_stress_args *args)
+{
+	struct bpf_test_run_opts opts;
+	int ret;
+
+	memset(&opts, 0, sizeof(opts));
+	opts = (struct bpf_test_run_opts) {
+		.sz = sizeof(opts),
+		.ctx_in = args,
+		.ctx_size_in = sizeof(*args),
+	};
+
+	ret = bpf_prog_test_run_opts(prog_fd, &opts);
+	if (ret)
+		return ret;
+
+	return opts.retval;
+}
+
+static void *
+lvq_stress_thread_fn(void *arg)
+{
+	struct lvq_stress_thread *thread = arg;
+	cpu_set_t cpus;
+
+	CPU_ZERO(&cpus);
+	CPU_SET(thread->args.cpu, &cpus);
+	thread->err = pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+	if (thread->err)
+		return NULL;
+
+	thread->err = lvq_stress_run(thread->prog_fd, &thread->args);
+
+	return NULL;
+}
+
+/*
+ * Hammer a per-CPU lvqueue pool from one pinned thread per CPU, then drain it
+ * and check that every pushed element came out exactly once.
+ */
+static int
+selftest_lvq_stress(struct selftest *skel)
+{
+	static struct lvq_stress_thread threads[LVQ_STRESS_MAX_THREADS];
+	u64 nr_pushed = 0, nr_popped = 0, sum_pushed = 0, sum_popped = 0;
+	u64 elapsed_ns = 0, nr_ops = 0;
+	struct lvq_stress_args args;
+	int nr_threads, prog_fd;
+	int i, ret;
+
+	nr_threads = get_nprocs();
+	if (nr_threads > LVQ_STRESS_MAX_THREADS)
+		nr_threads = LVQ_STRESS_MAX_THREADS;
+	if (nr_threads < 2) {
+		printf("lvqueue stress: needs at least two CPUs, skipping\n");
+		return 0;
+	}
+
+	args = (struct lvq_stress_args) { .nr_cpus = nr_threads };
+	ret = lvq_stress_run(bpf_program__fd(skel->progs.lvq_stress_init), &args);
+	if (ret) {
+		fprintf(stderr, "error %d in %s\n", ret, __func__);
+		return ret;
+	}
+
+	prog_fd = bpf_program__fd(skel->progs.lvq_stress);
+	assert(prog_fd >= 0 && "no program found");
+
+	for (i = 0; i < nr_threads; i++) {
+		threads[i] = (struct lvq_stress_thread) {
+			.prog_fd = prog_fd,
+			.args = {
+				.cpu = i,
+				.nr_cpus = nr_threads,
+				.nr_ops = LVQ_STRESS_OPS,
+			},
+		};
+
+		ret = pthread_create(&threads[i].thread, NULL, lvq_stress_thread_fn, &threads[i]);
+		VALIDATE(ret);
+	}
+
+	for (i = 0; i < nr_threads; i++) {
+		pthread_join(threads[i].thread, NULL);
+		if (threads[i].err) {
+			fprintf(stderr, "lvqueue stress thread %d failed with %d\n", i, threads[i].err);
+			return threads[i].err;
+		}
+
+		nr_pushed += threads[i].args.nr_pushed;
+		nr_popped += threads[i].args.nr_popped;
+		sum_pushed += threads[i].args.sum_pushed;
+		sum_popped += threads[i].args.sum_popped;
+		nr_ops += threads[i].args.nr_ops;
+		if (threads[i].args.elapsed_ns > elapsed_ns)
+			elapsed_ns = threads[i].args.elapsed_ns;
+	}
+
+	/* Drain the leftovers single-threaded. */
+	args = (struct lvq_stress_args) { .cpu = 0, .nr_cpus = nr_threads };
+	ret = lvq_stress_run(prog_fd, &args);
+	if (ret) {
+		fprintf(stderr, "error %d draining in %s\n", ret, __func__);
+		return ret;
+	}
+
+	nr_popped += args.nr_popped;
+	sum_popped += args.sum_popped;
+
+	printf("lvqueue stress: %d threads, %10.0f ops/s, %llu steals moving %llu elements\n",
+	       nr_threads, nr_ops * 1e9 / (elapsed_ns ?: 1), args.nr_steals, args.nr_stolen);
+
+	if (nr_pushed != nr_popped || sum_pushed != sum_popped) {
+		fprintf(stderr, "lvqueue stress: pushed %llu (sum %llu), popped %llu (sum %llu)\n",
+			nr_pushed, sum_pushed, nr_popped, sum_popped);
+		return -EINVAL;
+	}
+
+	return 0;
+}
+
 int bump_rlimit(void)
 {
 	int ret;
@@ -311,7 +512,19 @@ static int libbpf_print_fn(enum libbpf_print_level level,
 int main(int argc, char *argv[])
 {
 	struct selftest *skel;
-	int ret;
+	bool bench = false;
+	int opt, ret;
+
+	while ((opt = getopt(argc, argv, "b")) != -1) {
+		switch (opt) {
+		case 'b':
+			bench = true;
+			break;
+		default:
+			fprintf(stderr, "usage: %s [-b]\n", argv[0]);
+			return 1;
+		}
+	}
 
 	libbpf_set_print(libbpf_print_fn);
 
@@ -332,6 +545,13 @@ int main(int argc, char *argv[])
 	selftest_arena_init(skel);
 	selftest_topology_init(skel);
 
+	/* The benchmarks are independent, a failed one doesn't skip the rest. */
+	if (bench) {
+		ret = selftest_minheap_bench(skel);
+		ret = selftest_lvq_stress(skel) ?: ret;
+		return ret ? 1 : 0;
+	}
+
 	selftest(skel);
 
 	printf("Tests complete");
@@ -23,11 +23,39 @@ struct task_ctx_nonarena {
 
 typedef struct task_ctx_nonarena __arena task_ctx;
 
+struct minheap_bench_args {
+	u64 nr_elems;
+	u64 nr_ops;
+	u64 arity;
+	u64 insert_ns;
+	u64 churn_ns;
+	u64 pop_ns;
+};
+
+int minheap_bench(struct minheap_bench_args *args);
+
+struct lvq_stress_args {
+	u64 cpu;
+	u64 nr_cpus;
+	u64 nr_ops;
+	u64 nr_pushed;
+	u64 nr_popped;
+	u64 sum_pushed;
+	u64 sum_popped;
+	u64 elapsed_ns;
+	u64 nr_steals;
+	u64 nr_stolen;
+};
+
+int lvq_stress_init(struct lvq_stress_args *args);
+int lvq_stress(struct lvq_stress_args *args);
+
 int scx_selftest_arena_topology_timer(void);
 int scx_selftest_atq(void);
 int scx_selftest_bitmap(void);
 int scx_selftest_btree(void);
 int scx_selftest_lvqueue(void);
+int scx_selftest_map_cleanup(void);
 int scx_selftest_minheap(void);
 int scx_selftest_rbtree(void);
 int scx_selftest_topology(void);
@@ -353,6 +353,167 @@ int scx_selftest_atq_sized(u64 unused)
 	return 0;
 }
 
+__weak
+int scx_selftest_atq_destroy(u64 unused)
+{
+	scx_atq_t *atq;
+	int ret, i;
+
+	/* Recycle an ATQ a few times to make sure its memory comes back. */
+	for (i = 0; i < 4 && can_loop; i++) {
+		atq = (scx_atq_t *)scx_atq_create(false);
+		if (!atq) {
+			bpf_printk("ATQ failed to create on round %d", i);
+			return -ENOMEM;
+		}
+
+		ret = scx_atq_insert_vtime(atq, &tasks[i]->common, i);
+		if (ret) {
+			bpf_printk("ATQ insert failed with %d", ret);
+			return ret;
+		}
+
+		ret = scx_atq_destroy(atq);
+		if (ret != -EBUSY) {
+			bpf_printk("ATQ destroyed while not empty (%d)", ret);
+			return -EINVAL;
+		}
+
+		if ((task_ctx *)scx_atq_pop(atq) != tasks[i]) {
+			bpf_printk("ATQ popped unexpected task");
+			return -EINVAL;
+		}
+
+		ret = scx_atq_destroy(atq);
+		if (ret) {
+			bpf_printk("ATQ destroy failed with %d", ret);
+			return ret;
+		}
+	}
+
+	return 0;
+}
+
+__weak
+int scx_selftest_atq_fifo_cancel(u64 unused)
+{
+	const int nr_tasks = 8;
+	task_ctx *taskc;
+	int ret, i;
+
+	for (i = 0; i < nr_tasks && can_loop; i++) {
+		tasks[i]->pid = i;
+		ret = scx_atq_insert(fifo, &tasks[i]->common);
+		if (ret) {
+			bpf_printk("fifo atq insert failed with %d", ret);
+			return ret;
+		}
+	}
+
+	/* Cancel the odd tasks, leaving tombstones in the ring. */
+	for (i = 1; i < nr_tasks && can_loop; i += 2) {
+		ret = scx_atq_cancel(&tasks[i]->common);
+		if (ret) {
+			bpf_printk("fifo atq cancel failed with %d", ret);
+			return ret;
+		}
+	}
+
+	if (scx_atq_nr_queued(fifo) != nr_tasks / 2) {
+		bpf_printk("fifo atq has %d tasks after cancel", scx_atq_nr_queued(fifo));
+		return -EINVAL;
+	}
+
+	/* Requeueing a cancelled task must not revive its old cell. */
+	ret = scx_atq_insert(fifo, &tasks[1]->common);
+	if (ret) {
+		bpf_printk("fifo atq reinsert failed with %d", ret);
+		return ret;
+	}
+
+	for (i = 0; i < nr_tasks && can_loop; i += 2) {
+		taskc = (task_ctx *)scx_atq_pop(fifo);
+		if (taskc != tasks[i]) {
+			bpf_printk("fifo atq popped %p, expected task %d", taskc, i);
+			return -EINVAL;
+		}
+	}
+
+	if ((task_ctx *)scx_atq_pop(fifo) != tasks[1]) {
+		bpf_printk("fifo atq lost the requeued task");
+		return -EINVAL;
+	}
+
+	if (scx_atq_nr_queued(fifo) || scx_atq_pop(fifo)) {
+		bpf_printk("fifo atq not empty after cancel test");
+		return -EINVAL;
+	}
+
+	return 0;
+}
+
+__weak
+int scx_selftest_atq_fifo_overflow(u64 unused)
+{
+	const int nr_tombstones = 6, nr_tasks = 4;
+	scx_atq_t *atq;
+	task_ctx *taskc;
+	int ret, i;
+
+	/* A capacity of 4 gets an 8 cell ring. */
+	atq = (scx_atq_t *)scx_atq_create_size(true, nr_tasks);
+	if (!atq)
+		return -ENOMEM;
+
+	/* Fill most of the ring with tombstones. */
+	for (i = 0; i < nr_tombstones && can_loop; i++) {
+		ret = scx_atq_insert(atq, &tasks[i]->common);
+		if (!ret)
+			ret = scx_atq_cancel(&tasks[i]->common);
+		if (ret) {
+			bpf_printk("fifo atq insert/cancel failed with %d", ret);
+			return ret;
+		}
+	}
+
+	/* The first two tasks land in the ring, the rest in the tree. */
+	for (i = 0; i < nr_tasks && can_loop; i++) {
+		ret = scx_atq_insert(atq, &tasks[i]->common);
+		if (ret) {
+			bpf_printk("fifo atq insert failed with %d", ret);
+			return ret;
+		}
+	}
+
+	if (!atq->nr_overflow) {
+		bpf_printk("fifo atq did not overflow");
+		return -EINVAL;
+	}
+
+	if (!scx_atq_insert(atq, &tasks[nr_tasks]->common)) {
+		bpf_printk("fifo atq insert above capacity succeeded");
+		return -EINVAL;
+	}
+
+	for (i = 0; i < nr_tasks && can_loop; i++) {
+		taskc = (task_ctx *)scx_atq_pop(atq);
+		if (taskc != tasks[i]) {
+			bpf_printk("fifo atq popped %p, expected task %d", taskc, i);
+			return -EINVAL;
+		}
+
+		if (rb_integrity_check(atq->tree))
+			return -EINVAL;
+	}
+
+	if (scx_atq_nr_queued(atq) || atq->nr_overflow) {
+		bpf_printk("fifo atq not empty after overflow test");
+		return -EINVAL;
+	}
+
+	return scx_atq_destroy(atq);
+}
+
 __weak
 int scx_selftest_atq(void)
 {
@@ -371,10 +532,13 @@ int scx_selftest_atq(void)
 	SCX_ATQ_SELFTEST(fail_vtime_without_weight);
 	SCX_ATQ_SELFTEST(fifo);
 	SCX_ATQ_SELFTEST(fail_fifo_with_weight);
+	SCX_ATQ_SELFTEST(fifo_cancel);
+	SCX_ATQ_SELFTEST(fifo_overflow);
 	SCX_ATQ_SELFTEST(nr_queued);
 	SCX_ATQ_SELFTEST(peek_nodestruct);
 	SCX_ATQ_SELFTEST(peek_empty);
 	SCX_ATQ_SELFTEST(sized);
+	SCX_ATQ_SELFTEST(destroy);
 
 	return 0;
 }
@@ -526,6 +526,113 @@ __weak int scx_selftest_btree_add_remove_circular_reverse(btree_t __arg_arena *b
 }
 
 
+/* Walk the leaf list of whatever the previous tests left in the tree. */
+__weak int scx_selftest_btree_iterate(btree_t __arg_arena *btree)
+{
+	struct bt_iter it;
+	u64 key, value, last = 0;
+	int ret, i;
+
+	if (!btree)
+		return 1;
+
+	ret = bt_iter_seek(btree, 0, &it);
+	if (ret)
+		return 2;
+
+	for (i = 0; !bt_iter_next(&it, &key, &value) && can_loop; i++) {
+		if (i > 0 && key <= last)
+			return 3;
+		last = key;
+
+		ret = bt_find(btree, key, &value);
+		if (ret)
+			return 4;
+	}
+
+	return 0;
+}
+
+__weak int scx_selftest_btree_bulk_load(btree_t __arg_arena *unused)
+{
+	const u64 nr = 500, step = 3;
+	u64 __arena *sorted_keys, *sorted_values;
+	u64 key, value;
+	struct bt_iter it;
+	btree_t *btree;
+	int ret, i;
+
+	sorted_keys = scx_static_alloc(nr * sizeof(*sorted_keys), 1);
+	sorted_values = scx_static_alloc(nr * sizeof(*sorted_values), 1);
+	if (!sorted_keys || !sorted_values)
+		return 1;
+
+	bpf_for(i, 0, nr) {
+		sorted_keys[i] = step * i;
+		sorted_values[i] = 2 * step * i;
+	}
+
+	btree = bt_bulk_load(sorted_keys, sorted_values, nr);
+	if (!btree)
+		return 2;
+
+	bpf_for(i, 0, nr) {
+		ret = bt_find(btree, step * i, &value);
+		if (ret || value != 2 * step * i)
+			return 3;
+	}
+
+	/* Scan a range that does not start on a key. */
+	ret = bt_iter_seek(btree, 100, &it);
+	if (ret)
+		return 4;
+
+	for (i = 0; !bt_iter_next(&it, &key, &value) && key < 400 && can_loop; i++) {
+		if (key != step * (34 + i) || value != 2 * key)
+			return 5;
+	}
+
+	if (i != 100)
+		return 6;
+
+	/* The tree stays usable, and the leaf list intact, after updates. */
+	bpf_for(i, 0, nr) {
+		if (i % 2)
+			ret = bt_remove(btree, step * i);
+		else
+			ret = bt_insert(btree, step * i + 1, 0, false);
+		if (ret)
+			return 7;
+	}
+
+	ret = bt_iter_seek(btree, 0, &it);
+	if (ret)
+		return 8;
+
+	for (i = 0; !bt_iter_next(&it, &key, &value) && can_loop; i++) {
+		/* Even multiples of step, each followed by key + 1. */
+		if (key != step * 2 * (i / 2) + (i % 2))
+			return 9;
+	}
+
+	if (i != nr)
+		return 10;
+
+	/* Removing a missing key must not remove its successor. */
+	if (bt_remove(btree, step) != -ENOENT)
+		return 11;
+
+	if (bt_destroy(btree))
+		return 12;
+
+	/* Unsorted input fails the load, which frees what it built so far. */
+	sorted_keys[nr / 2] = 0;
+	if (bt_bulk_load(sorted_keys, sorted_values, nr))
+		return 13;
+
+	return 0;
+}
+
 #define SCX_BTREE_SELFTEST(suffix) SCX_SELFTEST(scx_selftest_btree_ ## suffix, btree)
 
 __weak
@@ -550,6 +657,8 @@ int scx_selftest_btree(void)
 	SCX_BTREE_SELFTEST(remove_many);
 	SCX_BTREE_SELFTEST(add_remove_circular_reverse);
 	SCX_BTREE_SELFTEST(add_remove_circular);
+	SCX_BTREE_SELFTEST(iterate);
+	SCX_BTREE_SELFTEST(bulk_load);
 
 	return 0;
 }
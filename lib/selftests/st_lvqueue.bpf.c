@@ -133,6 +133,161 @@ int scx_selftest_lvqueue_steal_many(lv_queue_t *lvq)
 	return 0;
 }
 
+/*
+ * Grow queues past their initial array, drain them and destroy them, a few
+ * times over, to make sure the arrays come back.
+ */
+int scx_selftest_lvqueue_destroy(lv_queue_t *unused)
+{
+	lv_queue_t *lvq;
+	int ret, i, round;
+	u64 val;
+
+	for (round = 0; round < 4 && can_loop; round++) {
+		lvq = lvq_create();
+		if (!lvq)
+			return 1;
+
+		for (i = 0; i < 2 * LV_ARR_BASESZ && can_loop; i++) {
+			ret = lvq_push(lvq, i);
+			if (ret)
+				return 2;
+		}
+
+		for (i = 2 * LV_ARR_BASESZ - 1; i >= 0 && can_loop; i--) {
+			ret = lvq_pop(lvq, &val);
+			if (ret)
+				return 3;
+
+			if (val != i)
+				return 4;
+		}
+
+		ret = lvq_destroy(lvq);
+		if (ret)
+			return 5;
+	}
+
+	return 0;
+}
+
+/*
+ * Grow a queue to its third array and drain it. Once it has been sparse for
+ * long enough it must move back to a smaller array without losing anything.
+ */
+int scx_selftest_lvqueue_shrink(lv_queue_t *unused)
+{
+	const int nr = 3 * LV_ARR_BASESZ;
+	lv_queue_t *lvq;
+	int ret, i;
+	u64 val;
+
+	lvq = lvq_create();
+	if (!lvq)
+		return 1;
+
+	for (i = 0; i < nr && can_loop; i++) {
+		ret = lvq_push(lvq, i);
+		if (ret)
+			return 2;
+	}
+
+	if (lvq->cur->order != 2)
+		return 3;
+
+	for (i = nr - 1; i >= 0 && can_loop; i--) {
+		ret = lvq_pop(lvq, &val);
+		if (ret)
+			return 4;
+
+		if (val != i)
+			return 5;
+	}
+
+	if (lvq->cur->order != 1)
+		return 6;
+
+	return lvq_destroy(lvq) ? 7 : 0;
+}
+
+int scx_selftest_lvqueue_steal_half(lv_queue_t *unused)
+{
+	lv_queue_t *victim, *thief;
+	int ret, i;
+	u64 val;
+
+	victim = lvq_create();
+	thief = lvq_create();
+	if (!victim || !thief)
+		return 1;
+
+	for (i = 0; i < 9 && can_loop; i++) {
+		ret = lvq_push(victim, i);
+		if (ret)
+			return 2;
+	}
+
+	/* Rounds up, and takes the oldest elements. */
+	ret = lvq_steal_half(victim, thief);
+	if (ret != 5)
+		return 3;
+
+	for (i = 4; i >= 0 && can_loop; i--) {
+		if (lvq_pop(thief, &val) || val != i)
+			return 4;
+	}
+
+	for (i = 8; i >= 5 && can_loop; i--) {
+		if (lvq_pop(victim, &val) || val != i)
+			return 5;
+	}
+
+	if (lvq_steal_half(victim, thief))
+		return 6;
+
+	if (lvq_destroy(victim) || lvq_destroy(thief))
+		return 7;
+
+	return 0;
+}
+
+/* Elements pushed on one CPU must be reachable from every other one. */
+int scx_selftest_lvqueue_pool(lv_queue_t *unused)
+{
+	const int nr = 10, nr_queues = 2;
+	lvq_pool_t *pool;
+	u64 val, sum = 0;
+	int ret, i;
+
+	pool = lvq_pool_create(nr_queues);
+	if (!pool)
+		return 1;
+
+	for (i = 0; i < nr && can_loop; i++) {
+		ret = lvq_pool_push(pool, 0, i);
+		if (ret)
+			return 2;
+	}
+
+	for (i = 0; i < nr && can_loop; i++) {
+		ret = lvq_pool_pop(pool, i % nr_queues, &val);
+		if (ret)
+			return 3;
+		sum += val;
+	}
+
+	if (sum != nr * (nr - 1) / 2)
+		return 4;
+
+	if (lvq_pool_pop(pool, 1, &val) != -ENOENT)
+		return 5;
+
+	if (!pool->nr_steals)
+		return 6;
+
+	return lvq_pool_destroy(pool) ? 7 : 0;
+}
+
 #define SCX_LVQUEUE_SELFTEST(suffix) SCX_SELFTEST(scx_selftest_lvqueue_ ## suffix, lvq)
 
 __weak
@@ -147,6 +302,87 @@ int scx_selftest_lvqueue(void)
 	SCX_LVQUEUE_SELFTEST(steal_empty);
 	SCX_LVQUEUE_SELFTEST(pop_one);
 	SCX_LVQUEUE_SELFTEST(steal_one);
+	SCX_LVQUEUE_SELFTEST(destroy);
+	SCX_LVQUEUE_SELFTEST(shrink);
+	SCX_LVQUEUE_SELFTEST(steal_half);
+	SCX_LVQUEUE_SELFTEST(pool);
+
+	return 0;
+}
+
+/*
+ * Multi-threaded stress benchmark, driven by "selftest -b". Userspace runs
+ * lvq_stress concurrently on a set of pinned threads, each the owner of the
+ * pool queue of its CPU. Even CPUs mostly produce and odd ones only consume,
+ * so the consumers live off stealing. The totals and value sums of all
+ * threads must match once the pool has been drained.
+ */
+lvq_pool_t *lvq_stress_pool;
+
+SEC("syscall")
+int lvq_stress_init(struct lvq_stress_args *args)
+{
+	if (lvq_stress_pool)
+		lvq_pool_destroy(lvq_stress_pool);
+
+	lvq_stress_pool = lvq_pool_create(args->nr_cpus);
+
+	return lvq_stress_pool ? 0 : -ENOMEM;
+}
+
+SEC("syscall")
+int lvq_stress(struct lvq_stress_args *args)
+{
+	lvq_pool_t *pool = lvq_stress_pool;
+	u32 cpu = args->cpu;
+	u64 start, val;
+	int ret;
+	u64 i;
+
+	if (!pool)
+		return -EINVAL;
+
+	start = bpf_ktime_get_ns();
+
+	bpf_for(i, 0, args->nr_ops) {
+		if (!(cpu % 2) && i % 3 != 2) {
+			val = ((u64)cpu << 32) | i;
+			ret = lvq_pool_push(pool, cpu, val);
+			if (ret)
+				return ret;
+
+			args->nr_pushed += 1;
+			args->sum_pushed += val;
+			continue;
+		}
+
+		ret = lvq_pool_pop(pool, cpu, &val);
+		if (ret == -ENOENT || ret == -EAGAIN)
+			continue;
+		if (ret)
+			return ret;
+
+		args->nr_popped += 1;
+		args->sum_popped += val;
+	}
+
+	/* With nr_ops == 0, drain whatever is left anywhere in the pool. */
+	bpf_for(i, 0, args->nr_ops ? 0 : 1 << 20) {
+		ret = lvq_pool_pop(pool, cpu, &val);
+		if (ret == -EAGAIN)
+			continue;
+		if (ret == -ENOENT)
+			break;
+		if (ret)
+			return ret;
+
+		args->nr_popped += 1;
+		args->sum_popped += val;
+	}
+
+	args->elapsed_ns = bpf_ktime_get_ns() - start;
+	args->nr_steals = pool->nr_steals;
+	args->nr_stolen = pool->nr_stolen;
 
 	return 0;
 }
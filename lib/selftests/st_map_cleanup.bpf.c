@@ -0,0 +1,153 @@
+/*
+ * SPDX-License-Identifier: GPL-2.0
+ * Copyright (c) 2025 Meta Platforms, Inc. and affiliates.
+ */
+
+#include <scx/common.bpf.h>
+
+#include "selftest.h"
+
+#define ST_MC_NR_KEYS	32
+#define ST_MC_TAG(key)	((u64)(key) * 7 + 3)
+
+struct st_mc_entry {
+	u64 tag;
+	u64 last_touched;
+};
+
+struct {
+	__uint(type, BPF_MAP_TYPE_HASH);
+	__uint(max_entries, ST_MC_NR_KEYS);
+	__type(key, u32);
+	__type(value, struct st_mc_entry);
+} st_mc_map SEC(".maps");
+
+/* How many times each key was handed to the eviction callback. */
+static u32 st_mc_evicted[ST_MC_NR_KEYS];
+static u32 st_mc_bad_copies;
+
+static void st_map_cleanup_evict(u32 key, void *val)
+{
+	struct st_mc_entry *entry = val;
+
+	/* The value is a copy, and must still be readable after the delete. */
+	if (entry->tag != ST_MC_TAG(key))
+		st_mc_bad_copies++;
+
+	if (key < ST_MC_NR_KEYS)
+		st_mc_evicted[key]++;
+}
+
+#define SCX_MAP_CLEANUP_TARGET		st_mc_map
+#define SCX_MAP_CLEANUP_AGE_OFFSET	offsetof(struct st_mc_entry, last_touched)
+#define SCX_MAP_CLEANUP_EVICT_FN	st_map_cleanup_evict
+#define SCX_AGE_INDEX_SLOT_CAP		ST_MC_NR_KEYS
+#include <lib/map_cleanup.h>
+
+/* Four age index windows, so stale and fresh entries land in different ones. */
+#define ST_MC_MAX_AGE_NS	(4ULL << 27)
+
+/*
+ * Fill the map with the even keys stale and the odd ones fresh, optionally
+ * reporting them to the age index, and clear the callback record.
+ */
+static int st_map_cleanup_fill(u64 now, bool touch)
+{
+	struct st_mc_entry entry;
+	int ret, i;
+	u32 key;
+
+	bpf_for(i, 0, ST_MC_NR_KEYS) {
+		key = i;
+		entry.tag = ST_MC_TAG(key);
+		entry.last_touched = key % 2 ? now : now - 2 * ST_MC_MAX_AGE_NS;
+
+		ret = bpf_map_update_elem(&st_mc_map, &key, &entry, BPF_ANY);
+		if (ret)
+			return ret;
+
+		if (touch)
+			scx_map_cleanup_touch(key, 0, entry.last_touched);
+
+		st_mc_evicted[key] = 0;
+	}
+
+	st_mc_bad_copies = 0;
+
+	return 0;
+}
+
+/* Exactly the stale keys went to the callback, once each, and left the map. */
+static int st_map_cleanup_check(u32 evicted)
+{
+	bool stale, present;
+	u32 key;
+	int i;
+
+	if (evicted != ST_MC_NR_KEYS / 2 || st_mc_bad_copies)
+		return 1;
+
+	bpf_for(i, 0, ST_MC_NR_KEYS) {
+		key = i;
+		stale = !(key % 2);
+
+		if (st_mc_evicted[key] != stale)
+			return 2;
+
+		present = bpf_map_lookup_elem(&st_mc_map, &key);
+		if (present == stale)
+			return 3;
+	}
+
+	return 0;
+}
+
+static int scx_selftest_map_cleanup_full_scan(void)
+{
+	u64 now = bpf_ktime_get_ns();
+	u32 evicted = 0;
+	int ret;
+
+	ret = st_map_cleanup_fill(now, false);
+	if (ret)
+		return ret;
+
+	ret = scx_map_cleanup_full_scan(&evicted);
+	if (ret)
+		return ret;
+
+	return st_map_cleanup_check(evicted);
+}
+
+static int scx_selftest_map_cleanup_age_index(void)
+{
+	u64 now = bpf_ktime_get_ns();
+	u32 evicted = 0;
+	int ret;
+
+	ret = st_map_cleanup_fill(now, true);
+	if (ret)
+		return ret;
+
+	ret = scx_map_cleanup_scan(&evicted);
+	if (ret)
+		return ret;
+
+	return st_map_cleanup_check(evicted);
+}
+
+__weak
+int scx_selftest_map_cleanup(void)
+{
+	map_cleanup_ctl.budget_ns = map_cleanup_budget_max_ns;
+	map_cleanup_ctl.max_age_ns = ST_MC_MAX_AGE_NS;
+
+	/* Ages below are relative to now, which has to be far enough along. */
+	if (bpf_ktime_get_ns() < 4 * ST_MC_MAX_AGE_NS)
+		return 0;
+
+	SCX_SELFTEST(scx_selftest_map_cleanup_full_scan);
+	SCX_SELFTEST(scx_selftest_map_cleanup_age_index);
+
+	return 0;
+}
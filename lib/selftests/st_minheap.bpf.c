@@ -233,11 +233,229 @@ int scx_selftest_minheap_read_back(scx_minheap_t *heap)
 
 	return 0;
 }
+/*
+ * A heap too large for a buddy block is backed by arena pages, and must work
+ * like any other. Capacities past the maximum are refused.
+ */
+static
+int scx_selftest_minheap_large(scx_minheap_t *unused)
+{
+	const u64 capacity = 2 * SCX_DYN_MAX_BUDDY_BYTES / sizeof(struct scx_minheap_elem);
+	struct scx_minheap_elem helem;
+	scx_minheap_t *heap;
+	int ret, i;
+
+	if (scx_minheap_alloc(SCX_MINHEAP_MAX_CAPACITY + 1))
+		return -EINVAL;
+
+	heap = scx_minheap_alloc(capacity);
+	if (!heap)
+		return -ENOMEM;
+
+	bpf_for(i, 0, capacity) {
+		ret = scx_minheap_insert(heap, i, capacity - i);
+		if (ret)
+			goto out;
+	}
+
+	/* Every slot of the array is usable, and no more. */
+	ret = scx_minheap_insert(heap, 0, 0) ? 0 : -EINVAL;
+	if (ret)
+		goto out;
+
+	/* The last element inserted has the lowest weight. */
+	ret = scx_minheap_pop(heap, &helem);
+	if (!ret && (helem.elem != capacity - 1 || helem.weight != 1))
+		ret = -EINVAL;
+
+out:
+	scx_minheap_destroy(heap);
+	return ret;
+}
+
+/*
+ * Recycle heaps a few times to make sure their memory comes back.
+ */
+static
+int scx_selftest_minheap_destroy(scx_minheap_t *unused)
+{
+	scx_minheap_t *heap;
+	int ret, i;
+
+	for (i = 0; i < 4 && can_loop; i++) {
+		heap = scx_minheap_alloc(HEAP_CAPACITY);
+		if (!heap)
+			return -ENOMEM;
+
+		ret = scx_minheap_insert(heap, i, i);
+		if (ret)
+			return ret;
+
+		ret = scx_minheap_destroy(heap);
+		if (ret)
+			return ret;
+	}
+
+	return 0;
+}
+
+/*
+ * Pop the indexed heap dry, checking the weights come out in order. Returns
+ * the number of elements popped or a negative error.
+ */
+static
+int scx_selftest_idx_minheap_drain(scx_idx_minheap_t *iheap)
+{
+	struct scx_minheap_elem helem;
+	u64 prev = 0;
+	int ret, i;
+
+	for (i = 0; i < HEAP_CAPACITY && iheap->size && can_loop; i++) {
+		ret = scx_idx_minheap_pop(iheap, &helem);
+		if (ret)
+			return ret;
+
+		if (prev > helem.weight) {
+			bpf_printk("weight inversion %ld %ld", prev, helem.weight);
+			return -EINVAL;
+		}
+
+		prev = helem.weight;
+	}
+
+	return i;
+}
+
+/*
+ * Reweight elements in both directions and make sure they come out where
+ * their new weight puts them.
+ */
+static
+int scx_selftest_idx_minheap_update(scx_idx_minheap_t *iheap)
+{
+	u64 keys[] = { 23, 12, 55, 42, 67, 3, 15, 8 };
+	const size_t nr_keys = sizeof(keys) / sizeof(keys[0]);
+	struct scx_minheap_elem helem;
+	s64 handles[8];
+	int ret, i;
+
+	if (iheap->size)
+		return -EINVAL;
+
+	for (i = 0; i < nr_keys && can_loop; i++) {
+		handles[i] = scx_idx_minheap_insert(iheap, i, keys[i]);
+		if (handles[i] < 0)
+			return handles[i];
+	}
+
+	/* Push the current minimum (3) to the back, pull 67 to the front. */
+	ret = scx_idx_minheap_update_weight(iheap, handles[5], 100);
+	if (ret)
+		return ret;
+
+	ret = scx_idx_minheap_update_weight(iheap, handles[4], 1);
+	if (ret)
+		return ret;
+
+	ret = scx_idx_minheap_pop(iheap, &helem);
+	if (ret)
+		return ret;
+
+	if (helem.elem != 4 || helem.weight != 1) {
+		bpf_printk("expected (4, 1), found (%ld, %ld)", helem.elem, helem.weight);
+		return -EINVAL;
+	}
+
+	/* The popped handle is stale now. */
+	if (scx_idx_minheap_update_weight(iheap, handles[4], 0) != -ENOENT)
+		return -EINVAL;
+
+	ret = scx_selftest_idx_minheap_drain(iheap);
+	if (ret < 0)
+		return ret;
+
+	if (ret != nr_keys - 1)
+		return -EINVAL;
+
+	return 0;
+}
+
+/*
+ * Remove elements from different parts of the heap.
+ */
+static
+int scx_selftest_idx_minheap_remove(scx_idx_minheap_t *iheap)
+{
+	u64 keys[] = { 97, 79, 88, 2, 51, 75, 71, 59, 12, 7, 37 };
+	const size_t nr_keys = sizeof(keys) / sizeof(keys[0]);
+	const size_t nr_removed = 3;
+	s64 handles[11], reused;
+	int ret, i;
+
+	if (iheap->size)
+		return -EINVAL;
+
+	for (i = 0; i < nr_keys && can_loop; i++) {
+		handles[i] = scx_idx_minheap_insert(iheap, i, keys[i]);
+		if (handles[i] < 0)
+			return handles[i];
+	}
+
+	/* The minimum (2) and two elements from further down. */
+	ret = scx_idx_minheap_remove(iheap, handles[3]);
+	if (ret)
+		return ret;
+
+	ret = scx_idx_minheap_remove(iheap, handles[6]);
+	if (ret)
+		return ret;
+
+	ret = scx_idx_minheap_remove(iheap, handles[10]);
+	if (ret)
+		return ret;
+
+	/* Removing twice must fail. */
+	if (scx_idx_minheap_remove(iheap, handles[3]) != -ENOENT)
+		return -EINVAL;
+
+	/* Released handle slots get reused, the last released first. */
+	reused = scx_idx_minheap_insert(iheap, 0, 1);
+	if (reused < 0)
+		return reused;
+
+	if ((u32)reused != (u32)handles[10] || reused == handles[10])
+		return -EINVAL;
+
+	/* The stale handle must not reach the element that took its slot. */
+	if (scx_idx_minheap_update_weight(iheap, handles[10], 1000) != -ENOENT)
+		return -EINVAL;
+
+	if (scx_idx_minheap_remove(iheap, handles[10]) != -ENOENT)
+		return -EINVAL;
+
+	if (iheap->helems[0].handle != reused)
+		return -EINVAL;
+
+	ret = scx_selftest_idx_minheap_drain(iheap);
+	if (ret < 0)
+		return ret;
+
+	if (ret != nr_keys - nr_removed + 1)
+		return -EINVAL;
+
+	if (iheap->nr_handles != nr_keys)
+		return -EINVAL;
+
+	return 0;
+}
+
 #define SCX_MINHEAP_SELFTEST(suffix) SCX_SELFTEST(scx_selftest_minheap_ ## suffix, heap)
+#define SCX_IDX_MINHEAP_SELFTEST(suffix) SCX_SELFTEST(scx_selftest_idx_minheap_ ## suffix, iheap)
 
 __weak
 int scx_selftest_minheap(void)
 {
+	scx_idx_minheap_t *iheap;
 	scx_minheap_t *heap;
 
 	heap = scx_minheap_alloc(HEAP_CAPACITY);
@@ -252,6 +470,17 @@ int scx_selftest_minheap(void)
 	SCX_MINHEAP_SELFTEST(descending);
 	SCX_MINHEAP_SELFTEST(alternating);
 	SCX_MINHEAP_SELFTEST(random);
+	SCX_MINHEAP_SELFTEST(large);
+	SCX_MINHEAP_SELFTEST(destroy);
 
-	return 0;
+	iheap = scx_idx_minheap_alloc(HEAP_CAPACITY);
+	if (!iheap) {
+		bpf_printk("Could not allocate indexed heap");
+		return -ENOMEM;
+	}
+
+	SCX_IDX_MINHEAP_SELFTEST(update);
+	SCX_IDX_MINHEAP_SELFTEST(remove);
+
+	return scx_idx_minheap_destroy(iheap);
 }
@@ -0,0 +1,74 @@
+/*
+ * SPDX-License-Identifier: GPL-2.0
+ * Copyright (c) 2025 Meta Platforms, Inc. and affiliates.
+ */
+
+#include <scx/common.bpf.h>
+
+#include <lib/sdt_task.h>
+#include <lib/minheap.h>
+
+#include "selftest.h"
+
+/*
+ * Time scx_minheap operations on a heap of args->nr_elems elements: filling
+ * it with random weights, args->nr_ops pop/insert pairs at that size (what a
+ * scheduler requeueing the task it just picked does), and draining it. The
+ * layout benchmarked is the one selected by SCX_MINHEAP_ARITY at build time.
+ */
+SEC("syscall")
+int minheap_bench(struct minheap_bench_args *args)
+{
+	struct scx_minheap_elem helem;
+	u64 nr_elems = args->nr_elems;
+	u64 last = 0, start;
+	scx_minheap_t *heap;
+	int ret = 0;
+	u64 i;
+
+	heap = scx_minheap_alloc(nr_elems);
+	if (!heap)
+		return -ENOMEM;
+
+	start = bpf_ktime_get_ns();
+	bpf_for(i, 0, nr_elems) {
+		ret = scx_minheap_insert(heap, i, bpf_get_prandom_u32());
+		if (ret)
+			goto out;
+	}
+	args->insert_ns = bpf_ktime_get_ns() - start;
+
+	start = bpf_ktime_get_ns();
+	bpf_for(i, 0, args->nr_ops) {
+		ret = scx_minheap_pop(heap, &helem);
+		if (ret)
+			goto out;
+
+		ret = scx_minheap_insert(heap, helem.elem,
+					 helem.weight + bpf_get_prandom_u32() % nr_elems);
+		if (ret)
+			goto out;
+	}
+	args->churn_ns = bpf_ktime_get_ns() - start;
+
+	start = bpf_ktime_get_ns();
+	bpf_for(i, 0, nr_elems) {
+		ret = scx_minheap_pop(heap, &helem);
+		if (ret)
+			goto out;
+
+		/* Keep the numbers honest, a broken layout would be fast. */
+		if (helem.weight < last) {
+			ret = -EINVAL;
+			goto out;
+		}
+		last = helem.weight;
+	}
+	args->pop_ns = bpf_ktime_get_ns() - start;
+
+	args->arity = SCX_MINHEAP_ARITY;
+
+out:
+	scx_minheap_destroy(heap);
+	return ret;
+}
@@ -760,6 +760,122 @@ __weak int scx_selftest_rbtree_alloc_check(rbtree_t __arg_arena *rbtree)
 	return 0;
 }
 
+/*
+ * Insert keys out of order, with duplicates, and walk them both ways.
+ */
+__weak int scx_selftest_rbtree_iterate(rbtree_t __arg_arena *rbtree)
+{
+	const size_t keys = 32;
+	rbnode_t *node;
+	u64 last;
+	int ret, i;
+
+	bpf_for(i, 0, keys) {
+		ret = rb_insert(rbtree, (i * 7) % (keys / 2), i);
+		if (ret)
+			return 1;
+	}
+
+	i = 0;
+	last = 0;
+	for (node = rb_first(rbtree); node && can_loop; node = rb_next(node)) {
+		if (node->key < last)
+			return 2;
+		last = node->key;
+		i += 1;
+	}
+
+	if (i != keys)
+		return 3;
+
+	i = 0;
+	for (node = rb_last(rbtree); node && can_loop; node = rb_prev(node)) {
+		if (node->key > last)
+			return 4;
+		last = node->key;
+		i += 1;
+	}
+
+	if (i != keys)
+		return 5;
+
+	node = rb_lower_bound(rbtree, 5);
+	if (!node || node->key != 5)
+		return 6;
+
+	if (rb_lower_bound(rbtree, keys / 2))
+		return 7;
+
+	return 0;
+}
+
+__weak int scx_selftest_rbtree_range(rbtree_t __arg_arena *rbtree)
+{
+	struct rb_batch batch;
+	int ret, i;
+
+	/* Each key in [0, 16) is present twice from the iterate test. */
+	ret = rb_range(rbtree, 3, 6, &batch);
+	if (ret != 6)
+		return 1;
+
+	bpf_for(i, 0, RB_BATCH_MAX) {
+		if (i >= batch.nr)
+			break;
+
+		if (batch.keys[i] != 3 + i / 2)
+			return 2;
+	}
+
+	/* More than a batch. */
+	ret = rb_range(rbtree, 0, 16, &batch);
+	if (ret != RB_BATCH_MAX)
+		return 3;
+
+	ret = rb_range(rbtree, 16, 32, &batch);
+	if (ret)
+		return 4;
+
+	return 0;
+}
+
+__weak int scx_selftest_rbtree_pop_n(rbtree_t __arg_arena *rbtree)
+{
+	struct rb_batch batch;
+	u64 key, last = 0;
+	int ret, i, j;
+
+	bpf_for(i, 0, 32 / 5 + 1) {
+		ret = rb_pop_n(rbtree, 5, &batch);
+		if (ret < 0)
+			return 1;
+
+		bpf_for(j, 0, RB_BATCH_MAX) {
+			if (j >= batch.nr)
+				break;
+
+			if (batch.keys[j] < last)
+				return 2;
+			last = batch.keys[j];
+		}
+
+		/* The cached minimum must follow the removals. */
+		if (rbtree->root && (rb_least(rbtree, &key, NULL) || key < last))
+			return 3;
+
+		if (rb_integrity_check(rbtree))
+			return 6;
+	}
+
+	if (rbtree->root || rb_first(rbtree))
+		return 4;
+
+	if (rb_pop_n(rbtree, 5, &batch))
+		return 5;
+
+	return 0;
+}
+
 __weak int scx_selftest_rbtree_print(rbtree_t __arg_arena *rbtree)
 {
 	rb_print(rbtree);
@@ -771,7 +887,7 @@ __weak int scx_selftest_rbtree_print(rbtree_t __arg_arena *rbtree)
 __weak
 int scx_selftest_rbtree(void)
 {
-	rbtree_t *standard, *update, *duplicate, *noalloc;
+	rbtree_t *standard, *update, *duplicate, *noalloc, *ordered;
 
 	standard = rb_create(RB_ALLOC, RB_DEFAULT);
 	if (!standard)
@@ -789,6 +905,10 @@ int scx_selftest_rbtree(void)
 	if (!standard)
 		return -ENOMEM;
 
+	ordered = rb_create(RB_ALLOC, RB_DUPLICATE);
+	if (!ordered)
+		return -ENOMEM;
+
 	SCX_RBTREE_SELFTEST(find_nonexistent, standard);
 	SCX_RBTREE_SELFTEST(insert_one, update);
 	SCX_RBTREE_SELFTEST(print, update);
@@ -804,6 +924,10 @@ int scx_selftest_rbtree(void)
 	SCX_RBTREE_SELFTEST(add_remove_circular_reverse, update);
 	SCX_RBTREE_SELFTEST(add_remove_circular, update);
 	SCX_RBTREE_SELFTEST(alloc_check, standard);
+	SCX_RBTREE_SELFTEST(least_pop, ordered);
+	SCX_RBTREE_SELFTEST(iterate, ordered);
+	SCX_RBTREE_SELFTEST(range, ordered);
+	SCX_RBTREE_SELFTEST(pop_n, ordered);
 
 	return 0;
 }
@@ -31,6 +31,48 @@ int scx_selftest_topology_contains(void)
 	return 0;
 }
 
+__weak
+int scx_selftest_topology_cpu_info(void)
+{
+	struct topo_cpu_info *info;
+	u32 cpu, other;
+
+	cpu = bpf_get_smp_processor_id();
+	info = topo_cpu_lookup(cpu);
+	if (!info) {
+		bpf_printk("TOPO: no cpu info for cpu %d", cpu);
+		return -EINVAL;
+	}
+
+	if (!info->llc_mask || !scx_bitmap_test_cpu(cpu, info->llc_mask)) {
+		bpf_printk("TOPO: cpu %d missing from its llc mask", cpu);
+		return -EINVAL;
+	}
+
+	if (topo_cpu_to_llc_id(cpu) != info->llc_id) {
+		bpf_printk("TOPO: llc id mismatch for cpu %d", cpu);
+		return -EINVAL;
+	}
+
+	if (topo_cpu_distance(cpu, cpu) != TOPO_DIST_SELF) {
+		bpf_printk("TOPO: cpu %d is not closest to itself", cpu);
+		return -EINVAL;
+	}
+
+	bpf_for(other, 0, nr_cpu_ids) {
+		if (other == cpu || !scx_bitmap_test_cpu(other, info->llc_mask))
+			continue;
+
+		if (topo_cpu_distance(cpu, other) > TOPO_DIST_LLC) {
+			bpf_printk("TOPO: cpus %d and %d share an llc but rank farther",
+				   cpu, other);
+			return -EINVAL;
+		}
+	}
+
+	return 0;
+}
+
 __weak
 int scx_selftest_topology_print(void)
 {
@@ -50,6 +92,7 @@ int scx_selftest_topology(void)
 	}
 
 	SCX_TOPOLOGY_SELFTEST(contains);
+	SCX_TOPOLOGY_SELFTEST(cpu_info);
 	SCX_TOPOLOGY_SELFTEST(print);
 
 	return 0;
@@ -18,6 +18,8 @@ u64 topo_nodes[TOPO_MAX_LEVEL][NR_CPUS];
 
 int nr_topo_nodes[TOPO_MAX_LEVEL];
 
+struct topo_cpu_info topo_cpus[NR_CPUS];
+
 __hidden
 int topo_contains(topo_ptr topo, u32 cpu)
 {
@@ -30,6 +32,66 @@ int topo_subset(topo_ptr topo, scx_bitmap_t mask)
 	return scx_bitmap_subset(topo->mask, mask);
 }
 
+/*
+ * Record the core, LLC and node of a new CPU leaf in topo_cpus. The
+ * ancestors are already in place, topo_init() adds nodes top down.
+ */
+static
+int topo_cpu_info_init(topo_ptr topo)
+{
+	struct topo_cpu_info *info;
+	topo_ptr ancestor;
+	s32 cpu = -1;
+	u64 word;
+	int i;
+
+	/* The leaf's mask holds just its CPU. */
+	bpf_for(i, 0, SCXMASK_NLONG) {
+		if (i >= mask_size)
+			break;
+
+		word = topo->mask->bits[i];
+		if (word) {
+			cpu = i * 64 + scx_ffs(word);
+			break;
+		}
+	}
+
+	if (cpu < 0 || cpu >= NR_CPUS) {
+		bpf_printk("invalid cpu %d in topology leaf", cpu);
+		return -EINVAL;
+	}
+
+	info = &topo_cpus[cpu];
+
+	ancestor = topo->parent;
+	bpf_for(i, 0, TOPO_MAX_LEVEL) {
+		if (!ancestor)
+			break;
+
+		switch (ancestor->level) {
+		case TOPO_CORE:
+			info->core_id = ancestor->id;
+			break;
+		case TOPO_LLC:
+			info->llc_id = ancestor->id;
+			info->llc_mask = ancestor->mask;
+			break;
+		case TOPO_NODE:
+			info->node_id = ancestor->id;
+			break;
+		default:
+			break;
+		}
+
+		ancestor = ancestor->parent;
+	}
+
+	info->valid = 1;
+
+	return 0;
+}
+
 static
 topo_ptr topo_node(topo_ptr parent, scx_bitmap_t mask, u64 id)
 {
@@ -63,6 +125,9 @@ topo_ptr topo_node(topo_ptr parent, scx_bitmap_t mask, u64 id)
 
 	topo_nodes[topo->level][topo->id] = (u64)topo;
 
+	if (topo->level == TOPO_CPU && topo_cpu_info_init(topo))
+		return NULL;
+
 	return topo;
 }
 
@@ -368,22 +433,17 @@ topo_iter_level_internal(struct topo_iter *iter, enum topo_level lvl)
 __weak int
 topo_cpu_to_llc_id(u32 cpu)
 {
-	topo_ptr topo;
-	u32 id;
+	int id;
 
 	if (cpu >= nr_cpu_ids) {
 		bpf_printk("invalid cpu id: %u", cpu);
 		return -EINVAL;
 	}
 
-	topo = (topo_ptr)topo_nodes[TOPO_CPU][cpu];
-	if (!topo) {
+	id = topo_cpu_llc_id(cpu);
+	if (id < 0)
 		bpf_printk("cpu %u has no topology node set", cpu);
-		return -EINVAL;
-	}
 
-	/* TOPO_CPU -> TOPO_CORE -> TOPO_LLC */
-	id = topo->parent->parent->id;
 	return id;
 }
 
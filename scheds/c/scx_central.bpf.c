@@ -37,6 +37,38 @@
  *    SCX_KICK_PREEMPT is used to trigger scheduling and CPUs to move to the
  *    next tasks.
  *
+ * d. Sharding
+ *
+ *    On large machines a single central CPU can't keep up, so the CPUs can be
+ *    split into shards, e.g. one per LLC or NUMA node, each with its own
+ *    central CPU, queue and periodic timer. Tasks are queued on the shard of
+ *    the CPU they last ran on and a shard's central CPU only dispatches to its
+ *    own CPUs. When a shard's queue is full, enqueue spills into the next
+ *    shard with room, and a central CPU whose queue runs dry steals from the
+ *    other shards. Without sharding, there is a single shard covering all
+ *    CPUs.
+ *
+ * e. Batched handoff
+ *
+ *    CPUs that ran out of tasks flag themselves in a word-packed gimme bitmap,
+ *    laid out so that each shard's CPUs are contiguous. The central CPU only
+ *    visits the flagged CPUs by scanning the bitmap with find-first-set, and
+ *    can hand each of them up to dispatch_depth tasks at once. The tasks
+ *    queued behind the running one are picked up when the timer preempts it,
+ *    which saves a kick and a trip through the central CPU per task.
+ *
+ * f. Affinity buckets
+ *
+ *    Tasks that can't run on every CPU of their shard, e.g. pinned pollers
+ *    or taskset'd services, don't go through the shard queue where most pops
+ *    would find them unable to run on the requesting CPU. Each CPU has its
+ *    own bucket DSQ instead. Such a task is queued on the bucket of an
+ *    allowed CPU, and the central CPU serves a CPU's bucket before its shard
+ *    queue whenever it hands that CPU tasks. A CPU that finds both empty
+ *    pulls tasks it may run from the buckets of the other CPUs of its shard,
+ *    so a task allowed on several CPUs doesn't wait for the one it's queued
+ *    on.
+ *
  * This scheduler is designed to maximize usage of various SCX mechanisms. A
  * more practical implementation would likely put the scheduling loop outside
  * the central CPU's dispatch() path and add some form of priority mechanism.
@@ -51,30 +83,73 @@ char _license[] SEC("license") = "GPL";
 
 enum {
 	FALLBACK_DSQ_ID		= 0,
+	BUCKET_DSQ_BASE		= 1,	/* + cpu */
+	MAX_SHARDS		= 64,
+	CENTRAL_Q_LEN		= 4096,
 	MS_TO_NS		= 1000LLU * 1000,
 	TIMER_INTERVAL_NS	= 1 * MS_TO_NS,
 };
 
-const volatile s32 central_cpu;
 const volatile u32 nr_cpu_ids = 1;	/* !0 for veristat, set during init */
 const volatile u64 slice_ns;
+const volatile u32 dispatch_depth = 1;	/* tasks handed to a CPU at once */
+const volatile u32 nr_gimme_words = 1;
+
+/*
+ * Shard s is scheduled by shard_central[s] and owns the CPUs in
+ * shard_cpus[shard_first[s], shard_first[s + 1]). All set by user space.
+ */
+const volatile u32 nr_shards = 1;
+const volatile s32 shard_central[MAX_SHARDS];
+const volatile u32 shard_first[MAX_SHARDS + 1];
 
 bool timer_pinned = true;
 u64 nr_total, nr_locals, nr_queued, nr_lost_pids;
 u64 nr_timers, nr_dispatches, nr_mismatches, nr_retries;
-u64 nr_overflows;
+u64 nr_overflows, nr_spills, nr_steals, nr_bucketed, nr_bucket_pulls;
+
+u64 shard_nr_queued[MAX_SHARDS];
+bool shard_timer_started[MAX_SHARDS];
 
 UEI_DEFINE(uei);
 
-struct {
+struct central_q_map {
 	__uint(type, BPF_MAP_TYPE_QUEUE);
-	__uint(max_entries, 4096);
+	__uint(max_entries, CENTRAL_Q_LEN);
 	__type(value, s32);
-} central_q SEC(".maps");
+};
+
+/* Shard 0's queue, user space creates the others after loading. */
+struct central_q_map central_q SEC(".maps");
+
+struct {
+	__uint(type, BPF_MAP_TYPE_ARRAY_OF_MAPS);
+	__uint(max_entries, MAX_SHARDS);
+	__type(key, u32);
+	__array(values, struct central_q_map);
+} central_qs SEC(".maps") = {
+	.values = { [0] = &central_q },
+};
 
 /* can't use percpu map due to bad lookups */
-bool RESIZABLE_ARRAY(data, cpu_gimme_task);
 u64 RESIZABLE_ARRAY(data, cpu_started_at);
+u32 RESIZABLE_ARRAY(data, cpu_shard);
+s32 RESIZABLE_ARRAY(data, shard_cpus);
+u32 RESIZABLE_ARRAY(data, cpu_pos);	/* index of each CPU in shard_cpus */
+
+/* Bit i is set when shard_cpus[i] wants a task. */
+u64 RESIZABLE_ARRAY(data, gimme_mask);
+
+struct shard_mask {
+	struct bpf_cpumask __kptr *mask;
+};
+
+struct {
+	__uint(type, BPF_MAP_TYPE_ARRAY);
+	__uint(max_entries, MAX_SHARDS);
+	__type(key, u32);
+	__type(value, struct shard_mask);
+} shard_masks SEC(".maps");
 
 struct central_timer {
 	struct bpf_timer timer;
@@ -82,26 +157,113 @@ struct central_timer {
 
 struct {
 	__uint(type, BPF_MAP_TYPE_ARRAY);
-	__uint(max_entries, 1);
+	__uint(max_entries, MAX_SHARDS);
 	__type(key, u32);
 	__type(value, struct central_timer);
 } central_timer SEC(".maps");
 
+static u32 cpu_to_shard(s32 cpu)
+{
+	u32 *shard = ARRAY_ELEM_PTR(cpu_shard, cpu, nr_cpu_ids);
+
+	return shard && *shard < nr_shards ? *shard : 0;
+}
+
+static s32 shard_central_cpu(u32 shard)
+{
+	return shard_central[shard & (MAX_SHARDS - 1)];
+}
+
+/*
+ * Queue @pid on @shard, spilling into the following shards if it's full.
+ * On success, @shard is updated to the shard the pid ended up on.
+ */
+static int shard_push(u32 *shard, s32 pid)
+{
+	u32 i, s;
+	void *q;
+
+	bpf_for(i, 0, nr_shards) {
+		s = (*shard + i) % nr_shards;
+		q = bpf_map_lookup_elem(&central_qs, &s);
+		if (!q || bpf_map_push_elem(q, &pid, 0))
+			continue;
+
+		if (i)
+			__sync_fetch_and_add(&nr_spills, 1);
+		__sync_fetch_and_add(&shard_nr_queued[s & (MAX_SHARDS - 1)], 1);
+		*shard = s;
+		return 0;
+	}
+
+	return -ENOSPC;
+}
+
+/* Pop a pid from @shard, stealing from the other shards if it's empty. */
+static int shard_pop(u32 shard, s32 *pid)
+{
+	u32 i, s;
+	void *q;
+
+	bpf_for(i, 0, nr_shards) {
+		s = (shard + i) % nr_shards;
+		q = bpf_map_lookup_elem(&central_qs, &s);
+		if (!q || bpf_map_pop_elem(q, pid))
+			continue;
+
+		if (i)
+			__sync_fetch_and_add(&nr_steals, 1);
+		__sync_fetch_and_sub(&shard_nr_queued[s & (MAX_SHARDS - 1)], 1);
+		return 0;
+	}
+
+	return -ENOENT;
+}
+
+/* Can @p run on every CPU of @shard? */
+static bool task_fits_shard(struct task_struct *p, u32 shard)
+{
+	struct shard_mask *sm;
+	struct bpf_cpumask *mask;
+
+	if (p->nr_cpus_allowed >= nr_cpu_ids)
+		return true;
+
+	sm = bpf_map_lookup_elem(&shard_masks, &shard);
+	if (!sm)
+		return true;
+
+	mask = sm->mask;
+	return !mask || bpf_cpumask_subset(cast_mask(mask), p->cpus_ptr);
+}
+
 s32 BPF_STRUCT_OPS(central_select_cpu, struct task_struct *p,
 		   s32 prev_cpu, u64 wake_flags)
 {
+	/*
+	 * Tasks restricted to a subset of the shard are bucketed on the CPU
+	 * they're enqueued on, don't pile them all up on the central CPU.
+	 */
+	if (!task_fits_shard(p, cpu_to_shard(prev_cpu))) {
+		s32 cpu = scx_bpf_pick_idle_cpu(p->cpus_ptr, 0);
+
+		return cpu >= 0 ? cpu : prev_cpu;
+	}
+
 	/*
 	 * Steer wakeups to the central CPU as much as possible to avoid
 	 * disturbing other CPUs. It's safe to blindly return the central cpu as
 	 * select_cpu() is a hint and if @p can't be on it, the kernel will
 	 * automatically pick a fallback CPU.
 	 */
-	return central_cpu;
+	return shard_central_cpu(cpu_to_shard(prev_cpu));
 }
 
 void BPF_STRUCT_OPS(central_enqueue, struct task_struct *p, u64 enq_flags)
 {
 	s32 pid = p->pid;
+	s32 cpu;
+	u32 shard;
 
 	__sync_fetch_and_add(&nr_total, 1);
 
@@ -118,7 +280,26 @@ void BPF_STRUCT_OPS(central_enqueue, struct task_struct *p, u64 enq_flags)
 		return;
 	}
 
-	if (bpf_map_push_elem(&central_q, &pid, 0)) {
+	cpu = scx_bpf_task_cpu(p);
+	shard = cpu_to_shard(cpu);
+
+	/* Route restricted tasks straight to an allowed CPU's bucket. */
+	if (!task_fits_shard(p, shard)) {
+		if (!bpf_cpumask_test_cpu(cpu, p->cpus_ptr))
+			cpu = scx_bpf_pick_any_cpu(p->cpus_ptr, 0);
+
+		if (cpu >= 0 && cpu < nr_cpu_ids) {
+			__sync_fetch_and_add(&nr_bucketed, 1);
+			scx_bpf_dsq_insert(p, BUCKET_DSQ_BASE + cpu, SCX_SLICE_INF,
+					   enq_flags);
+			if (!scx_bpf_task_running(p))
+				scx_bpf_kick_cpu(shard_central_cpu(cpu_to_shard(cpu)),
+						 SCX_KICK_PREEMPT);
+			return;
+		}
+	}
+
+	if (shard_push(&shard, pid)) {
 		__sync_fetch_and_add(&nr_overflows, 1);
 		scx_bpf_dsq_insert(p, FALLBACK_DSQ_ID, SCX_SLICE_INF, enq_flags);
 		return;
@@ -127,16 +308,102 @@ void BPF_STRUCT_OPS(central_enqueue, struct task_struct *p, u64 enq_flags)
 	__sync_fetch_and_add(&nr_queued, 1);
 
 	if (!scx_bpf_task_running(p))
-		scx_bpf_kick_cpu(central_cpu, SCX_KICK_PREEMPT);
+		scx_bpf_kick_cpu(shard_central_cpu(shard), SCX_KICK_PREEMPT);
 }
 
-static bool dispatch_to_cpu(s32 cpu)
+static void gimme_set(s32 cpu)
 {
+	u32 *pos = ARRAY_ELEM_PTR(cpu_pos, cpu, nr_cpu_ids);
+	u64 *word;
+
+	if (!pos)
+		return;
+
+	word = ARRAY_ELEM_PTR(gimme_mask, *pos / 64, nr_gimme_words);
+	if (word)
+		__sync_fetch_and_or(word, 1LLU << (*pos % 64));
+}
+
+/* Bits of gimme word @w that belong to positions [@first, @last). */
+static u64 gimme_range(u32 w, u32 first, u32 last)
+{
+	u32 lo = first > w * 64 ? first - w * 64 : 0;
+	u32 hi = last < (w + 1) * 64 ? last - w * 64 : 64;
+	u64 mask = hi < 64 ? (1LLU << hi) - 1 : ~0LLU;
+
+	return mask & ~((1LLU << lo) - 1);
+}
+
+/*
+ * Move tasks that can run on @cpu from the buckets of the other CPUs of
+ * @shard to @cpu until it has dispatch_depth of them. Returns the new count.
+ */
+static u32 pull_from_buckets(s32 cpu, u32 shard, u32 nr_dispatched)
+{
+	u32 first = shard_first[shard & (MAX_SHARDS - 1)];
+	u32 last = shard_first[(shard & (MAX_SHARDS - 1)) + 1];
 	struct task_struct *p;
+	int pos;
+
+	bpf_for(pos, first, last) {
+		s32 *cpup = ARRAY_ELEM_PTR(shard_cpus, pos, nr_cpu_ids);
+		u64 dsq_id;
+
+		if (!cpup || nr_dispatched >= dispatch_depth)
+			break;
+
+		dsq_id = BUCKET_DSQ_BASE + *cpup;
+		if (*cpup == cpu || !scx_bpf_dsq_nr_queued(dsq_id))
+			continue;
+
+		bpf_for_each(scx_dsq, p, dsq_id, 0) {
+			if (nr_dispatched >= dispatch_depth)
+				break;
+
+			if (!bpf_cpumask_test_cpu(cpu, p->cpus_ptr))
+				continue;
+
+			if (__COMPAT_scx_bpf_dsq_move(BPF_FOR_EACH_ITER, p,
+						      SCX_DSQ_LOCAL_ON | cpu, 0)) {
+				__sync_fetch_and_add(&nr_bucket_pulls, 1);
+				nr_dispatched++;
+			}
+		}
+	}
+
+	return nr_dispatched;
+}
+
+/* Hand up to dispatch_depth tasks to @cpu. Returns how many were handed. */
+static u32 dispatch_to_cpu(s32 cpu, u32 shard)
+{
+	struct task_struct *p;
+	u32 nr_dispatched = 0;
 	s32 pid;
 
+	/* Tasks that can only run on a few CPUs first, they can't go elsewhere. */
+	bpf_for_each(scx_dsq, p, BUCKET_DSQ_BASE + cpu, 0) {
+		if (nr_dispatched >= dispatch_depth)
+			break;
+
+		if (__COMPAT_scx_bpf_dsq_move(BPF_FOR_EACH_ITER, p,
+					      SCX_DSQ_LOCAL_ON | cpu, 0))
+			nr_dispatched++;
+	}
+
 	bpf_repeat(BPF_MAX_LOOPS) {
-		if (bpf_map_pop_elem(&central_q, &pid))
+		if (nr_dispatched >= dispatch_depth)
+			break;
+
+		/*
+		 * We might run out of dispatch buffer slots, e.g. if we keep
+		 * bouncing tasks to the fallback DSQ. In such a case, stop as
+		 * the next dispatch operation would fail.
+		 */
+		if (!scx_bpf_dispatch_nr_slots())
+			break;
+
+		if (shard_pop(shard, &pid))
 			break;
 
 		__sync_fetch_and_sub(&nr_queued, 1);
@@ -148,56 +415,100 @@ static bool dispatch_to_cpu(s32 cpu)
 		}
 
 		/*
-		 * If we can't run the task at the top, do the dumb thing and
-		 * bounce it to the fallback dsq.
+		 * The task's affinity changed since it was queued, or it was
+		 * stolen from another shard. Move it to the bucket of a CPU it
+		 * can run on, and only fall back to the fallback dsq if there's
+		 * none.
 		 */
 		if (!bpf_cpumask_test_cpu(cpu, p->cpus_ptr)) {
+			s32 target = scx_bpf_task_cpu(p);
+			u64 dsq_id = FALLBACK_DSQ_ID;
+
 			__sync_fetch_and_add(&nr_mismatches, 1);
-			scx_bpf_dsq_insert(p, FALLBACK_DSQ_ID, SCX_SLICE_INF, 0);
+
+			if (!bpf_cpumask_test_cpu(target, p->cpus_ptr))
+				target = scx_bpf_pick_any_cpu(p->cpus_ptr, 0);
+			if (target >= 0 && target < nr_cpu_ids)
+				dsq_id = BUCKET_DSQ_BASE + target;
+
+			scx_bpf_dsq_insert(p, dsq_id, SCX_SLICE_INF, 0);
 			bpf_task_release(p);
-			/*
-			 * We might run out of dispatch buffer slots if we continue dispatching
-			 * to the fallback DSQ, without dispatching to the local DSQ of the
-			 * target CPU. In such a case, break the loop now as will fail the
-			 * next dispatch operation.
-			 */
-			if (!scx_bpf_dispatch_nr_slots())
-				break;
 			continue;
 		}
 
-		/* dispatch to local and mark that @cpu doesn't need more */
 		scx_bpf_dsq_insert(p, SCX_DSQ_LOCAL_ON | cpu, SCX_SLICE_INF, 0);
-
-		if (cpu != central_cpu)
-			scx_bpf_kick_cpu(cpu, SCX_KICK_IDLE);
-
 		bpf_task_release(p);
-		return true;
+		nr_dispatched++;
 	}
 
-	return false;
+	/* Nothing of our own, take restricted tasks queued on a sibling. */
+	if (!nr_dispatched)
+		nr_dispatched = pull_from_buckets(cpu, shard, nr_dispatched);
+
+	/* One kick for the whole batch. */
+	if (nr_dispatched && cpu != shard_central_cpu(shard))
+		scx_bpf_kick_cpu(cpu, SCX_KICK_IDLE);
+
+	return nr_dispatched;
 }
 
+static void start_shard_timer(u32 shard);
+
 void BPF_STRUCT_OPS(central_dispatch, s32 cpu, struct task_struct *prev)
 {
+	u32 shard = cpu_to_shard(cpu);
+	s32 central_cpu = shard_central_cpu(shard);
+
 	if (cpu == central_cpu) {
+		u32 first, last, w, i;
+		bool full = false;
+
+		/* Pin the shard's timer the first time its central CPU shows up. */
+		if (!shard_timer_started[shard & (MAX_SHARDS - 1)])
+			start_shard_timer(shard);
+
 		/* dispatch for all other CPUs first */
 		__sync_fetch_and_add(&nr_dispatches, 1);
 
-		bpf_for(cpu, 0, nr_cpu_ids) {
-			bool *gimme;
+		first = shard_first[shard & (MAX_SHARDS - 1)];
+		last = shard_first[(shard & (MAX_SHARDS - 1)) + 1];
 
-			if (!scx_bpf_dispatch_nr_slots())
+		/* Only visit the CPUs that asked, central's gimme is never set. */
+		bpf_for(w, first / 64, (last + 63) / 64) {
+			u64 *word = ARRAY_ELEM_PTR(gimme_mask, w, nr_gimme_words);
+			u64 bits;
+
+			if (!word)
 				break;
 
-			/* central's gimme is never set */
-			gimme = ARRAY_ELEM_PTR(cpu_gimme_task, cpu, nr_cpu_ids);
-			if (!gimme || !*gimme)
-				continue;
+			bits = *word & gimme_range(w, first, last);
+
+			bpf_for(i, 0, 64) {
+				u32 bit, pos;
+				s32 *cpup;
+
+				if (!bits)
+					break;
+
+				if (!scx_bpf_dispatch_nr_slots()) {
+					full = true;
+					break;
+				}
 
-			if (dispatch_to_cpu(cpu))
-				*gimme = false;
+				bit = ctzll(bits);
+				bits &= bits - 1;
+				pos = w * 64 + bit;
+
+				cpup = ARRAY_ELEM_PTR(shard_cpus, pos, nr_cpu_ids);
+				if (!cpup)
+					break;
+
+				if (dispatch_to_cpu(*cpup, shard))
+					__sync_fetch_and_and(word, ~(1LLU << bit));
+			}
+
+			if (full)
+				break;
 		}
 
 		/*
@@ -216,16 +527,12 @@ void BPF_STRUCT_OPS(central_dispatch, s32 cpu, struct task_struct *prev)
 		/* look for a task to run on the central CPU */
 		if (scx_bpf_dsq_move_to_local(FALLBACK_DSQ_ID))
 			return;
-		dispatch_to_cpu(central_cpu);
+		dispatch_to_cpu(central_cpu, shard);
 	} else {
-		bool *gimme;
-
 		if (scx_bpf_dsq_move_to_local(FALLBACK_DSQ_ID))
 			return;
 
-		gimme = ARRAY_ELEM_PTR(cpu_gimme_task, cpu, nr_cpu_ids);
-		if (gimme)
-			*gimme = true;
+		gimme_set(cpu);
 
 		/*
 		 * Force dispatch on the scheduling CPU so that it finds a task
@@ -253,8 +560,12 @@ void BPF_STRUCT_OPS(central_stopping, struct task_struct *p, bool runnable)
 
 static int central_timerfn(void *map, int *key, struct bpf_timer *timer)
 {
+	u32 shard = (u32)*key & (MAX_SHARDS - 1);
+	s32 central_cpu = shard_central_cpu(shard);
 	u64 now = scx_bpf_now();
-	u64 nr_to_kick = nr_queued;
+	u64 nr_to_kick = shard_nr_queued[shard];
+	u32 first = shard_first[shard];
+	u32 nr = shard_first[shard + 1] - first;
 	s32 i, curr_cpu;
 
 	curr_cpu = bpf_get_smp_processor_id();
@@ -264,10 +575,16 @@ static int central_timerfn(void *map, int *key, struct bpf_timer *timer)
 		return 0;
 	}
 
-	bpf_for(i, 0, nr_cpu_ids) {
-		s32 cpu = (nr_timers + i) % nr_cpu_ids;
+	bpf_for(i, 0, nr) {
+		s32 *cpup = ARRAY_ELEM_PTR(shard_cpus, first + (nr_timers + i) % nr,
+					   nr_cpu_ids);
+		s32 cpu;
 		u64 *started_at;
 
+		if (!cpup)
+			break;
+		cpu = *cpup;
+
 		if (cpu == central_cpu)
 			continue;
 
@@ -279,6 +596,7 @@ static int central_timerfn(void *map, int *key, struct bpf_timer *timer)
 
 		/* and there's something pending */
 		if (scx_bpf_dsq_nr_queued(FALLBACK_DSQ_ID) ||
+		    scx_bpf_dsq_nr_queued(BUCKET_DSQ_BASE + cpu) ||
 		    scx_bpf_dsq_nr_queued(SCX_DSQ_LOCAL_ON | cpu))
 			;
 		else if (nr_to_kick)
@@ -294,27 +612,91 @@ static int central_timerfn(void *map, int *key, struct bpf_timer *timer)
 	return 0;
 }
 
+/*
+ * Arm the timer of @shard. BPF_F_TIMER_CPU_PIN pins it to the calling CPU,
+ * so this must run on the shard's central CPU.
+ */
+static void start_shard_timer(u32 shard)
+{
+	struct bpf_timer *timer;
+	u32 key = shard;
+	int ret;
+
+	timer = bpf_map_lookup_elem(&central_timer, &key);
+	if (!timer)
+		return;
+
+	ret = bpf_timer_start(timer, TIMER_INTERVAL_NS,
+			      timer_pinned ? BPF_F_TIMER_CPU_PIN : 0);
+	if (ret) {
+		scx_bpf_error("bpf_timer_start failed for shard %u (%d)", shard, ret);
+		return;
+	}
+
+	shard_timer_started[shard & (MAX_SHARDS - 1)] = true;
+}
+
 int BPF_STRUCT_OPS_SLEEPABLE(central_init)
 {
 	u32 key = 0;
 	struct bpf_timer *timer;
+	s32 cpu;
 	int ret;
 
 	ret = scx_bpf_create_dsq(FALLBACK_DSQ_ID, -1);
 	if (ret)
 		return ret;
 
-	timer = bpf_map_lookup_elem(&central_timer, &key);
-	if (!timer)
-		return -ESRCH;
-
-	if (bpf_get_smp_processor_id() != central_cpu) {
+	if (bpf_get_smp_processor_id() != shard_central_cpu(0)) {
 		scx_bpf_error("init from non-central CPU");
 		return -EINVAL;
 	}
 
-	bpf_timer_init(timer, &central_timer, CLOCK_MONOTONIC);
-	bpf_timer_set_callback(timer, central_timerfn);
+	bpf_for(cpu, 0, nr_cpu_ids) {
+		ret = scx_bpf_create_dsq(BUCKET_DSQ_BASE + cpu, -1);
+		if (ret)
+			return ret;
+	}
+
+	/* The other shards' timers are started from their central CPUs. */
+	bpf_for(key, 0, nr_shards) {
+		u32 first = shard_first[key & (MAX_SHARDS - 1)];
+		u32 last = shard_first[(key & (MAX_SHARDS - 1)) + 1];
+		struct bpf_cpumask *mask;
+		struct shard_mask *sm;
+		u32 i;
+
+		timer = bpf_map_lookup_elem(&central_timer, &key);
+		if (!timer)
+			return -ESRCH;
+
+		bpf_timer_init(timer, &central_timer, CLOCK_MONOTONIC);
+		bpf_timer_set_callback(timer, central_timerfn);
+
+		sm = bpf_map_lookup_elem(&shard_masks, &key);
+		if (!sm)
+			return -ESRCH;
+
+		mask = bpf_cpumask_create();
+		if (!mask)
+			return -ENOMEM;
+
+		bpf_for(i, first, last) {
+			s32 *cpup = ARRAY_ELEM_PTR(shard_cpus, i, nr_cpu_ids);
+
+			if (cpup)
+				bpf_cpumask_set_cpu(*cpup, mask);
+		}
+
+		mask = bpf_kptr_xchg(&sm->mask, mask);
+		if (mask)
+			bpf_cpumask_release(mask);
+	}
+
+	key = 0;
+	timer = bpf_map_lookup_elem(&central_timer, &key);
+	if (!timer)
+		return -ESRCH;
 
 	ret = bpf_timer_start(timer, TIMER_INTERVAL_NS, BPF_F_TIMER_CPU_PIN);
 	/*
@@ -330,6 +712,8 @@ int BPF_STRUCT_OPS_SLEEPABLE(central_init)
 	}
 	if (ret)
 		scx_bpf_error("bpf_timer_start failed (%d)", ret);
+	else
+		shard_timer_started[0] = true;
 	return ret;
 }
 
@@ -14,6 +14,7 @@
 #include <libgen.h>
 #include <bpf/bpf.h>
 #include <scx/common.h>
+#include <scx/topology.h>
 #include "scx_central.bpf.skel.h"
 
 const char help_fmt[] =
@@ -21,10 +22,12 @@ const char help_fmt[] =
 "\n"
 "See the top-level comment in .bpf.c for more details.\n"
 "\n"
-"Usage: %s [-s SLICE_US] [-c CPU]\n"
+"Usage: %s [-s SLICE_US] [-c CPU] [-S llc|node] [-d DEPTH]\n"
 "\n"
 "  -s SLICE_US   Override slice duration\n"
 "  -c CPU        Override the central CPU (default: 0)\n"
+"  -S SHARD      Run one central CPU per LLC or NUMA node (default: one in total)\n"
+"  -d DEPTH      Hand up to DEPTH tasks to a CPU at once (default: 1)\n"
 "  -i INTERVAL   Override the sleep interval (default: 1)\n"
 "  -v            Print libbpf debug messages\n"
 "  -h            Display this help and exit\n";
@@ -33,6 +36,93 @@ static bool verbose;
 static volatile int exit_req;
 static u32 sleep_time = 1;
 
+/*
+ * Split the CPUs into shards by LLC or NUMA node. The central CPU's shard
+ * comes first, as shard 0 is set up from the loading thread. The other
+ * shards are scheduled from their first CPU. CPUs whose domain can't be
+ * read, e.g. offline ones, go to shard 0.
+ */
+static void setup_shards(struct scx_central *skel, enum scx_shard_mode mode)
+{
+	u32 nr_cpus = skel->rodata->nr_cpu_ids;
+	u32 max_shards = sizeof(skel->rodata->shard_central) /
+			 sizeof(skel->rodata->shard_central[0]);
+	s32 central_cpu = skel->rodata->shard_central[0];
+	u32 *cpu_shard = skel->data_cpu_shard->cpu_shard;
+	s32 *shard_cpus = skel->data_shard_cpus->shard_cpus;
+	u32 *cpu_pos = skel->data_cpu_pos->cpu_pos;
+	int dom_ids[max_shards];
+	u32 nr_shards = 0, shard, cpu, i, pos;
+
+	for (i = 0; i < nr_cpus; i++) {
+		int id;
+
+		cpu = i ? (i <= (u32)central_cpu ? i - 1 : i) : central_cpu;
+		id = scx_cpu_shard_id(cpu, mode);
+
+		/*
+		 * Shard 0 belongs to the requested central CPU even if its
+		 * domain can't be read, in which case no other CPU joins it
+		 * by domain.
+		 */
+		if (!i) {
+			dom_ids[nr_shards++] = id;
+			cpu_shard[cpu] = 0;
+			continue;
+		}
+
+		if (id < 0) {
+			cpu_shard[cpu] = 0;
+			continue;
+		}
+
+		for (shard = 0; shard < nr_shards; shard++)
+			if (dom_ids[shard] == id)
+				break;
+
+		if (shard == nr_shards) {
+			SCX_BUG_ON(nr_shards == max_shards,
+				   "More than %u shards", max_shards);
+			dom_ids[nr_shards++] = id;
+			skel->rodata->shard_central[shard] = cpu;
+		}
+
+		cpu_shard[cpu] = shard;
+	}
+
+	/* Lay out each shard's CPUs contiguously. */
+	pos = 0;
+	for (shard = 0; shard < nr_shards; shard++) {
+		skel->rodata->shard_first[shard] = pos;
+		for (cpu = 0; cpu < nr_cpus; cpu++) {
+			if (cpu_shard[cpu] != shard)
+				continue;
+			cpu_pos[cpu] = pos;
+			shard_cpus[pos++] = cpu;
+		}
+	}
+	skel->rodata->shard_first[nr_shards] = pos;
+	skel->rodata->nr_shards = nr_shards;
+}
+
+/* Shard 0 uses the static central_q, create a queue for every other shard. */
+static void create_shard_queues(struct scx_central *skel)
+{
+	int outer_fd = bpf_map__fd(skel->maps.central_qs);
+	u32 qlen = bpf_map__max_entries(skel->maps.central_q);
+	u32 shard;
+
+	for (shard = 1; shard < skel->rodata->nr_shards; shard++) {
+		int fd = bpf_map_create(BPF_MAP_TYPE_QUEUE, "central_q", 0,
+					sizeof(__s32), qlen, NULL);
+
+		SCX_BUG_ON(fd < 0, "Failed to create queue for shard %u", shard);
+		SCX_BUG_ON(bpf_map_update_elem(outer_fd, &shard, &fd, BPF_ANY),
+			   "Failed to install queue for shard %u", shard);
+		close(fd);
+	}
+}
+
 static int libbpf_print_fn(enum libbpf_print_level level, const char *format, va_list args)
 {
 	if (level == LIBBPF_DEBUG && !verbose)
@@ -52,6 +142,8 @@ int main(int argc, char **argv)
 	__u64 seq = 0, ecode;
 	__s32 opt;
 	cpu_set_t *cpuset;
+	enum scx_shard_mode shard_mode = SCX_SHARD_NONE;
+	u32 shard;
 
 	libbpf_set_print(libbpf_print_fn);
 	signal(SIGINT, sigint_handler);
@@ -59,14 +151,14 @@ int main(int argc, char **argv)
 restart:
 	skel = SCX_OPS_OPEN(central_ops, scx_central);
 
-	skel->rodata->central_cpu = 0;
+	skel->rodata->shard_central[0] = 0;
 	skel->rodata->nr_cpu_ids = libbpf_num_possible_cpus();
 	skel->rodata->slice_ns = __COMPAT_ENUM_OR_ZERO("scx_public_consts", "SCX_SLICE_DFL");
 
 	assert(skel->rodata->nr_cpu_ids > 0);
 	assert(skel->rodata->nr_cpu_ids <= INT32_MAX);
 
-	while ((opt = getopt(argc, argv, "s:c:i:pvh")) != -1) {
+	while ((opt = getopt(argc, argv, "s:c:S:d:i:pvh")) != -1) {
 		switch (opt) {
 		case 's':
 			skel->rodata->slice_ns = strtoull(optarg, NULL, 0) * 1000;
@@ -77,7 +169,22 @@ restart:
 				fprintf(stderr, "invalid central CPU id value, %u given (%u max)\n", central_cpu, skel->rodata->nr_cpu_ids);
 				return -1;
 			}
-			skel->rodata->central_cpu = (s32)central_cpu;
+			skel->rodata->shard_central[0] = (s32)central_cpu;
+			break;
+		}
+		case 'S':
+			if (scx_shard_mode_parse(optarg, &shard_mode)) {
+				fprintf(stderr, "invalid shard mode %s (llc or node)\n", optarg);
+				return -1;
+			}
+			break;
+		case 'd': {
+			u32 depth = strtoul(optarg, NULL, 0);
+			if (depth < 1) {
+				fprintf(stderr, "invalid dispatch depth (1 min)\n");
+				return -1;
+			}
+			skel->rodata->dispatch_depth = depth;
 			break;
 		}
 		case 'i': {
@@ -98,11 +205,26 @@ restart:
 	}
 
 	/* Resize arrays so their element count is equal to cpu count. */
-	RESIZE_ARRAY(skel, data, cpu_gimme_task, skel->rodata->nr_cpu_ids);
 	RESIZE_ARRAY(skel, data, cpu_started_at, skel->rodata->nr_cpu_ids);
+	RESIZE_ARRAY(skel, data, cpu_shard, skel->rodata->nr_cpu_ids);
+	RESIZE_ARRAY(skel, data, shard_cpus, skel->rodata->nr_cpu_ids);
+	RESIZE_ARRAY(skel, data, cpu_pos, skel->rodata->nr_cpu_ids);
+
+	skel->rodata->nr_gimme_words = (skel->rodata->nr_cpu_ids + 63) / 64;
+	RESIZE_ARRAY(skel, data, gimme_mask, skel->rodata->nr_gimme_words);
+
+	setup_shards(skel, shard_mode);
 
 	SCX_OPS_LOAD(skel, central_ops, scx_central, uei);
 
+	create_shard_queues(skel);
+
+	for (shard = 0; shard < skel->rodata->nr_shards; shard++)
+		printf("shard %u: central CPU %d, %u CPUs\n", shard,
+		       skel->rodata->shard_central[shard],
+		       skel->rodata->shard_first[shard + 1] -
+		       skel->rodata->shard_first[shard]);
+
 	/*
 	 * Affinitize the loading thread to the central CPU, as:
 	 * - That's where the BPF timer is first invoked in the BPF program.
@@ -117,10 +239,10 @@ restart:
 	cpuset = CPU_ALLOC(skel->rodata->nr_cpu_ids);
 	SCX_BUG_ON(!cpuset, "Failed to allocate cpuset");
 	CPU_ZERO_S(CPU_ALLOC_SIZE(skel->rodata->nr_cpu_ids), cpuset);
-	CPU_SET(skel->rodata->central_cpu, cpuset);
+	CPU_SET(skel->rodata->shard_central[0], cpuset);
 	SCX_BUG_ON(sched_setaffinity(0, sizeof(*cpuset), cpuset),
 		   "Failed to affinitize to central CPU %d (max %d)",
-		   skel->rodata->central_cpu, skel->rodata->nr_cpu_ids - 1);
+		   skel->rodata->shard_central[0], skel->rodata->nr_cpu_ids - 1);
 	CPU_FREE(cpuset);
 
 	link = SCX_OPS_ATTACH(skel, central_ops, scx_central);
@@ -140,8 +262,13 @@ restart:
 		       skel->bss->nr_dispatches,
 		       skel->bss->nr_mismatches,
 		       skel->bss->nr_retries);
-		printf("overflow:%10" PRIu64 "\n",
-		       skel->bss->nr_overflows);
+		printf("overflow:%10" PRIu64 "    spill:%10" PRIu64 "    steal:%10" PRIu64 " bucketed:%10" PRIu64 "\n",
+		       skel->bss->nr_overflows,
+		       skel->bss->nr_spills,
+		       skel->bss->nr_steals,
+		       skel->bss->nr_bucketed);
+		printf("pulled  :%10" PRIu64 "\n",
+		       skel->bss->nr_bucket_pulls);
 		fflush(stdout);
 		sleep(sleep_time);
 	}
@@ -4,6 +4,7 @@
  *
  */
 #include <scx/common.bpf.h>
+#include <lib/prio_index.h>
 
 char _license[] SEC("license") = "GPL";
 
@@ -11,14 +12,24 @@ char _license[] SEC("license") = "GPL";
 #define SAMPLE_WINDOW_MIN 500
 #define SAMPLE_WINDOW_MAX 25000
 #define SAMPLE_COUNT 500
+#define CLAIM_RETRIES 4
+
+#define SCX_SLOT_ALLOC_NR MAX_TASKS
+#include <lib/slot_alloc.h>
 #define TIME_RATIO 100
 #define ALPHA 90
 
 static u64 vtime_now;
-static u32 map_size = 0;
+static u32 map_size = 0;	/* number of queued tasks */
 static u64 sampling_bound_ns = 500;
 static u64 avg_slice_used = 20000000; //20ms = SCX_SLICE_DFL
 
+/*
+ * Exact mode: keep runnable tasks in lib/prio_index.h and always dispatch
+ * the lowest vtime instead of sampling task_map.
+ */
+const volatile bool exact_order = false;
+
 UEI_DEFINE(uei);
 #define SHARED_DSQ 0
 
@@ -26,17 +37,25 @@ struct random_sample_ctx {
     u64 start_ns;
     u64 window_ns;
     u64 best_vtime;
+    u64 best_seq;
+    u32 best_pid;
     int  best_key;
+    u32 nr_slots;
+    u32 base;	/* first slot of a linear pass */
+    bool linear;
 };
 
+/*
+ * A slot is queued while seq is odd. The enqueue path bumps it to odd after
+ * filling in pid and vruntime, and the dispatcher claims the task by bumping
+ * it back to even with a cmpxchg, so only one CPU can dispatch it.
+ */
 struct task_ctx {
-    struct bpf_spin_lock lock;
+    u64 seq;
     u32 pid;
     u64 vruntime;
-    bool valid;
 };
 
-private(dynamic) struct bpf_spin_lock map_lock;
 private(dynamic2) struct bpf_spin_lock time_lock;
 
 struct {
@@ -84,142 +103,158 @@ void BPF_STRUCT_OPS(dynamic_enqueue, struct task_struct *p, u64 enq_flags)
     if (time_before(vtime, vtime_now - SCX_SLICE_DFL))
         vtime = vtime_now - SCX_SLICE_DFL;
 
-    bpf_spin_lock(&map_lock);
-    u32 sz = map_size;
-    map_size++;
-    bpf_spin_unlock(&map_lock);
+    if (exact_order) {
+        /* Don't lose the task if the index is out of memory. */
+        if (scx_prio_index_insert(vtime, pid))
+            scx_bpf_dsq_insert(p, SHARED_DSQ, SCX_SLICE_DFL, enq_flags);
+        return;
+    }
 
-    struct task_ctx *ti = bpf_map_lookup_elem(&task_map, &sz);
-    if (!ti) return;
+    s32 slot = scx_slot_alloc();
+    u32 key = slot;
+    struct task_ctx *ti = slot >= 0 ? bpf_map_lookup_elem(&task_map, &key) : NULL;
+    if (!ti) {
+        /* Out of slots, don't lose the task. */
+        if (slot >= 0)
+            scx_slot_free(slot);
+        scx_bpf_dsq_insert(p, SHARED_DSQ, SCX_SLICE_DFL, enq_flags);
+        return;
+    }
 
-    bpf_spin_lock(&map_lock);
-    ti->vruntime += vtime;
+    ti->vruntime = vtime;
     ti->pid = pid;
-    ti->valid = true;
-    bpf_spin_unlock(&map_lock);
-
-    //bpf_printk("Enqueue: map_size = %llu\n", map_size);
+    /* Publish the task, the slot is ours so seq is even. */
+    smp_store_release(&ti->seq, ti->seq + 1);
+    __sync_fetch_and_add(&map_size, 1);
 }
 
 static long sample_cb(u64 idx, struct random_sample_ctx *rand_cxt)
 {
     struct random_sample_ctx *s = (struct random_sample_ctx *)rand_cxt;
+    u64 seq, vruntime;
+    u32 key, pid;
+
+    if (s->linear)
+        key = (s->base + idx) % s->nr_slots;
+    else
+        key = bpf_get_prandom_u32() % s->nr_slots;
 
-    // use bpf_get_prandom_u32() inside callback
-    u32 r = bpf_get_prandom_u32();
-    bpf_spin_lock(&map_lock);
-    u32 key = r % map_size;
-    bpf_spin_unlock(&map_lock);
     struct task_ctx *ti = bpf_map_lookup_elem(&task_map, &key);
-    if (!ti || !ti->valid) return 0; // continue
+    if (!ti) return 0; // continue
 
-    if (ti->vruntime < s->best_vtime) {
-        s->best_vtime = ti->vruntime;
+    seq = smp_load_acquire(&ti->seq);
+    if (!(seq & 1)) return 0; // free slot
+
+    vruntime = ti->vruntime;
+    pid = ti->pid;
+    /* Skip the slot if it was dispatched and refilled under us. */
+    smp_rmb();
+    if (READ_ONCE(ti->seq) != seq) return 0;
+
+    if (vruntime < s->best_vtime) {
+        s->best_vtime = vruntime;
+        s->best_seq = seq;
+        s->best_pid = pid;
         s->best_key = key;
     }
 
     // Optional early exit if time exceeded:
-    if (bpf_ktime_get_ns() - s->start_ns >= s->window_ns || idx >= map_size){
-        //bpf_printk("Exited because of time: %llu\n", idx);
+    if (bpf_ktime_get_ns() - s->start_ns >= s->window_ns || idx >= s->nr_slots)
         return 1; // bpf_loop will stop early if callback returns 1
-    }
-        
+
     return 0; // continue
 }
 
-void BPF_STRUCT_OPS(dynamic_dispatch, s32 cpu, struct task_struct *prev)
+static u32 linear_base;
+
+/*
+ * Sample the slots and claim the best task found. Returns true if a task
+ * was dispatched or nothing is queued, false if another CPU claimed our
+ * pick first.
+ */
+static bool sample_and_dispatch(void)
 {
-    //bpf_printk("Dispatch Started: map_size = %llu\n", map_size);
-	// my custom rand logic to choose task
     struct random_sample_ctx s = {
         .start_ns = bpf_ktime_get_ns(),
         .window_ns = sampling_bound_ns,
         .best_vtime = (u64)-1,
         .best_key = -1,
+        .nr_slots = scx_slot_hwm(),
     };
+    struct task_struct *task;
+    struct task_ctx *ti;
+    u32 key;
+
+    if (!READ_ONCE(map_size) || !s.nr_slots)
+        return true;
+
+    bpf_loop(SAMPLE_COUNT, sample_cb, &s, 0);
+
+    /*
+     * Slots aren't compacted, so a few queued tasks can hide in a mostly
+     * free array. Fall back to walking it from a rotating position.
+     */
+    if (s.best_key < 0) {
+        s.linear = true;
+        s.base = __sync_fetch_and_add(&linear_base, SAMPLE_COUNT);
+        s.start_ns = bpf_ktime_get_ns();
+        bpf_loop(SAMPLE_COUNT, sample_cb, &s, 0);
+    }
+
+    if (s.best_key < 0)
+        return true;
 
-    if(map_size > 1){
-        long ret = bpf_loop(SAMPLE_COUNT, sample_cb, &s, 0);
-        
-        // dispatch
-        if (s.best_key >= 0) {
-            //bpf_printk("Key Found\n");
-            struct task_ctx *ti_dis = bpf_map_lookup_elem(&task_map, &s.best_key);
-            if (!ti_dis) {
-                //bpf_printk("TI_DIS null\n");
-                return; 
-            }
-            bpf_spin_lock(&map_lock);
-            u32 key = map_size - 1;
-            bpf_spin_unlock(&map_lock);
-            struct task_ctx *ti_last = bpf_map_lookup_elem(&task_map, &key);
-            if (!ti_last){
-                //bpf_printk("TI_LAST null\n");
-                return;
-            }
-            //invalidate first to ensure only one cpu can dispatch this task
-            bpf_spin_lock(&map_lock);
-            if(!ti_dis->valid || !ti_last->valid || key != map_size - 1){
-                bpf_spin_unlock(&map_lock);
-                //bpf_printk("TI_DIS OR TI_LAST INVALID OR RACE DETECTED\n");
-                return;
-            }
-            // invalidate last task in array and decrement map size
-            map_size--;
-            ti_last->valid = false;
-
-            u32 pid = ti_dis->pid;
-
-            // then move that tasks info to the index of our one about to be dispatched
-            ti_dis->pid = ti_last->pid;
-            ti_dis->vruntime = ti_last->vruntime;
-            bpf_spin_unlock(&map_lock);
-            //convert pid to task struct and dispatch that
-            struct task_struct *task = bpf_task_from_pid(pid);
-            if (!task){
-                //bpf_printk("task struct null\n");
-                return;
-            }
+    key = s.best_key;
+    ti = bpf_map_lookup_elem(&task_map, &key);
+    if (!ti)
+        return true;
 
+    if (cmpxchg(&ti->seq, s.best_seq, s.best_seq + 1) != s.best_seq)
+        return false;
+
+    __sync_fetch_and_sub(&map_size, 1);
+    scx_slot_free(key);
+
+    //convert pid to task struct and dispatch that
+    task = bpf_task_from_pid(s.best_pid);
+    if (!task)
+        return true;
+
+    scx_bpf_dsq_insert(task, SHARED_DSQ, SCX_SLICE_DFL, 0);
+    bpf_task_release(task);
+    stat_inc(2);
+    return true;
+}
+
+static void exact_dispatch(void)
+{
+    struct task_struct *task;
+    u32 pid;
+
+    if (!scx_prio_index_pop(&pid)) {
+        task = bpf_task_from_pid(pid);
+        if (task) {
             scx_bpf_dsq_insert(task, SHARED_DSQ, SCX_SLICE_DFL, 0);
             bpf_task_release(task);
-            //bpf_printk("Successful Dispatch\n");
             stat_inc(2);
         }
-        else{
-            //bpf_printk("Nothing decided: map_size = %llu\n", map_size);
-        }
     }
-    if(map_size == 1){
-        u32 key = 0;
-        struct task_ctx *ti = bpf_map_lookup_elem(&task_map, &key);
-        if (!ti){
-            //bpf_printk("TI null\n");
-            return;
-        }
-        //invalidate first to ensure only one cpu can dispatch this task
-        bpf_spin_lock(&map_lock);
-        if(!ti->valid || map_size != 1){
-            bpf_spin_unlock(&map_lock);
-            //bpf_printk("TI INVALID OR RACE DETECTED\n");
-            return;
-        }
-        // invalidate the task in array and decrement map size
-        map_size--;
-        ti->valid = false;
-        u32 pid = ti->pid;
+    scx_bpf_dsq_move_to_local(SHARED_DSQ);
+}
+
+void BPF_STRUCT_OPS(dynamic_dispatch, s32 cpu, struct task_struct *prev)
+{
+    int i;
 
-        bpf_spin_unlock(&map_lock);
+    if (exact_order) {
+        exact_dispatch();
+        return;
+    }
 
-        struct task_struct *task = bpf_task_from_pid(pid);
-        if (!task){
-            //bpf_printk("task struct null\n");
-            return;
-        }
-        scx_bpf_dsq_insert(task, SHARED_DSQ, SCX_SLICE_DFL, 0);
-        bpf_task_release(task);
-        //bpf_printk("Successful Dispatch\n");
-        stat_inc(2);
+    /* Losing a claim race only costs another round of sampling. */
+    bpf_for(i, 0, CLAIM_RETRIES) {
+        if (sample_and_dispatch())
+            break;
     }
     scx_bpf_dsq_move_to_local(SHARED_DSQ);
 }
@@ -253,6 +288,20 @@ void BPF_STRUCT_OPS(dynamic_enable, struct task_struct *p)
 
 s32 BPF_STRUCT_OPS_SLEEPABLE(dynamic_init)
 {
+	int ret;
+
+	ret = scx_slot_alloc_init();
+	if (ret)
+		return ret;
+
+	if (exact_order) {
+		ret = scx_prio_index_init();
+		if (ret) {
+			scx_bpf_error("failed to initialize priority index (%d)", ret);
+			return ret;
+		}
+	}
+
 	return scx_bpf_create_dsq(SHARED_DSQ, -1);
 }
 
@@ -42,6 +42,14 @@
  * The scheduler first picks the cgroup to run and then schedule the tasks
  * within by using nested weighted vtime scheduling by default. The
  * cgroup-internal scheduling can be switched to FIFO with the -f option.
+ *
+ * Cgroups with queued tasks wait on a cgroup vtime ordered rbtree. By default
+ * there's a single one, which makes its lock a point of contention on large
+ * machines as every cgroup enqueue and pick takes it. With the -S option, the
+ * rbtree is sharded per LLC or NUMA node instead. A cgroup is queued on the
+ * shard of the CPU its task is enqueued on and CPUs pick from their own shard
+ * first. As each shard winds its own cgroup vtime, the shards are reconciled
+ * at pick time so that they don't drift apart by more than a few slices.
  */
 #include <scx/common.bpf.h>
 #include "scx_flatcg.h"
@@ -52,6 +60,8 @@
 enum {
 	FALLBACK_DSQ		= 0,
 	CGROUP_MAX_RETRIES	= 1024,
+	/* how many slices a shard's cvtime_now may lag behind before it's served */
+	FCG_SHARD_SLACK_SLICES	= 4,
 };
 
 char _license[] SEC("license") = "GPL";
@@ -59,7 +69,11 @@ char _license[] SEC("license") = "GPL";
 const volatile u32 nr_cpus = 32;	/* !0 for veristat, set during init */
 const volatile u64 cgrp_slice_ns;
 const volatile bool fifo_sched;
+const volatile u32 nr_shards = 1;
+
+u32 RESIZABLE_ARRAY(data, cpu_shard);
 
+/* the furthest cvtime_now across the shards, new cgroups start from here */
 u64 cvtime_now;
 UEI_DEFINE(uei);
 
@@ -82,6 +96,7 @@ static void stat_inc(enum fcg_stat_idx idx)
 struct fcg_cpu_ctx {
 	u64			cur_cgid;
 	u64			cur_at;
+	u32			probe_shard;
 };
 
 struct {
@@ -104,8 +119,22 @@ struct cgv_node {
 	__u64			cgid;
 };
 
-private(CGV_TREE) struct bpf_spin_lock cgv_tree_lock;
-private(CGV_TREE) struct bpf_rb_root cgv_tree __contains(cgv_node, rb_node);
+struct fcg_shard {
+	struct bpf_spin_lock	lock;
+	struct bpf_rb_root	root __contains(cgv_node, rb_node);
+	u64			cvtime_now;
+	u32			nr_queued;
+};
+
+struct {
+	__uint(type, BPF_MAP_TYPE_ARRAY);
+	__type(key, u32);
+	__type(value, struct fcg_shard);
+	__uint(max_entries, FCG_MAX_SHARDS);
+} cgv_shards SEC(".maps");
+
+/* protects ->nr_active, ->weight and ->child_weight_sum of all cgroups */
+private(FCG_WEIGHT) struct bpf_spin_lock weight_lock;
 
 struct cgv_node_stash {
 	struct cgv_node __kptr *node;
@@ -160,6 +189,29 @@ static struct fcg_cpu_ctx *find_cpu_ctx(void)
 	return cpuc;
 }
 
+static u32 cpu_to_shard(s32 cpu)
+{
+	u32 *shard;
+
+	if (nr_shards <= 1)
+		return 0;
+
+	shard = ARRAY_ELEM_PTR(cpu_shard, cpu, nr_cpus);
+	return shard && *shard < nr_shards ? *shard : 0;
+}
+
+static struct fcg_shard *find_shard(u32 shard)
+{
+	struct fcg_shard *sh;
+
+	sh = bpf_map_lookup_elem(&cgv_shards, &shard);
+	if (!sh) {
+		scx_bpf_error("cgv_shards lookup failed for shard %u", shard);
+		return NULL;
+	}
+	return sh;
+}
+
 static struct fcg_cgrp_ctx *find_cgrp_ctx(struct cgroup *cgrp)
 {
 	struct fcg_cgrp_ctx *cgc;
@@ -189,65 +241,92 @@ static struct fcg_cgrp_ctx *find_ancestor_cgrp_ctx(struct cgroup *cgrp, int leve
 	return cgc;
 }
 
+/*
+ * hweights are computed top-down and cached per hweight_gen. A generation
+ * change only means that some hweights may be stale, so instead of walking
+ * all the way from the root, look for the closest ancestor which has already
+ * been refreshed in the current generation, e.g. through a sibling, and only
+ * recompute below it. Each active cgroup is thus recomputed at most once per
+ * generation and the cost of a refresh is amortized over all the cgroups
+ * sharing the ancestors.
+ */
 static void cgrp_refresh_hweight(struct cgroup *cgrp, struct fcg_cgrp_ctx *cgc)
 {
-	int level;
+	struct fcg_cgrp_ctx *pcgc = NULL;
+	u64 gen = READ_ONCE(hweight_gen);
+	int idx, level, start = 0;
 
 	if (!cgc->nr_active) {
 		stat_inc(FCG_STAT_HWT_SKIP);
 		return;
 	}
 
-	if (cgc->hweight_gen == hweight_gen) {
+	if (cgc->hweight_gen == gen) {
 		stat_inc(FCG_STAT_HWT_CACHE);
 		return;
 	}
 
 	stat_inc(FCG_STAT_HWT_UPDATES);
-	bpf_for(level, 0, cgrp->level + 1) {
-		struct fcg_cgrp_ctx *cgc;
-		bool is_active;
 
-		cgc = find_ancestor_cgrp_ctx(cgrp, level);
-		if (!cgc)
+	bpf_for(idx, 1, cgrp->level + 1) {
+		struct fcg_cgrp_ctx *acgc;
+
+		level = cgrp->level - idx;
+		acgc = find_ancestor_cgrp_ctx(cgrp, level);
+		if (!acgc)
+			return;
+
+		if (acgc->hweight_gen == gen) {
+			pcgc = acgc;
+			start = level + 1;
 			break;
+		}
+	}
 
-		if (!level) {
-			cgc->hweight = FCG_HWEIGHT_ONE;
-			cgc->hweight_gen = hweight_gen;
-		} else {
-			struct fcg_cgrp_ctx *pcgc;
+	bpf_for(level, start, cgrp->level + 1) {
+		struct fcg_cgrp_ctx *lcgc;
+		bool is_active;
 
-			pcgc = find_ancestor_cgrp_ctx(cgrp, level - 1);
-			if (!pcgc)
-				break;
+		if (level == cgrp->level)
+			lcgc = cgc;
+		else
+			lcgc = find_ancestor_cgrp_ctx(cgrp, level);
+		if (!lcgc)
+			break;
 
+		if (!pcgc) {
+			lcgc->hweight = FCG_HWEIGHT_ONE;
+			lcgc->hweight_gen = gen;
+		} else {
 			/*
 			 * We can be opportunistic here and not grab the
-			 * cgv_tree_lock and deal with the occasional races.
+			 * weight_lock and deal with the occasional races.
 			 * However, hweight updates are already cached and
 			 * relatively low-frequency. Let's just do the
 			 * straightforward thing.
 			 */
-			bpf_spin_lock(&cgv_tree_lock);
-			is_active = cgc->nr_active;
+			bpf_spin_lock(&weight_lock);
+			is_active = lcgc->nr_active;
 			if (is_active) {
-				cgc->hweight_gen = pcgc->hweight_gen;
-				cgc->hweight =
-					div_round_up(pcgc->hweight * cgc->weight,
+				lcgc->hweight_gen = gen;
+				lcgc->hweight =
+					div_round_up(pcgc->hweight * lcgc->weight,
 						     pcgc->child_weight_sum);
 			}
-			bpf_spin_unlock(&cgv_tree_lock);
+			bpf_spin_unlock(&weight_lock);
 
 			if (!is_active) {
 				stat_inc(FCG_STAT_HWT_RACE);
 				break;
 			}
 		}
+
+		pcgc = lcgc;
 	}
 }
 
-static void cgrp_cap_budget(struct cgv_node *cgv_node, struct fcg_cgrp_ctx *cgc)
+static void cgrp_cap_budget(struct cgv_node *cgv_node, struct fcg_cgrp_ctx *cgc,
+			    u64 now)
 {
 	u64 delta, cvtime, max_budget;
 
@@ -256,7 +335,7 @@ static void cgrp_cap_budget(struct cgv_node *cgv_node, struct fcg_cgrp_ctx *cgc)
 	 * and thus can't be updated and repositioned. Instead, we collect the
 	 * vtime deltas separately and apply it asynchronously here.
 	 */
-	delta = __sync_fetch_and_sub(&cgc->cvtime_delta, cgc->cvtime_delta);
+	delta = __sync_lock_test_and_set(&cgc->cvtime_delta, 0);
 	cvtime = cgv_node->cvtime + delta;
 
 	/*
@@ -266,18 +345,24 @@ static void cgrp_cap_budget(struct cgv_node *cgv_node, struct fcg_cgrp_ctx *cgc)
 	 */
 	max_budget = (cgrp_slice_ns * nr_cpus * cgc->hweight) /
 		(2 * FCG_HWEIGHT_ONE);
-	if (time_before(cvtime, cvtime_now - max_budget))
-		cvtime = cvtime_now - max_budget;
+	if (time_before(cvtime, now - max_budget))
+		cvtime = now - max_budget;
 
 	cgv_node->cvtime = cvtime;
 }
 
-static void cgrp_enqueued(struct cgroup *cgrp, struct fcg_cgrp_ctx *cgc)
+static void cgrp_enqueued(struct cgroup *cgrp, struct fcg_cgrp_ctx *cgc,
+			  u32 shard)
 {
 	struct cgv_node_stash *stash;
 	struct cgv_node *cgv_node;
+	struct fcg_shard *sh;
 	u64 cgid = cgrp->kn->id;
 
+	sh = find_shard(shard);
+	if (!sh)
+		return;
+
 	/* paired with cmpxchg in try_pick_next_cgroup() */
 	if (__sync_val_compare_and_swap(&cgc->queued, 0, 1)) {
 		stat_inc(FCG_STAT_ENQ_SKIP);
@@ -297,10 +382,17 @@ static void cgrp_enqueued(struct cgroup *cgrp, struct fcg_cgrp_ctx *cgc)
 		return;
 	}
 
-	bpf_spin_lock(&cgv_tree_lock);
-	cgrp_cap_budget(cgv_node, cgc);
-	bpf_rbtree_add(&cgv_tree, &cgv_node->rb_node, cgv_node_less);
-	bpf_spin_unlock(&cgv_tree_lock);
+	bpf_spin_lock(&sh->lock);
+	/*
+	 * An empty shard's cvtime_now stops advancing. Catch it up with the
+	 * other shards so that its cgroups don't come back with a head start.
+	 */
+	if (!sh->nr_queued && time_before(sh->cvtime_now, cvtime_now))
+		sh->cvtime_now = cvtime_now;
+	cgrp_cap_budget(cgv_node, cgc, sh->cvtime_now);
+	bpf_rbtree_add(&sh->root, &cgv_node->rb_node, cgv_node_less);
+	sh->nr_queued++;
+	bpf_spin_unlock(&sh->lock);
 }
 
 static void set_bypassed_at(struct task_struct *p, struct fcg_task_ctx *taskc)
@@ -403,7 +495,7 @@ void BPF_STRUCT_OPS(fcg_enqueue, struct task_struct *p, u64 enq_flags)
 					 tvtime, enq_flags);
 	}
 
-	cgrp_enqueued(cgrp, cgc);
+	cgrp_enqueued(cgrp, cgc, cpu_to_shard(scx_bpf_task_cpu(p)));
 out_release:
 	bpf_cgroup_release(cgrp);
 }
@@ -415,7 +507,7 @@ out_release:
  */
 static void update_active_weight_sums(struct cgroup *cgrp, bool runnable)
 {
-	struct fcg_cgrp_ctx *cgc;
+	struct fcg_cgrp_ctx *cgc, *lcgc;
 	bool updated = false;
 	int idx;
 
@@ -427,7 +519,7 @@ static void update_active_weight_sums(struct cgroup *cgrp, bool runnable)
 	 * In most cases, a hot cgroup would have multiple threads going to
 	 * sleep and waking up while the whole cgroup stays active. In leaf
 	 * cgroups, ->nr_runnable which is updated with __sync operations gates
-	 * ->nr_active updates, so that we don't have to grab the cgv_tree_lock
+	 * ->nr_active updates, so that we don't have to grab the weight_lock
 	 * repeatedly for a busy cgroup which is staying active.
 	 */
 	if (runnable) {
@@ -450,20 +542,20 @@ static void update_active_weight_sums(struct cgroup *cgrp, bool runnable)
 	if (!runnable)
 		cgrp_refresh_hweight(cgrp, cgc);
 
-	/* propagate upwards */
+	/*
+	 * Propagate upwards. Each level's parent becomes the next level's
+	 * child, so every ancestor is looked up only once, and the walk stops
+	 * at the first ancestor whose active state doesn't change.
+	 */
+	lcgc = cgc;
 	bpf_for(idx, 0, cgrp->level) {
 		int level = cgrp->level - idx;
-		struct fcg_cgrp_ctx *cgc, *pcgc = NULL;
+		struct fcg_cgrp_ctx *pcgc;
 		bool propagate = false;
 
-		cgc = find_ancestor_cgrp_ctx(cgrp, level);
-		if (!cgc)
+		pcgc = find_ancestor_cgrp_ctx(cgrp, level - 1);
+		if (!pcgc)
 			break;
-		if (level) {
-			pcgc = find_ancestor_cgrp_ctx(cgrp, level - 1);
-			if (!pcgc)
-				break;
-		}
 
 		/*
 		 * We need the propagation protected by a lock to synchronize
@@ -471,30 +563,27 @@ static void update_active_weight_sums(struct cgroup *cgrp, bool runnable)
 		 * each level but bpf_spin_lock() doesn't want any function
 		 * calls while locked.
 		 */
-		bpf_spin_lock(&cgv_tree_lock);
+		bpf_spin_lock(&weight_lock);
 
 		if (runnable) {
-			if (!cgc->nr_active++) {
+			if (!lcgc->nr_active++) {
 				updated = true;
-				if (pcgc) {
-					propagate = true;
-					pcgc->child_weight_sum += cgc->weight;
-				}
+				propagate = true;
+				pcgc->child_weight_sum += lcgc->weight;
 			}
 		} else {
-			if (!--cgc->nr_active) {
+			if (!--lcgc->nr_active) {
 				updated = true;
-				if (pcgc) {
-					propagate = true;
-					pcgc->child_weight_sum -= cgc->weight;
-				}
+				propagate = true;
+				pcgc->child_weight_sum -= lcgc->weight;
 			}
 		}
 
-		bpf_spin_unlock(&cgv_tree_lock);
+		bpf_spin_unlock(&weight_lock);
 
 		if (!propagate)
 			break;
+		lcgc = pcgc;
 	}
 
 	if (updated)
@@ -597,35 +686,41 @@ void BPF_STRUCT_OPS(fcg_cgroup_set_weight, struct cgroup *cgrp, u32 weight)
 			return;
 	}
 
-	bpf_spin_lock(&cgv_tree_lock);
+	bpf_spin_lock(&weight_lock);
 	if (pcgc && cgc->nr_active)
 		pcgc->child_weight_sum += (s64)weight - cgc->weight;
 	cgc->weight = weight;
-	bpf_spin_unlock(&cgv_tree_lock);
+	bpf_spin_unlock(&weight_lock);
 }
 
-static bool try_pick_next_cgroup(u64 *cgidp)
+static bool try_pick_next_cgroup(u64 *cgidp, u32 shard)
 {
 	struct bpf_rb_node *rb_node;
 	struct cgv_node_stash *stash;
 	struct cgv_node *cgv_node;
 	struct fcg_cgrp_ctx *cgc;
+	struct fcg_shard *sh;
 	struct cgroup *cgrp;
 	u64 cgid;
 
+	*cgidp = 0;
+
+	sh = find_shard(shard);
+	if (!sh)
+		return true;
+
 	/* pop the front cgroup and wind cvtime_now accordingly */
-	bpf_spin_lock(&cgv_tree_lock);
+	bpf_spin_lock(&sh->lock);
 
-	rb_node = bpf_rbtree_first(&cgv_tree);
+	rb_node = bpf_rbtree_first(&sh->root);
 	if (!rb_node) {
-		bpf_spin_unlock(&cgv_tree_lock);
-		stat_inc(FCG_STAT_PNC_NO_CGRP);
-		*cgidp = 0;
+		bpf_spin_unlock(&sh->lock);
 		return true;
 	}
 
-	rb_node = bpf_rbtree_remove(&cgv_tree, rb_node);
-	bpf_spin_unlock(&cgv_tree_lock);
+	rb_node = bpf_rbtree_remove(&sh->root, rb_node);
+	sh->nr_queued--;
+	bpf_spin_unlock(&sh->lock);
 
 	if (!rb_node) {
 		/*
@@ -640,6 +735,8 @@ static bool try_pick_next_cgroup(u64 *cgidp)
 	cgv_node = container_of(rb_node, struct cgv_node, rb_node);
 	cgid = cgv_node->cgid;
 
+	if (time_before(sh->cvtime_now, cgv_node->cvtime))
+		sh->cvtime_now = cgv_node->cvtime;
 	if (time_before(cvtime_now, cgv_node->cvtime))
 		cvtime_now = cgv_node->cvtime;
 
@@ -680,11 +777,12 @@ static bool try_pick_next_cgroup(u64 *cgidp)
 	 * according to the actual consumption. This prevents lowpri thundering
 	 * herd from saturating the machine.
 	 */
-	bpf_spin_lock(&cgv_tree_lock);
+	bpf_spin_lock(&sh->lock);
 	cgv_node->cvtime += cgrp_slice_ns * FCG_HWEIGHT_ONE / (cgc->hweight ?: 1);
-	cgrp_cap_budget(cgv_node, cgc);
-	bpf_rbtree_add(&cgv_tree, &cgv_node->rb_node, cgv_node_less);
-	bpf_spin_unlock(&cgv_tree_lock);
+	cgrp_cap_budget(cgv_node, cgc, sh->cvtime_now);
+	bpf_rbtree_add(&sh->root, &cgv_node->rb_node, cgv_node_less);
+	sh->nr_queued++;
+	bpf_spin_unlock(&sh->lock);
 
 	*cgidp = cgid;
 	stat_inc(FCG_STAT_PNC_NEXT);
@@ -705,9 +803,10 @@ out_stash:
 	__sync_val_compare_and_swap(&cgc->queued, 1, 0);
 
 	if (scx_bpf_dsq_nr_queued(cgid)) {
-		bpf_spin_lock(&cgv_tree_lock);
-		bpf_rbtree_add(&cgv_tree, &cgv_node->rb_node, cgv_node_less);
-		bpf_spin_unlock(&cgv_tree_lock);
+		bpf_spin_lock(&sh->lock);
+		bpf_rbtree_add(&sh->root, &cgv_node->rb_node, cgv_node_less);
+		sh->nr_queued++;
+		bpf_spin_unlock(&sh->lock);
 		stat_inc(FCG_STAT_PNC_RACE);
 	} else {
 		cgv_node = bpf_kptr_xchg(&stash->node, cgv_node);
@@ -724,6 +823,74 @@ out_free:
 	return false;
 }
 
+/*
+ * Pick from @shard first and then from the other shards in order, so that a
+ * CPU doesn't go idle while any shard has a cgroup queued. The other shards
+ * are skipped without taking their locks if they look empty.
+ */
+static bool pick_next_cgroup(u64 *cgidp, u32 shard)
+{
+	struct fcg_shard *sh;
+	u32 target;
+	int i;
+
+	bpf_for(i, 0, nr_shards) {
+		target = (shard + i) % nr_shards;
+
+		if (i) {
+			sh = bpf_map_lookup_elem(&cgv_shards, &target);
+			if (!sh || !READ_ONCE(sh->nr_queued))
+				continue;
+		}
+
+		if (!try_pick_next_cgroup(cgidp, target))
+			return false;
+
+		if (*cgidp) {
+			if (i)
+				stat_inc(FCG_STAT_PNC_STEAL);
+			return true;
+		}
+	}
+
+	stat_inc(FCG_STAT_PNC_NO_CGRP);
+	return true;
+}
+
+/*
+ * Each shard winds its own cvtime_now from the cgroups it serves, so a shard
+ * with more contention falls behind the others and its cgroups would get less
+ * than their hweight. To bound the error, every pick probes one other shard
+ * round-robin and serves it instead of @own if its cvtime_now lags by more
+ * than FCG_SHARD_SLACK_SLICES slices.
+ */
+static u32 pick_shard(struct fcg_cpu_ctx *cpuc, u32 own)
+{
+	struct fcg_shard *own_sh, *sh;
+	u32 probe;
+
+	if (nr_shards <= 1)
+		return own;
+
+	probe = cpuc->probe_shard++ % nr_shards;
+	if (probe == own)
+		return own;
+
+	own_sh = bpf_map_lookup_elem(&cgv_shards, &own);
+	sh = bpf_map_lookup_elem(&cgv_shards, &probe);
+	if (!own_sh || !sh || !READ_ONCE(sh->nr_queued))
+		return own;
+
+	if (time_before(READ_ONCE(sh->cvtime_now) +
+			cgrp_slice_ns * FCG_SHARD_SLACK_SLICES,
+			READ_ONCE(own_sh->cvtime_now))) {
+		stat_inc(FCG_STAT_PNC_RECONCILE);
+		return probe;
+	}
+
+	return own;
+}
+
 void BPF_STRUCT_OPS(fcg_dispatch, s32 cpu, struct task_struct *prev)
 {
 	struct fcg_cpu_ctx *cpuc;
@@ -731,6 +898,7 @@ void BPF_STRUCT_OPS(fcg_dispatch, s32 cpu, struct task_struct *prev)
 	struct cgroup *cgrp;
 	u64 now = scx_bpf_now();
 	bool picked_next = false;
+	u32 shard;
 
 	cpuc = find_cpu_ctx();
 	if (!cpuc)
@@ -762,15 +930,13 @@ void BPF_STRUCT_OPS(fcg_dispatch, s32 cpu, struct task_struct *prev)
 	cgc = bpf_cgrp_storage_get(&cgrp_ctx, cgrp, 0, 0);
 	if (cgc) {
 		/*
-		 * We want to update the vtime delta and then look for the next
-		 * cgroup to execute but the latter needs to be done in a loop
-		 * and we can't keep the lock held. Oh well...
+		 * The cgroup may be queued on any shard, so no shard lock
+		 * covers this. cgrp_cap_budget() consumes the delta with an
+		 * atomic exchange, which an atomic add here can't race with.
 		 */
-		bpf_spin_lock(&cgv_tree_lock);
 		__sync_fetch_and_add(&cgc->cvtime_delta,
 				     (cpuc->cur_at + cgrp_slice_ns - now) *
 				     FCG_HWEIGHT_ONE / (cgc->hweight ?: 1));
-		bpf_spin_unlock(&cgv_tree_lock);
 	} else {
 		stat_inc(FCG_STAT_CNS_GONE);
 	}
@@ -785,15 +951,17 @@ pick_next_cgroup:
 		return;
 	}
 
+	shard = pick_shard(cpuc, cpu_to_shard(cpu));
+
 	bpf_repeat(CGROUP_MAX_RETRIES) {
-		if (try_pick_next_cgroup(&cpuc->cur_cgid)) {
+		if (pick_next_cgroup(&cpuc->cur_cgid, shard)) {
 			picked_next = true;
 			break;
 		}
 	}
 
 	/*
-	 * This only happens if try_pick_next_cgroup() races against enqueue
+	 * This only happens if pick_next_cgroup() races against enqueue
 	 * path for more than CGROUP_MAX_RETRIES times, which is extremely
 	 * unlikely and likely indicates an underlying bug. There shouldn't be
 	 * any stall risk as the race is against enqueue.
@@ -903,8 +1071,8 @@ void BPF_STRUCT_OPS(fcg_cgroup_exit, struct cgroup *cgrp)
 	u64 cgid = cgrp->kn->id;
 
 	/*
-	 * For now, there's no way find and remove the cgv_node if it's on the
-	 * cgv_tree. Let's drain them in the dispatch path as they get popped
+	 * For now, there's no way find and remove the cgv_node if it's on a
+	 * shard's rbtree. Let's drain them in the dispatch path as they get popped
 	 * off the front of the tree.
 	 */
 	bpf_map_delete_elem(&cgv_node_stash, &cgid);
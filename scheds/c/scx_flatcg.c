@@ -15,6 +15,8 @@
 #include <time.h>
 #include <bpf/bpf.h>
 #include <scx/common.h>
+#include <scx/map_cleanup.h>
+#include <scx/topology.h>
 #include "scx_flatcg.h"
 #include "scx_flatcg.bpf.skel.h"
 
@@ -27,11 +29,13 @@ const char help_fmt[] =
 "\n"
 "See the top-level comment in .bpf.c for more details.\n"
 "\n"
-"Usage: %s [-s SLICE_US] [-i INTERVAL] [-f] [-v]\n"
+"Usage: %s [-s SLICE_US] [-i INTERVAL] [-f] [-S llc|node] [-c FILE] [-v]\n"
 "\n"
 "  -s SLICE_US   Override slice duration\n"
 "  -i INTERVAL   Report interval\n"
 "  -f            Use FIFO scheduling instead of weighted vtime scheduling\n"
+"  -S SHARD      Queue cgroups per LLC or NUMA node (default: one queue)\n"
+"  -c FILE       Write map cleanup statistics to FILE as CSV\n"
 "  -v            Print libbpf debug messages\n"
 "  -h            Display this help and exit\n";
 
@@ -100,6 +104,41 @@ static float read_cpu_util(__u64 *last_sum, __u64 *last_idle)
 	return delta_sum ? (float)(delta_sum - delta_idle) / delta_sum : 0.0;
 }
 
+/*
+ * Map each CPU to the cgroup queue shard of its LLC or NUMA node. CPUs whose
+ * domain can't be read, e.g. offline ones, go to shard 0.
+ */
+static void setup_shards(struct scx_flatcg *skel, enum scx_shard_mode mode)
+{
+	__u32 nr_cpus = skel->rodata->nr_cpus;
+	__u32 *cpu_shard = skel->data_cpu_shard->cpu_shard;
+	int dom_ids[FCG_MAX_SHARDS];
+	__u32 nr_shards = 0, shard, cpu;
+
+	for (cpu = 0; cpu < nr_cpus; cpu++) {
+		int id = scx_cpu_shard_id(cpu, mode);
+
+		if (id < 0) {
+			cpu_shard[cpu] = 0;
+			continue;
+		}
+
+		for (shard = 0; shard < nr_shards; shard++)
+			if (dom_ids[shard] == id)
+				break;
+
+		if (shard == nr_shards) {
+			SCX_BUG_ON(nr_shards == FCG_MAX_SHARDS,
+				   "More than %u shards", FCG_MAX_SHARDS);
+			dom_ids[nr_shards++] = id;
+		}
+
+		cpu_shard[cpu] = shard;
+	}
+
+	skel->rodata->nr_shards = nr_shards ?: 1;
+}
+
 static void fcg_read_stats(struct scx_flatcg *skel, __u64 *stats)
 {
 	__u64 cnts[FCG_NR_STATS][skel->rodata->nr_cpus];
@@ -127,9 +166,13 @@ int main(int argc, char **argv)
 	bool dump_cgrps = false;
 	__u64 last_cpu_sum = 0, last_cpu_idle = 0;
 	__u64 last_stats[FCG_NR_STATS] = {};
+	struct scx_map_cleanup_collector col = { .map_fd = -1 };
+	const char *csv_path = NULL;
 	unsigned long seq = 0;
 	__s32 opt;
+	enum scx_shard_mode shard_mode = SCX_SHARD_NONE;
 	__u64 ecode;
+	int ret;
 
 	libbpf_set_print(libbpf_print_fn);
 	signal(SIGINT, sigint_handler);
@@ -141,7 +184,7 @@ restart:
 	assert(skel->rodata->nr_cpus > 0);
 	skel->rodata->cgrp_slice_ns = __COMPAT_ENUM_OR_ZERO("scx_public_consts", "SCX_SLICE_DFL");
 
-	while ((opt = getopt(argc, argv, "s:i:dfvh")) != -1) {
+	while ((opt = getopt(argc, argv, "s:i:dfS:c:vh")) != -1) {
 		double v;
 
 		switch (opt) {
@@ -160,6 +203,15 @@ restart:
 		case 'f':
 			skel->rodata->fifo_sched = true;
 			break;
+		case 'S':
+			if (scx_shard_mode_parse(optarg, &shard_mode)) {
+				fprintf(stderr, "invalid shard mode %s\n", optarg);
+				return 1;
+			}
+			break;
+		case 'c':
+			csv_path = optarg;
+			break;
 		case 'v':
 			verbose = true;
 			break;
@@ -170,14 +222,22 @@ restart:
 		}
 	}
 
-	printf("slice=%.1lfms intv=%.1lfs dump_cgrps=%d",
+	RESIZE_ARRAY(skel, data, cpu_shard, skel->rodata->nr_cpus);
+	setup_shards(skel, shard_mode);
+
+	printf("slice=%.1lfms intv=%.1lfs dump_cgrps=%d shards=%u",
 	       (double)skel->rodata->cgrp_slice_ns / 1000000.0,
 	       (double)intv_ts.tv_sec + (double)intv_ts.tv_nsec / 1000000000.0,
-	       dump_cgrps);
+	       dump_cgrps, skel->rodata->nr_shards);
 
 	SCX_OPS_LOAD(skel, flatcg_ops, scx_flatcg, uei);
 	link = SCX_OPS_ATTACH(skel, flatcg_ops, scx_flatcg);
 
+	if (csv_path) {
+		ret = scx_map_cleanup_collector_init(&col, skel->obj, "tasks", csv_path);
+		SCX_BUG_ON(ret, "Failed to open map cleanup collector on %s", csv_path);
+	}
+
 	while (!exit_req && !UEI_EXITED(skel, uei)) {
 		__u64 acc_stats[FCG_NR_STATS];
 		__u64 stats[FCG_NR_STATS];
@@ -219,13 +279,18 @@ restart:
 		       stats[FCG_STAT_PNC_GONE],
 		       stats[FCG_STAT_PNC_RACE],
 		       stats[FCG_STAT_PNC_FAIL]);
+		printf("SHD  steal:%6llu  recon:%6llu\n",
+		       stats[FCG_STAT_PNC_STEAL],
+		       stats[FCG_STAT_PNC_RECONCILE]);
 		printf("BAD remove:%6llu\n",
 		       acc_stats[FCG_STAT_BAD_REMOVAL]);
 		fflush(stdout);
+		scx_map_cleanup_collector_sample(&col);
 
 		nanosleep(&intv_ts, NULL);
 	}
 
+	scx_map_cleanup_collector_destroy(&col);
 	bpf_link__destroy(link);
 	ecode = UEI_REPORT(skel, uei);
 	scx_flatcg__destroy(skel);
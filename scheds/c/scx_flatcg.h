@@ -3,6 +3,7 @@
 
 enum {
 	FCG_HWEIGHT_ONE		= 1LLU << 16,
+	FCG_MAX_SHARDS		= 64,
 };
 
 enum fcg_stat_idx {
@@ -30,6 +31,8 @@ enum fcg_stat_idx {
 	FCG_STAT_PNC_GONE,
 	FCG_STAT_PNC_RACE,
 	FCG_STAT_PNC_FAIL,
+	FCG_STAT_PNC_STEAL,
+	FCG_STAT_PNC_RECONCILE,
 
 	FCG_STAT_BAD_REMOVAL,
 
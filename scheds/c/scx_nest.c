@@ -12,6 +12,7 @@
 #include <libgen.h>
 #include <bpf/bpf.h>
 #include <scx/common.h>
+#include <scx/map_cleanup.h>
 
 #include "scx_nest.bpf.skel.h"
 #include "scx_nest.h"
@@ -23,13 +24,14 @@ const char help_fmt[] =
 "\n"
 "See the top-level comment in .bpf.c for more details.\n"
 "\n"
-"Usage: %s [-p] [-d DELAY] [-m <max>] [-i ITERS]\n"
+"Usage: %s [-p] [-d DELAY] [-m <max>] [-i ITERS] [-c FILE]\n"
 "\n"
 "  -d DELAY_US   Delay (us), before removing an idle core from the primary nest (default 2000us / 2ms)\n"
 "  -m R_MAX      Maximum number of cores in the reserve nest (default 5)\n"
 "  -i ITERS      Number of successive placement failures tolerated before trying to aggressively expand primary nest (default 2), or 0 to disable\n"
 "  -s SLICE_US   Override slice duration in us (default 20000us / 20ms)\n"
 "  -I            First try to find a fully idle core, and then any idle core, when searching nests. Default behavior is to ignore hypertwins and check for any idle core.\n"
+"  -c FILE       Write map cleanup statistics to FILE as CSV\n"
 "  -v            Print libbpf debug messages\n"
 "  -h            Display this help and exit\n";
 
@@ -162,8 +164,11 @@ int main(int argc, char **argv)
 {
 	struct scx_nest *skel;
 	struct bpf_link *link;
+	struct scx_map_cleanup_collector col = { .map_fd = -1 };
+	const char *csv_path = NULL;
 	__u32 opt;
 	__u64 ecode;
+	int ret;
 
 	libbpf_set_print(libbpf_print_fn);
 	signal(SIGINT, sigint_handler);
@@ -176,7 +181,7 @@ restart:
 	skel->rodata->sampling_cadence_ns = SAMPLING_CADENCE_S * 1000 * 1000 * 1000;
 	skel->rodata->slice_ns = __COMPAT_ENUM_OR_ZERO("scx_public_consts", "SCX_SLICE_DFL");
 
-	while ((opt = getopt(argc, argv, "d:m:i:Is:vh")) != -1) {
+	while ((opt = getopt(argc, argv, "d:m:i:Is:c:vh")) != -1) {
 		switch (opt) {
 		case 'd':
 			skel->rodata->p_remove_ns = strtoull(optarg, NULL, 0) * 1000;
@@ -193,6 +198,9 @@ restart:
 		case 's':
 			skel->rodata->slice_ns = strtoull(optarg, NULL, 0) * 1000;
 			break;
+		case 'c':
+			csv_path = optarg;
+			break;
 		case 'v':
 			verbose = true;
 			break;
@@ -205,6 +213,11 @@ restart:
 	SCX_OPS_LOAD(skel, nest_ops, scx_nest, uei);
 	link = SCX_OPS_ATTACH(skel, nest_ops, scx_nest);
 
+	if (csv_path) {
+		ret = scx_map_cleanup_collector_init(&col, skel->obj, "tasks", csv_path);
+		SCX_BUG_ON(ret, "Failed to open map cleanup collector on %s", csv_path);
+	}
+
 	while (!exit_req && !UEI_EXITED(skel, uei)) {
 		u64 stats[NEST_STAT(NR)];
 		enum nest_stat_idx i;
@@ -227,9 +240,11 @@ restart:
 		printf("\n");
 		printf("\n");
 		fflush(stdout);
+		scx_map_cleanup_collector_sample(&col);
 		sleep(SAMPLING_CADENCE_S);
 	}
 
+	scx_map_cleanup_collector_destroy(&col);
 	bpf_link__destroy(link);
 	ecode = UEI_REPORT(skel, uei);
 	scx_nest__destroy(skel);
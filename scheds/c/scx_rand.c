@@ -18,9 +18,10 @@ const char help_fmt[] =
 "\n"
 "See the top-level comment in .bpf.c for more details.\n"
 "\n"
-"Usage: %s [-f] [-v]\n"
+"Usage: %s [-f] [-e] [-v]\n"
 "\n"
 "  -f            Use FIFO scheduling instead of weighted vtime scheduling\n"
+"  -e            Dispatch the exact lowest vtime from an rbtree instead of sampling\n"
 "  -v            Print libbpf debug messages\n"
 "  -h            Display this help and exit\n";
 
@@ -73,8 +74,11 @@ int main(int argc, char **argv)
 restart:
 	skel = SCX_OPS_OPEN(rand_ops, scx_rand);
 
-	while ((opt = getopt(argc, argv, "fvh")) != -1) {
+	while ((opt = getopt(argc, argv, "fevh")) != -1) {
 		switch (opt) {
+		case 'e':
+			skel->rodata->exact_order = true;
+			break;
 		case 'v':
 			verbose = true;
 			break;
@@ -82,7 +82,12 @@ restart:
 		printf("alloc_ops=%llu\t", skel->bss->alloc_stats.alloc_ops);
 		printf("free_ops=%llu\t", skel->bss->alloc_stats.free_ops);
 		printf("active_allocs=%llu\t", skel->bss->alloc_stats.active_allocs);
-		printf("arena_pages_used=%llu\t", skel->bss->alloc_stats.arena_pages_used);
+		printf("arena_pages_used=%llu\n", skel->bss->alloc_stats.arena_pages_used);
+		printf("mag_hits=%llu\t", skel->bss->alloc_stats.mag_hits);
+		printf("mag_misses=%llu\t", skel->bss->alloc_stats.mag_misses);
+		printf("mag_refills=%llu\t", skel->bss->alloc_stats.mag_refills);
+		printf("mag_flushes=%llu\t", skel->bss->alloc_stats.mag_flushes);
+		printf("mag_flush_errors=%llu\t", skel->bss->alloc_stats.mag_flush_errors);
 		printf("\n\n");
 
 		fflush(stdout);
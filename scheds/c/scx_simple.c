@@ -11,6 +11,7 @@
 #include <libgen.h>
 #include <bpf/bpf.h>
 #include <scx/common.h>
+#include <scx/map_cleanup.h>
 #include "scx_simple.bpf.skel.h"
 
 const char help_fmt[] =
@@ -18,9 +19,10 @@ const char help_fmt[] =
 "\n"
 "See the top-level comment in .bpf.c for more details.\n"
 "\n"
-"Usage: %s [-f] [-v]\n"
+"Usage: %s [-f] [-c FILE] [-v]\n"
 "\n"
 "  -f            Use FIFO scheduling instead of weighted vtime scheduling\n"
+"  -c FILE       Write map cleanup statistics to FILE as CSV\n"
 "  -v            Print libbpf debug messages\n"
 "  -h            Display this help and exit\n";
 
@@ -64,8 +66,11 @@ int main(int argc, char **argv)
 {
 	struct scx_simple *skel;
 	struct bpf_link *link;
+	struct scx_map_cleanup_collector col = { .map_fd = -1 };
+	const char *csv_path = NULL;
 	__u32 opt;
 	__u64 ecode;
+	int ret;
 
 	libbpf_set_print(libbpf_print_fn);
 	signal(SIGINT, sigint_handler);
@@ -73,11 +78,14 @@ int main(int argc, char **argv)
 restart:
 	skel = SCX_OPS_OPEN(simple_ops, scx_simple);
 
-	while ((opt = getopt(argc, argv, "fvh")) != -1) {
+	while ((opt = getopt(argc, argv, "fc:vh")) != -1) {
 		switch (opt) {
 		case 'f':
 			skel->rodata->fifo_sched = true;
 			break;
+		case 'c':
+			csv_path = optarg;
+			break;
 		case 'v':
 			verbose = true;
 			break;
@@ -90,15 +98,22 @@ restart:
 	SCX_OPS_LOAD(skel, simple_ops, scx_simple, uei);
 	link = SCX_OPS_ATTACH(skel, simple_ops, scx_simple);
 
+	if (csv_path) {
+		ret = scx_map_cleanup_collector_init(&col, skel->obj, "tasks", csv_path);
+		SCX_BUG_ON(ret, "Failed to open map cleanup collector on %s", csv_path);
+	}
+
 	while (!exit_req && !UEI_EXITED(skel, uei)) {
 		__u64 stats[2];
 
 		read_stats(skel, stats);
 		printf("local=%llu global=%llu\n", stats[0], stats[1]);
 		fflush(stdout);
+		scx_map_cleanup_collector_sample(&col);
 		sleep(1);
 	}
 
+	scx_map_cleanup_collector_destroy(&col);
 	bpf_link__destroy(link);
 	ecode = UEI_REPORT(skel, uei);
 	scx_simple__destroy(skel);
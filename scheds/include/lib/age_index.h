@@ -0,0 +1,231 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+/*
+ * Time-bucketed age index for task-tracking maps.
+ *
+ * Finding stale entries by scanning the whole map costs O(map size) even if
+ * only a handful of entries expired. The age index keeps, next to the map, a
+ * wheel of SCX_AGE_INDEX_SLOTS buckets. Each bucket covers 2^age_index_shift
+ * ns of wall time and records the keys that were touched during that window.
+ * Expiring entries then only has to drain the buckets whose window ended more
+ * than max_age ago.
+ *
+ * A key is pushed into a bucket only when its timestamp crosses into a new
+ * window, so refreshing an entry is O(1) and usually doesn't push at all. A
+ * key may therefore appear in several buckets. Draining a bucket only deletes
+ * the entries whose timestamp is actually stale, so a later touch always wins
+ * over an older bucket reference.
+ *
+ * Buckets are fixed-size. Pushes to a full bucket are dropped and counted in
+ * age_index_stats.nr_overflows, in which case the caller should fall back to
+ * a full scan to catch the entries the index lost track of.
+ *
+ * If SCX_AGE_INDEX_EVICT_FN is defined before the include, it is called as
+ * SCX_AGE_INDEX_EVICT_FN(key, val) for every expired entry once it has been
+ * deleted. The entry may be reused by then, so @val points to a copy taken
+ * before the delete, of type SCX_AGE_INDEX_VALUE_TYPE, which must be defined
+ * as well. An entry that fails to be deleted is left alone.
+ */
+#pragma once
+
+#include <scx/common.bpf.h>
+
+#if defined(SCX_AGE_INDEX_EVICT_FN) && !defined(SCX_AGE_INDEX_VALUE_TYPE)
+#error "SCX_AGE_INDEX_EVICT_FN requires SCX_AGE_INDEX_VALUE_TYPE"
+#endif
+
+#ifndef SCX_AGE_INDEX_SLOTS
+#define SCX_AGE_INDEX_SLOTS	64
+#endif
+
+#ifndef SCX_AGE_INDEX_SLOT_CAP
+#define SCX_AGE_INDEX_SLOT_CAP	16384
+#endif
+
+_Static_assert(!(SCX_AGE_INDEX_SLOTS & (SCX_AGE_INDEX_SLOTS - 1)),
+	       "SCX_AGE_INDEX_SLOTS must be a power of two");
+
+/*
+ * 2^27 ns (~134ms) per bucket. With the default 64 buckets the wheel spans
+ * ~8.6s, which must exceed max_age plus the cleanup interval.
+ */
+const volatile u32 age_index_shift = 27;
+
+struct scx_age_index_stats {
+	u64 nr_pushed;
+	u64 nr_overflows;
+	u64 nr_popped;
+	u64 nr_evicted;
+};
+
+struct scx_age_index_stats age_index_stats;
+
+/* The next window to drain. */
+static u64 age_index_drain_epoch;
+
+struct scx_age_slot {
+	u32 head;
+	u32 tail;
+};
+
+struct {
+	__uint(type, BPF_MAP_TYPE_ARRAY);
+	__uint(max_entries, SCX_AGE_INDEX_SLOTS);
+	__type(key, u32);
+	__type(value, struct scx_age_slot);
+} age_index_slots SEC(".maps");
+
+struct {
+	__uint(type, BPF_MAP_TYPE_ARRAY);
+	__uint(max_entries, SCX_AGE_INDEX_SLOTS * SCX_AGE_INDEX_SLOT_CAP);
+	__type(key, u32);
+	__type(value, u32);
+} age_index_keys SEC(".maps");
+
+/*
+ * Record that @key was touched at @now_ns. @prev_ns is the previous timestamp
+ * of the entry or 0 if it was just created.
+ */
+static __always_inline void scx_age_index_touch(u32 key, u64 prev_ns, u64 now_ns)
+{
+	u64 epoch = now_ns >> age_index_shift;
+	struct scx_age_slot *slot;
+	u32 slot_idx, pos, *kp;
+
+	if (prev_ns && (prev_ns >> age_index_shift) == epoch)
+		return;
+
+	slot_idx = epoch & (SCX_AGE_INDEX_SLOTS - 1);
+	slot = bpf_map_lookup_elem(&age_index_slots, &slot_idx);
+	if (!slot)
+		return;
+
+	pos = __sync_fetch_and_add(&slot->tail, 1);
+	if (pos >= SCX_AGE_INDEX_SLOT_CAP) {
+		__sync_fetch_and_add(&age_index_stats.nr_overflows, 1);
+		return;
+	}
+
+	pos += slot_idx * SCX_AGE_INDEX_SLOT_CAP;
+	kp = bpf_map_lookup_elem(&age_index_keys, &pos);
+	if (!kp)
+		return;
+
+	*kp = key;
+	__sync_fetch_and_add(&age_index_stats.nr_pushed, 1);
+}
+
+/*
+ * Delete the entries of @map whose u64 timestamp at @ts_off is older than
+ * @max_age_ns, visiting only the buckets that expired since the last call.
+ * Stops with -ETIMEDOUT once @budget_ns elapsed and resumes from the same
+ * position on the next call.
+ *
+ * Must not be called concurrently with itself.
+ */
+static __always_inline int scx_age_index_expire(void *map, u32 ts_off, u64 now,
+						u64 max_age_ns, u64 budget_ns,
+						u32 *evicted)
+{
+	u64 deadline = bpf_ktime_get_ns() + budget_ns;
+	u64 expire_epoch, oldest_epoch, epoch;
+	int n;
+
+	if (now < max_age_ns)
+		return 0;
+
+	/* Every window before @expire_epoch ended more than @max_age_ns ago. */
+	expire_epoch = (now - max_age_ns) >> age_index_shift;
+
+	/*
+	 * Windows before @oldest_epoch share their bucket with a window that
+	 * may still be live. Draining them would reset the bucket and drop
+	 * the references to the fresh keys in it.
+	 */
+	oldest_epoch = now >> age_index_shift;
+	if (oldest_epoch >= SCX_AGE_INDEX_SLOTS - 1)
+		oldest_epoch -= SCX_AGE_INDEX_SLOTS - 1;
+	else
+		oldest_epoch = 0;
+
+	epoch = age_index_drain_epoch;
+	if (!epoch) {
+		/* first call, nothing older than the wheel has been pushed */
+		epoch = oldest_epoch;
+	} else if (epoch < oldest_epoch) {
+		/*
+		 * The drain fell behind by more than the wheel. The skipped
+		 * windows' keys may have been mixed into live buckets, so
+		 * count it as an overflow to have the caller do a full scan.
+		 */
+		__sync_fetch_and_add(&age_index_stats.nr_overflows, 1);
+		epoch = oldest_epoch;
+	}
+
+	bpf_for(n, 0, SCX_AGE_INDEX_SLOTS) {
+		struct scx_age_slot *slot;
+		u32 slot_idx, end;
+		int i;
+
+		if (epoch >= expire_epoch)
+			break;
+
+		slot_idx = epoch & (SCX_AGE_INDEX_SLOTS - 1);
+		slot = bpf_map_lookup_elem(&age_index_slots, &slot_idx);
+		if (!slot)
+			return -ENOENT;
+
+		end = slot->tail;
+		if (end > SCX_AGE_INDEX_SLOT_CAP)
+			end = SCX_AGE_INDEX_SLOT_CAP;
+
+		bpf_for(i, slot->head, end) {
+			u32 pos = slot_idx * SCX_AGE_INDEX_SLOT_CAP + i;
+#ifdef SCX_AGE_INDEX_EVICT_FN
+			SCX_AGE_INDEX_VALUE_TYPE copy;
+#endif
+			u32 *kp, key;
+			void *val;
+
+			if (!(i & 63) && bpf_ktime_get_ns() > deadline) {
+				slot->head = i;
+				age_index_drain_epoch = epoch;
+				return -ETIMEDOUT;
+			}
+
+			age_index_stats.nr_popped++;
+
+			kp = bpf_map_lookup_elem(&age_index_keys, &pos);
+			if (!kp)
+				continue;
+
+			val = bpf_map_lookup_elem(map, kp);
+			if (!val)
+				continue;
+
+			if (!time_before(*(u64 *)(val + ts_off), now - max_age_ns))
+				continue;
+
+			key = *kp;
+#ifdef SCX_AGE_INDEX_EVICT_FN
+			__builtin_memcpy(&copy, val, sizeof(copy));
+#endif
+
+			if (bpf_map_delete_elem(map, &key))
+				continue;
+
+			age_index_stats.nr_evicted++;
+			(*evicted)++;
+
+#ifdef SCX_AGE_INDEX_EVICT_FN
+			SCX_AGE_INDEX_EVICT_FN(key, &copy);
+#endif
+		}
+
+		slot->head = 0;
+		slot->tail = 0;
+		epoch++;
+	}
+
+	age_index_drain_epoch = epoch;
+	return 0;
+}
@@ -13,9 +13,35 @@
 
 enum scx_atq_consts {
 	SCX_ATQ_INF_CAPACITY  = ((u64)-1),
-	SCX_ATQ_FIFO = ((u64)-1)
+	SCX_ATQ_FIFO = ((u64)-1),
+	/* Marks the keys of FIFO tasks that overflowed into the tree. */
+	SCX_ATQ_OVERFLOW_KEY = (1ULL << 63),
 };
 
+/*
+ * FIFO ATQs append through a lock-free MPSC ring of this many cells (fewer
+ * for small capacities). Producers claim a cell by swinging the tail with a
+ * cmpxchg, so inserts never take the ATQ lock while the ring has room.
+ * Consumers still serialize on the lock. Cancelled tasks leave their cell
+ * behind as a tombstone that pop skips, and inserts fall back to the locked
+ * tree when the ring is full or contended. Once a task is in the tree, later
+ * inserts follow it there until it drains; a producer that claimed a cell
+ * before noticing leaves it empty, so the ring never overtakes the tree.
+ */
+#ifndef SCX_ATQ_FIFO_SLOTS
+#define SCX_ATQ_FIFO_SLOTS	512
+#endif
+
+_Static_assert(!(SCX_ATQ_FIFO_SLOTS & (SCX_ATQ_FIFO_SLOTS - 1)),
+	       "SCX_ATQ_FIFO_SLOTS must be a power of two");
+
+struct scx_atq_cell {
+	u64 seq;
+	u64 taskc;
+};
+
+typedef struct scx_atq_cell __arena scx_atq_cell_t;
+
 enum scx_task_throttle {
 	SCX_TSK_CANRUN = 0,
 	SCX_TSK_THROTTLED
@@ -28,6 +54,13 @@ struct scx_atq {
 	u64 size;
 	u64 seq;
 	u64 fifo;
+
+	/* FIFO mode only. */
+	scx_atq_cell_t *ring;
+	u64 ring_mask;
+	u64 head;		/* next cell to pop, protected by the lock */
+	u64 tail;		/* next cell to push */
+	u64 nr_overflow;	/* tasks queued in the tree, written under the lock */
 };
 
 
@@ -45,6 +78,7 @@ typedef struct scx_task_common __arena scx_task_common;
 u64 scx_atq_create_internal(bool fifo, size_t capacity);
 #define scx_atq_create(fifo) scx_atq_create_internal((fifo), SCX_ATQ_INF_CAPACITY)
 #define scx_atq_create_size(fifo, capacity) scx_atq_create_internal((fifo), (capacity))
+int scx_atq_destroy(scx_atq_t __arg_arena *atq);
 int scx_atq_insert(scx_atq_t *atq, scx_task_common *taskc);
 int scx_atq_insert_vtime(scx_atq_t __arg_arena *atq, scx_task_common *taskc, u64 vtime);
 int scx_atq_remove(scx_atq_t *atq, scx_task_common *taskc);
@@ -5,7 +5,21 @@
 #include <scx/bpf_arena_spin_lock.h>
 
 #define BT_MAXLVL_PRINT (10)
-#define BT_LEAFSZ 10
+
+/*
+ * Node size in 64-byte cache lines, set at build time. A node is BT_LEAFSZ
+ * key/value pairs plus four words of metadata, so the fanout is chosen to
+ * fill the lines exactly: 3 lines (the default) give a fanout of 10, 4 give
+ * 14, 8 give 30. Nodes are allocated line-aligned.
+ */
+#ifndef BT_NODE_CACHELINES
+#define BT_NODE_CACHELINES (3)
+#endif
+
+#define BT_CACHELINE_SIZE (64)
+#define BT_LEAFSZ (4 * BT_NODE_CACHELINES - 2)
+
+_Static_assert(BT_NODE_CACHELINES >= 2, "btree nodes need a fanout of at least 6");
 
 #define BT_F_LEAF (0x1)
 
@@ -18,8 +32,12 @@ struct bt_node {
 	u64 flags;
 	u64 numkeys;
 	bt_node *parent;
+	bt_node *next;		/* next leaf in key order, leaves only */
 };
 
+_Static_assert(sizeof(struct bt_node) == BT_NODE_CACHELINES * BT_CACHELINE_SIZE,
+	       "btree node does not fill its cache lines");
+
 struct btree {
 	bt_node *root;
 	bt_node *freelist;
@@ -31,10 +49,28 @@ typedef struct btree __arena btree_t;
 u64 bt_create_internal(void);
 #define bt_create() ((btree_t *)(bt_create_internal()))
 
+u64 bt_bulk_load_internal(u64 __arena *keys, u64 __arena *values, u64 nr);
+#define bt_bulk_load(keys, values, nr) ((btree_t *)(bt_bulk_load_internal((keys), (values), (nr))))
+
 int bt_destroy(btree_t *btree);
 int bt_insert(btree_t *btree, u64 key, u64 value, bool update);
 int bt_remove(btree_t *btree, u64 key);
 int bt_find(btree_t *btree, u64 key, u64 *value);
 int bt_print(btree_t *btree);
 
-/* XXXETSAL Iterators */
+/*
+ * Forward iterator over the leaves. Any insertion or removal invalidates it.
+ *
+ *	struct bt_iter it;
+ *
+ *	bt_iter_seek(btree, lo, &it);
+ *	while (!bt_iter_next(&it, &key, &value) && key < hi && can_loop)
+ *		...
+ */
+struct bt_iter {
+	u64 leaf;	/* bt_node *, NULL once exhausted */
+	u64 ind;
+};
+
+int bt_iter_seek(btree_t *btree, u64 key, struct bt_iter *it);
+int bt_iter_next(struct bt_iter *it, u64 *key, u64 *value);
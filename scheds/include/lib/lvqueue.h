@@ -5,6 +5,13 @@ struct lv_arr;
 #define LV_ARR_BASESZ 128
 #define LV_ARR_ORDERS 10
 
+/*
+ * The owner halves the array once this many pops in a row have left it less
+ * than 1 / LV_ARR_SHRINK_RATIO full.
+ */
+#define LV_ARR_SHRINK_RATIO 4
+#define LV_ARR_SHRINK_DELAY 64
+
 struct lv_arr {
 	u64 __arena *data;
 	u64 order;
@@ -16,6 +23,7 @@ struct lv_queue {
 	lv_arr_t *cur;
 	volatile u64 top;
 	volatile u64 bottom;
+	u64 nr_low;		/* consecutive sparse pops, owner only */
 	struct lv_arr arr[LV_ARR_ORDERS];
 };
 
@@ -24,8 +32,37 @@ typedef struct lv_queue __arena lv_queue_t;
 int lvq_push(lv_queue_t *lvq, u64 val);
 int lvq_pop(lv_queue_t *lvq, u64 *val);
 int lvq_steal(lv_queue_t *lvq, u64 *val);
+int lvq_steal_half(lv_queue_t *victim, lv_queue_t *thief);
 
 u64 lvq_create_internal(void);
 #define lvq_create() ((lv_queue_t *)lvq_create_internal())
 
 int lvq_destroy(lv_queue_t *lvq);
+
+/* Most elements moved by a single lvq_steal_half(). */
+#define LVQ_STEAL_MAX 32
+
+/*
+ * Per-CPU work-stealing deques. Each CPU pushes to and pops from its own
+ * queue. When it runs dry it steals half of the first non-empty queue it
+ * finds, looking at the CPUs that share its core first, then its LLC, then
+ * its NUMA node and only then the rest of the machine.
+ */
+struct lvq_pool {
+	u64 nr_queues;
+	u64 __arena *queues;	/* lv_queue_t * per CPU */
+
+	/* Racy statistics, for tuning. */
+	u64 nr_steals;		/* successful steals */
+	u64 nr_stolen;		/* elements moved by them */
+	u64 nr_steal_fails;	/* pops that found every queue empty */
+};
+
+typedef struct lvq_pool __arena lvq_pool_t;
+
+u64 lvq_pool_create_internal(u32 nr_queues);
+#define lvq_pool_create(nr_queues) ((lvq_pool_t *)lvq_pool_create_internal((nr_queues)))
+
+int lvq_pool_destroy(lvq_pool_t *pool);
+int lvq_pool_push(lvq_pool_t *pool, u32 cpu, u64 val);
+int lvq_pool_pop(lvq_pool_t *pool, u32 cpu, u64 *val);
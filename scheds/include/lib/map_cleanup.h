@@ -0,0 +1,535 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+/*
+ * Timer-driven sweeper for task-tracking maps.
+ *
+ * Schedulers that keep per-task state in a BPF hash map need to evict the
+ * entries of tasks that went away. Doing that from ops.dispatch() makes
+ * whichever CPU happens to cross the interval boundary pay for the scan, and
+ * several CPUs can cross it at once. Instead, run the sweep from a bpf_timer
+ * pinned to a single CPU so it stays off the scheduling hot path.
+ *
+ * Usage:
+ *
+ *	#define SCX_MAP_CLEANUP_TARGET	tasks
+ *	#include <lib/map_cleanup.h>
+ *
+ * where @tasks is a map declared before the include. Call
+ * scx_map_cleanup_init() from ops.init() and scx_map_cleanup_arm() from a
+ * callback that runs on every CPU, e.g. ops.dispatch(). The latter is a
+ * single load once the timer is running; it only exists because a timer can
+ * be pinned to the CPU that starts it and ops.init() may run anywhere.
+ *
+ * If the scheduler also defines SCX_MAP_CLEANUP_AGE_OFFSET to the offset of
+ * the u64 last-touched timestamp in the map value, the sweep is driven by
+ * lib/age_index.h and only visits the entries that expired. The update paths
+ * then have to report every timestamp refresh via scx_map_cleanup_touch(). A
+ * full scan is only used as a backstop when the age index overflowed.
+ *
+ * Schedulers that hang resources off the map values (arena allocations,
+ * allocated objects) can define SCX_MAP_CLEANUP_EVICT_FN to a function
+ *
+ *	static void fn(u32 key, void *val);
+ *
+ * which is handed every expired entry once it has been deleted, so the
+ * resources can be released in the same pass without another lookup. The
+ * entry may already be reused by then, so @val points to a copy of the value
+ * taken before the delete, which is why the map must declare its value with
+ * __type() rather than value_size. Entries that fail to be deleted stay in
+ * the map and aren't passed to the callback. This requires
+ * SCX_MAP_CLEANUP_AGE_OFFSET. The full scan then walks the map with
+ * bpf_for_each_map_elem() instead of scx_bpf_map_scan_timeout_resume(), as
+ * the kfunc deletes entries without telling us.
+ *
+ * If SCX_MAP_CLEANUP_TARGET is a map declared with SCX_SHARDED_MAP_DEFINE()
+ * from lib/sharded_map.h, define SCX_MAP_CLEANUP_SHARDED as well. Each timer
+ * tick then sweeps the shards round-robin within the same budget. Sharded
+ * maps don't support the age index yet.
+ *
+ * With map_cleanup_adaptive set, the interval, budget and max age are only
+ * starting points. After each sweep, scx_map_cleanup_adapt() retunes them
+ * from an EWMA of the map fill ratio and of the evictions per sweep, and
+ * from whether the sweep ran out of budget. The values in effect are
+ * published in map_cleanup_ctl.
+ *
+ * Every sweep is reported as a struct scx_map_cleanup_event on the
+ * map_cleanup_events ring buffer, which the loaders drain with the collector
+ * in scx/map_cleanup.h.
+ *
+ * The knobs below are read-only and can be overridden by the loader.
+ */
+#pragma once
+
+#include <scx/common.bpf.h>
+#include <lib/map_cleanup_defs.h>
+
+#ifndef SCX_MAP_CLEANUP_TARGET
+#error "define SCX_MAP_CLEANUP_TARGET to the map to sweep before including lib/map_cleanup.h"
+#endif
+
+#if defined(SCX_MAP_CLEANUP_EVICT_FN) && !defined(SCX_MAP_CLEANUP_AGE_OFFSET)
+#error "SCX_MAP_CLEANUP_EVICT_FN requires SCX_MAP_CLEANUP_AGE_OFFSET"
+#endif
+
+#if defined(SCX_MAP_CLEANUP_SHARDED) && defined(SCX_MAP_CLEANUP_AGE_OFFSET)
+#error "SCX_MAP_CLEANUP_SHARDED can't be combined with SCX_MAP_CLEANUP_AGE_OFFSET"
+#endif
+
+#ifdef SCX_MAP_CLEANUP_SHARDED
+#include <lib/sharded_map.h>
+#endif
+
+#ifdef SCX_MAP_CLEANUP_AGE_OFFSET
+#ifdef SCX_MAP_CLEANUP_EVICT_FN
+typedef typeof(*SCX_MAP_CLEANUP_TARGET.value) scx_map_cleanup_val_t;
+#define SCX_AGE_INDEX_EVICT_FN		SCX_MAP_CLEANUP_EVICT_FN
+#define SCX_AGE_INDEX_VALUE_TYPE	scx_map_cleanup_val_t
+#endif
+#include <lib/age_index.h>
+#endif
+
+const volatile s32 map_cleanup_cpu = 0;
+const volatile u64 map_cleanup_interval_ns = 1000000000ULL;
+const volatile u64 map_cleanup_budget_ns = 100000ULL;
+const volatile u64 map_cleanup_max_age_ns = 5000000000ULL;
+
+const volatile bool map_cleanup_adaptive = true;
+const volatile u64 map_cleanup_interval_min_ns = 100000000ULL;
+const volatile u64 map_cleanup_interval_max_ns = 2000000000ULL;
+const volatile u64 map_cleanup_budget_min_ns = 20000ULL;
+const volatile u64 map_cleanup_budget_max_ns = 500000ULL;
+const volatile u64 map_cleanup_max_age_min_ns = 1000000000ULL;
+const volatile u32 map_cleanup_fill_high_pct = 75;
+const volatile u32 map_cleanup_fill_low_pct = 25;
+
+#define MAP_CLEANUP_ALPHA	90
+/* evicted_avg is fixed point so that sweeps evicting a few entries count */
+#define MAP_CLEANUP_AVG_SHIFT	8
+/* below 1/8 eviction per sweep on average, sweeping is mostly wasted */
+#define MAP_CLEANUP_EVICTED_IDLE	((1 << MAP_CLEANUP_AVG_SHIFT) / 8)
+
+struct scx_map_cleanup_stats {
+	u64 nr_scans;
+	u64 nr_visited;
+	u64 nr_evicted;
+	u64 nr_timeouts;
+	u64 nr_errors;
+	u64 nr_events_dropped;
+};
+
+/* Parameters in effect, retuned after every sweep if map_cleanup_adaptive. */
+struct scx_map_cleanup_ctl {
+	u64 interval_ns;
+	u64 budget_ns;
+	u64 max_age_ns;
+	u64 fill_pct_avg;	/* -1 if the map can't be counted */
+	u64 evicted_avg;	/* evictions per sweep << MAP_CLEANUP_AVG_SHIFT */
+};
+
+struct scx_map_cleanup_stats map_cleanup_stats;
+struct scx_map_cleanup_ctl map_cleanup_ctl;
+bool map_cleanup_timer_pinned = true;
+
+struct {
+	__uint(type, BPF_MAP_TYPE_RINGBUF);
+	__uint(max_entries, MAP_CLEANUP_RINGBUF_SZ);
+} map_cleanup_events SEC(".maps");
+
+static u32 map_cleanup_armed;
+#ifndef SCX_MAP_CLEANUP_SHARDED
+static u64 map_cleanup_cursor;
+#endif
+
+#ifdef SCX_MAP_CLEANUP_EVICT_FN
+struct scx_map_cleanup_walk {
+	u64 now;
+	u64 deadline;
+	u64 skip;
+	u64 pos;		/* entries kept, to resume a timed out walk */
+	u64 nr_walked;		/* entries seen, to pace the deadline checks */
+	u32 evicted;
+	bool timedout;
+};
+
+static long scx_map_cleanup_walk_fn(struct bpf_map *map, const void *key,
+				    void *val, void *data)
+{
+	struct scx_map_cleanup_walk *walk = data;
+	u32 k = *(const u32 *)key;
+	scx_map_cleanup_val_t copy;
+	u64 ts;
+
+	if (walk->pos < walk->skip) {
+		walk->pos++;
+		return 0;
+	}
+
+	if (!(walk->nr_walked++ & 63) && bpf_ktime_get_ns() > walk->deadline) {
+		walk->timedout = true;
+		return 1;
+	}
+
+	map_cleanup_stats.nr_visited++;
+
+	ts = *(u64 *)(val + SCX_MAP_CLEANUP_AGE_OFFSET);
+	if (!time_before(ts, walk->now - map_cleanup_ctl.max_age_ns)) {
+		walk->pos++;
+		return 0;
+	}
+
+	__builtin_memcpy(&copy, val, sizeof(copy));
+	if (bpf_map_delete_elem(map, &k)) {
+		walk->pos++;
+		return 0;
+	}
+
+	walk->evicted++;
+	SCX_MAP_CLEANUP_EVICT_FN(k, &copy);
+
+	return 0;
+}
+
+/*
+ * bpf_for_each_map_elem() can't start from the middle of the map. Resume by
+ * skipping the entries that were kept by the previous, timed out, walk.
+ * Entries deleted in the meantime make us skip a few more than needed, which
+ * the next walk picks up.
+ */
+static int scx_map_cleanup_full_scan(u32 *evicted)
+{
+	struct scx_map_cleanup_walk walk = {
+		.now = bpf_ktime_get_ns(),
+		.skip = map_cleanup_cursor,
+	};
+
+	walk.deadline = walk.now + map_cleanup_ctl.budget_ns;
+	if (walk.now < map_cleanup_ctl.max_age_ns)
+		return 0;
+
+	bpf_for_each_map_elem(&SCX_MAP_CLEANUP_TARGET, scx_map_cleanup_walk_fn,
+			      &walk, 0);
+
+	*evicted += walk.evicted;
+	if (walk.timedout) {
+		map_cleanup_cursor = walk.pos;
+		return -ETIMEDOUT;
+	}
+
+	map_cleanup_cursor = 0;
+	return 0;
+}
+#elif defined(SCX_MAP_CLEANUP_SHARDED)
+static int scx_map_cleanup_full_scan(u32 *evicted)
+{
+	return scx_sharded_map_scan(SCX_MAP_CLEANUP_TARGET,
+				    map_cleanup_ctl.budget_ns,
+				    map_cleanup_ctl.max_age_ns, evicted);
+}
+#else
+static int scx_map_cleanup_full_scan(u32 *evicted)
+{
+	return __COMPAT_scx_bpf_map_scan_timeout_resume(&SCX_MAP_CLEANUP_TARGET,
+							&map_cleanup_cursor,
+							map_cleanup_ctl.budget_ns,
+							map_cleanup_ctl.max_age_ns,
+							evicted);
+}
+#endif
+
+#ifdef SCX_MAP_CLEANUP_AGE_OFFSET
+/* Age index overflows already covered by a completed full scan. */
+static u64 map_cleanup_overflows_seen;
+static bool map_cleanup_backstop;
+
+static int scx_map_cleanup_scan(u32 *evicted)
+{
+	u64 nr_overflows = age_index_stats.nr_overflows;
+	u64 nr_popped = age_index_stats.nr_popped;
+	u32 swept = 0;
+	int ret;
+
+	ret = scx_age_index_expire(&SCX_MAP_CLEANUP_TARGET,
+				   SCX_MAP_CLEANUP_AGE_OFFSET,
+				   bpf_ktime_get_ns(), map_cleanup_ctl.max_age_ns,
+				   map_cleanup_ctl.budget_ns, evicted);
+	map_cleanup_stats.nr_visited += age_index_stats.nr_popped - nr_popped;
+	if (ret)
+		return ret;
+
+	if (!map_cleanup_backstop && nr_overflows == map_cleanup_overflows_seen)
+		return 0;
+
+	/*
+	 * Some pushes were dropped and the entries may never show up in an
+	 * expired bucket. Sweep the whole map once to catch them.
+	 */
+	if (!map_cleanup_backstop) {
+		map_cleanup_backstop = true;
+		map_cleanup_overflows_seen = nr_overflows;
+	}
+
+	ret = scx_map_cleanup_full_scan(&swept);
+	*evicted += swept;
+	if (!ret)
+		map_cleanup_backstop = false;
+
+	return ret;
+}
+
+/*
+ * Report that the entry at @key had its timestamp moved from @prev_ns to
+ * @now_ns. @prev_ns is 0 for a new entry.
+ */
+static __always_inline void scx_map_cleanup_touch(u32 key, u64 prev_ns, u64 now_ns)
+{
+	scx_age_index_touch(key, prev_ns, now_ns);
+}
+#else
+static int scx_map_cleanup_scan(u32 *evicted)
+{
+	return scx_map_cleanup_full_scan(evicted);
+}
+
+static __always_inline void scx_map_cleanup_touch(u32 key, u64 prev_ns, u64 now_ns)
+{
+}
+#endif
+
+struct scx_map_cleanup_timer {
+	struct bpf_timer timer;
+};
+
+struct {
+	__uint(type, BPF_MAP_TYPE_ARRAY);
+	__uint(max_entries, 1);
+	__type(key, u32);
+	__type(value, struct scx_map_cleanup_timer);
+} map_cleanup_timer SEC(".maps");
+
+/*
+ * Number of entries in the target map, or -1 if it can't be counted. A
+ * sharded map is an array of maps and its own count says nothing.
+ */
+static s64 scx_map_cleanup_nr_entries(void)
+{
+#ifdef SCX_MAP_CLEANUP_SHARDED
+	return -1;
+#else
+	s64 nr;
+
+	if (!bpf_ksym_exists(bpf_map_sum_elem_count))
+		return -1;
+
+	nr = bpf_map_sum_elem_count((void *)&SCX_MAP_CLEANUP_TARGET);
+	return nr < 0 ? -1 : nr;
+#endif
+}
+
+/* Occupancy of the target map in percent, or -1 if it can't be counted. */
+static u64 scx_map_cleanup_fill_pct(s64 nr_entries)
+{
+	struct bpf_map *map = (void *)&SCX_MAP_CLEANUP_TARGET;
+	u32 max_entries = map->max_entries;
+
+	if (nr_entries < 0 || !max_entries)
+		return -1;
+
+	return (u64)nr_entries * 100 / max_entries;
+}
+
+static u64 scx_map_cleanup_clamp(u64 v, u64 lo, u64 hi)
+{
+	if (v < lo)
+		return lo;
+	if (v > hi)
+		return hi;
+	return v;
+}
+
+/*
+ * Retune the cleanup parameters from the outcome of the last sweep.
+ *
+ * - A sweep that ran out of budget means we're falling behind: double the
+ *   budget and halve the interval.
+ * - A filling map needs entries to go sooner: sweep at the minimum interval
+ *   and shorten max_age, but never below map_cleanup_max_age_min_ns.
+ * - A mostly empty map where sweeps evict nothing is wasting time: back off
+ *   the interval, shrink the budget and let max_age recover towards the
+ *   configured value.
+ */
+static void scx_map_cleanup_adapt(int ret, u32 evicted, s64 nr_entries)
+{
+	struct scx_map_cleanup_ctl *ctl = &map_cleanup_ctl;
+	u64 interval = ctl->interval_ns;
+	u64 budget = ctl->budget_ns;
+	u64 max_age = ctl->max_age_ns;
+	u64 fill = scx_map_cleanup_fill_pct(nr_entries);
+
+	ctl->evicted_avg = (ctl->evicted_avg * MAP_CLEANUP_ALPHA +
+			    ((u64)evicted << MAP_CLEANUP_AVG_SHIFT) *
+			    (100 - MAP_CLEANUP_ALPHA)) / 100;
+	if (fill == (u64)-1 || ctl->fill_pct_avg == (u64)-1)
+		ctl->fill_pct_avg = fill;
+	else
+		ctl->fill_pct_avg = (ctl->fill_pct_avg * MAP_CLEANUP_ALPHA +
+				     fill * (100 - MAP_CLEANUP_ALPHA)) / 100;
+
+	if (ret == -ETIMEDOUT) {
+		budget *= 2;
+		interval /= 2;
+	}
+
+	/* The instantaneous fill reacts to bursts, the average to trends. */
+	if (fill != (u64)-1 && (fill >= map_cleanup_fill_high_pct ||
+				ctl->fill_pct_avg >= map_cleanup_fill_high_pct)) {
+		interval = map_cleanup_interval_min_ns;
+		max_age = max_age * 3 / 4;
+	} else if (ret != -ETIMEDOUT &&
+		   ctl->evicted_avg < MAP_CLEANUP_EVICTED_IDLE &&
+		   (fill == (u64)-1 || ctl->fill_pct_avg <= map_cleanup_fill_low_pct)) {
+		interval *= 2;
+		budget = budget * 3 / 4;
+		max_age += max_age / 4;
+	} else if (ret != -ETIMEDOUT) {
+		/* Steady state, drift back towards the configured interval. */
+		interval = (interval + map_cleanup_interval_ns) / 2;
+	}
+
+	ctl->interval_ns = scx_map_cleanup_clamp(interval,
+						 map_cleanup_interval_min_ns,
+						 map_cleanup_interval_max_ns);
+	ctl->budget_ns = scx_map_cleanup_clamp(budget,
+					       map_cleanup_budget_min_ns,
+					       map_cleanup_budget_max_ns);
+	ctl->max_age_ns = scx_map_cleanup_clamp(max_age,
+						map_cleanup_max_age_min_ns,
+						map_cleanup_max_age_ns);
+}
+
+static void scx_map_cleanup_report(u64 start, u64 end, u64 nr_visited,
+				   s64 nr_entries, u32 evicted, int ret)
+{
+	struct scx_map_cleanup_event *ev;
+
+	ev = bpf_ringbuf_reserve(&map_cleanup_events, sizeof(*ev), 0);
+	if (!ev) {
+		map_cleanup_stats.nr_events_dropped++;
+		return;
+	}
+
+	ev->ts_ns = start;
+	ev->scan_ns = end - start;
+	ev->nr_visited = nr_visited;
+	ev->nr_entries = nr_entries;
+	ev->interval_ns = map_cleanup_ctl.interval_ns;
+	ev->budget_ns = map_cleanup_ctl.budget_ns;
+	ev->max_age_ns = map_cleanup_ctl.max_age_ns;
+	ev->nr_evicted = evicted;
+	ev->ret = ret;
+
+	bpf_ringbuf_submit(ev, 0);
+}
+
+static int scx_map_cleanup_timerfn(void *map, int *key, struct bpf_timer *timer)
+{
+	u64 nr_visited = map_cleanup_stats.nr_visited;
+	u64 start, end;
+	u32 evicted = 0;
+	s64 nr_entries;
+	int ret;
+
+	start = bpf_ktime_get_ns();
+	ret = scx_map_cleanup_scan(&evicted);
+	end = bpf_ktime_get_ns();
+
+	/* The timer only ever runs on one CPU, no need for atomics. */
+	map_cleanup_stats.nr_scans++;
+	map_cleanup_stats.nr_evicted += evicted;
+	if (ret == -ETIMEDOUT)
+		map_cleanup_stats.nr_timeouts++;
+	else if (ret)
+		map_cleanup_stats.nr_errors++;
+
+	nr_entries = scx_map_cleanup_nr_entries();
+	scx_map_cleanup_report(start, end,
+			       map_cleanup_stats.nr_visited - nr_visited,
+			       nr_entries, evicted, ret);
+
+	if (map_cleanup_adaptive)
+		scx_map_cleanup_adapt(ret, evicted, nr_entries);
+
+	bpf_timer_start(timer, map_cleanup_ctl.interval_ns,
+			map_cleanup_timer_pinned ? BPF_F_TIMER_CPU_PIN : 0);
+	return 0;
+}
+
+/*
+ * Set up the cleanup timer. Must be called from ops.init(). The timer is not
+ * started until scx_map_cleanup_arm() runs on map_cleanup_cpu.
+ */
+static s32 scx_map_cleanup_init(void)
+{
+	struct scx_map_cleanup_timer *ct;
+	u32 key = 0;
+	int ret;
+
+	map_cleanup_ctl.interval_ns = map_cleanup_interval_ns;
+	map_cleanup_ctl.budget_ns = map_cleanup_budget_ns;
+	map_cleanup_ctl.max_age_ns = map_cleanup_max_age_ns;
+	map_cleanup_ctl.fill_pct_avg =
+		scx_map_cleanup_fill_pct(scx_map_cleanup_nr_entries());
+
+	ct = bpf_map_lookup_elem(&map_cleanup_timer, &key);
+	if (!ct)
+		return -ESRCH;
+
+	ret = bpf_timer_init(&ct->timer, &map_cleanup_timer, CLOCK_MONOTONIC);
+	if (ret) {
+		scx_bpf_error("Failed to initialize map cleanup timer (%d)", ret);
+		return ret;
+	}
+
+	ret = bpf_timer_set_callback(&ct->timer, scx_map_cleanup_timerfn);
+	if (ret)
+		scx_bpf_error("Failed to set map cleanup timer callback (%d)", ret);
+
+	return ret;
+}
+
+/*
+ * Start the cleanup timer the first time we get called on map_cleanup_cpu.
+ * Cheap enough to call from ops.dispatch().
+ */
+static __always_inline void scx_map_cleanup_arm(void)
+{
+	struct scx_map_cleanup_timer *ct;
+	u32 key = 0;
+	int ret;
+
+	if (likely(READ_ONCE(map_cleanup_armed)))
+		return;
+
+	if (bpf_get_smp_processor_id() != map_cleanup_cpu)
+		return;
+
+	if (__sync_val_compare_and_swap(&map_cleanup_armed, 0, 1))
+		return;
+
+	ct = bpf_map_lookup_elem(&map_cleanup_timer, &key);
+	if (!ct) {
+		scx_bpf_error("Failed to lookup map cleanup timer");
+		return;
+	}
+
+	ret = bpf_timer_start(&ct->timer, map_cleanup_ctl.interval_ns,
+			      BPF_F_TIMER_CPU_PIN);
+	/*
+	 * BPF_F_TIMER_CPU_PIN needs >=6.7, see central_init() in scx_central
+	 * for the details. Fall back to an unpinned timer.
+	 */
+	if (ret == -EINVAL) {
+		map_cleanup_timer_pinned = false;
+		ret = bpf_timer_start(&ct->timer, map_cleanup_ctl.interval_ns, 0);
+	}
+	if (ret)
+		scx_bpf_error("Failed to arm map cleanup timer (%d)", ret);
+}
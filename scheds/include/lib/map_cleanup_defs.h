@@ -0,0 +1,22 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+/*
+ * Definitions shared between lib/map_cleanup.h and the userspace collector in
+ * scx/map_cleanup.h.
+ */
+#pragma once
+
+#define MAP_CLEANUP_EVENTS_MAP		"map_cleanup_events"
+#define MAP_CLEANUP_RINGBUF_SZ		(256 * 1024)
+
+/* One record per cleanup sweep. */
+struct scx_map_cleanup_event {
+	u64 ts_ns;		/* CLOCK_MONOTONIC at the start of the sweep */
+	u64 scan_ns;		/* time spent sweeping */
+	u64 nr_visited;		/* entries looked at, 0 if the kfunc did the scan */
+	s64 nr_entries;		/* map occupancy after the sweep, -1 if unknown */
+	u64 interval_ns;	/* cleanup parameters in effect for the sweep */
+	u64 budget_ns;
+	u64 max_age_ns;
+	u32 nr_evicted;
+	s32 ret;		/* 0, -ETIMEDOUT or another error */
+};
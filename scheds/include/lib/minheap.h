@@ -1,5 +1,28 @@
 #pragma once
 
+/*
+ * Fan-out of scx_minheap, selected at build time with -DSCX_MINHEAP_ARITY=N.
+ * Elements are 16 bytes and the sibling groups are aligned, so with N = 4 the
+ * children of a node share one 64-byte cache line and with N = 8 an aligned
+ * pair of lines. Sifting then touches a line or two per level instead of one
+ * per comparison, and the heap is half or a third as deep as a binary one.
+ */
+#ifndef SCX_MINHEAP_ARITY
+#define SCX_MINHEAP_ARITY 2
+#endif
+
+_Static_assert(SCX_MINHEAP_ARITY == 2 || SCX_MINHEAP_ARITY == 4 || SCX_MINHEAP_ARITY == 8,
+	       "SCX_MINHEAP_ARITY must be 2, 4 or 8");
+
+/*
+ * Largest capacity scx_minheap_alloc() and scx_idx_minheap_alloc() accept.
+ * The element arrays come from scx_dyn_alloc(), which backs anything above
+ * SCX_DYN_MAX_BUDDY_BYTES (32K elements of a plain heap) with whole arena
+ * pages, so the real bound is the free space in the arena. This keeps a bad
+ * capacity from asking for a sizable fraction of it.
+ */
+#define SCX_MINHEAP_MAX_CAPACITY	(1ULL << 24)
+
 struct scx_minheap_elem {
 	u64 elem;
 	u64 weight;
@@ -8,19 +31,59 @@ struct scx_minheap_elem {
 struct scx_minheap {
 	u64				size;
 	u64				capacity;
-	struct scx_minheap_elem		__arena *helems;
+	struct scx_minheap_elem		__arena *helems;	/* see SCX_MINHEAP_ELEM() */
 };
 
 typedef struct scx_minheap __arena scx_minheap_t;
 
+#define SCX_IDX_MINHEAP_INVALID ((u32)-1)
+
+struct scx_idx_minheap_elem {
+	u64 elem;
+	u64 weight;
+	u64 handle;
+};
+
+/*
+ * Minheap whose elements can be found by the handle returned on insert, so
+ * that they can be reweighted or removed in O(log n).
+ *
+ * Handle slots are recycled. The low 32 bits of a handle are its slot and the
+ * upper bits the slot's generation at insert time, which is bumped whenever
+ * the slot is released, so that a stale handle doesn't match the element that
+ * reused its slot.
+ */
+struct scx_idx_minheap {
+	u64				size;
+	u64				capacity;
+	struct scx_idx_minheap_elem	__arena *helems;
+	u32				__arena *pos;		/* handle -> index in helems */
+	u32				__arena *gens;		/* handle slot -> generation */
+	u32				__arena *free_handles;	/* stack of released slots */
+	u64				nr_handles;		/* handles ever handed out */
+	u64				nr_free;
+};
+
+typedef struct scx_idx_minheap __arena scx_idx_minheap_t;
+
 #ifdef __BPF__
 
 u64 scx_minheap_alloc_internal(size_t capacity);
 #define scx_minheap_alloc(capacity) (scx_minheap_t *)scx_minheap_alloc_internal(capacity)
+int scx_minheap_destroy(scx_minheap_t *heap __arg_arena);
 
 int scx_minheap_balance_top_down(void __arena *heap_ptr __arg_arena);
 int scx_minheap_insert(void __arena *heap_ptr __arg_arena, u64 elem, u64 weight);
 int scx_minheap_dump(scx_minheap_t *heap __arg_arena);
 int scx_minheap_pop(void __arena *heap_ptr __arg_arena, struct scx_minheap_elem *helem __arg_trusted);
 
+u64 scx_idx_minheap_alloc_internal(size_t capacity);
+#define scx_idx_minheap_alloc(capacity) (scx_idx_minheap_t *)scx_idx_minheap_alloc_internal(capacity)
+int scx_idx_minheap_destroy(scx_idx_minheap_t *heap __arg_arena);
+
+s64 scx_idx_minheap_insert(scx_idx_minheap_t *heap __arg_arena, u64 elem, u64 weight);
+int scx_idx_minheap_update_weight(scx_idx_minheap_t *heap __arg_arena, u64 handle, u64 weight);
+int scx_idx_minheap_remove(scx_idx_minheap_t *heap __arg_arena, u64 handle);
+int scx_idx_minheap_pop(scx_idx_minheap_t *heap __arg_arena, struct scx_minheap_elem *helem __arg_trusted);
+
 #endif /* __BPF__ */
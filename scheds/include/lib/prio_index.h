@@ -0,0 +1,83 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+/*
+ * Exact vtime ordering for the sampling schedulers.
+ *
+ * scx_rand and scx_dynamic pick the next task by drawing random keys from a
+ * flat array, taking the global map lock for every draw, and only
+ * approximate the lowest vtime. The priority index instead keeps the
+ * runnable tasks in an arena rbtree keyed by vtime (lib/rbtree.h), so that
+ * both inserting a task and popping the lowest vtime are O(log n) under a
+ * single lock acquisition.
+ *
+ * The tree and its nodes come from the library's reclaimable allocator and
+ * the lock from the static arena allocation, so users must be built as
+ * library schedulers and call scx_prio_index_init() from ops.init(). Nodes
+ * are recycled through the rbtree freelist.
+ */
+#pragma once
+
+#include <scx/common.bpf.h>
+#include <scx/bpf_arena_common.bpf.h>
+#include <lib/sdt_task.h>
+#include <lib/rbtree.h>
+
+#ifndef SCX_PRIO_INDEX_PAGES
+#define SCX_PRIO_INDEX_PAGES	1
+#endif
+
+static rbtree_t *prio_index;
+static arena_spinlock_t __arena *prio_index_lock;
+
+static s32 scx_prio_index_init(void)
+{
+	int ret;
+
+	ret = scx_static_init(SCX_PRIO_INDEX_PAGES);
+	if (ret)
+		return ret;
+
+	/* Tasks with equal vtime are common, don't reject them. */
+	prio_index = rb_create(RB_ALLOC, RB_DUPLICATE);
+	if (!prio_index)
+		return -ENOMEM;
+
+	prio_index_lock = scx_static_alloc(sizeof(*prio_index_lock), 1);
+	if (!prio_index_lock)
+		return -ENOMEM;
+
+	return 0;
+}
+
+/* Queue @pid with priority @vtime. */
+static int scx_prio_index_insert(u64 vtime, u32 pid)
+{
+	int ret;
+
+	ret = arena_spin_lock(prio_index_lock);
+	if (ret)
+		return ret;
+
+	ret = rb_insert(prio_index, vtime, pid);
+	arena_spin_unlock(prio_index_lock);
+
+	return ret;
+}
+
+/* Dequeue the task with the lowest vtime. Returns -ENOENT if empty. */
+static int scx_prio_index_pop(u32 *pid)
+{
+	u64 vtime, val;
+	int ret;
+
+	ret = arena_spin_lock(prio_index_lock);
+	if (ret)
+		return ret;
+
+	ret = rb_pop(prio_index, &vtime, &val);
+	arena_spin_unlock(prio_index_lock);
+
+	if (!ret)
+		*pid = val;
+
+	return ret;
+}
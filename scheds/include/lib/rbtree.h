@@ -63,12 +63,23 @@ enum rbtree_insert_mode {
 
 struct rbtree {
 	rbnode_t *root;
+	rbnode_t *leftmost;	/* cached minimum, NULL if empty */
 	rbnode_t *freelist;
 	enum rbtree_alloc alloc;
 	enum rbtree_insert_mode insert;
 };
 
 typedef struct rbtree __arena rbtree_t;
+
+#define RB_BATCH_MAX (16)
+
+/* Key/value pairs returned by the bulk operations, in ascending key order. */
+struct rb_batch {
+	u64 nr;
+	u64 keys[RB_BATCH_MAX];
+	u64 values[RB_BATCH_MAX];
+};
+
 #ifdef __BPF__
 u64 rb_create_internal(enum rbtree_alloc alloc, enum rbtree_insert_mode insert);
 #define rb_create(alloc, insert) ((rbtree_t *)rb_create_internal((alloc), (insert)))
@@ -80,6 +91,23 @@ int rb_find(rbtree_t *rbtree, u64 key, u64 *value);
 int rb_print(rbtree_t *rbtree);
 int rb_least(rbtree_t *rbtree, u64 *key, u64 *value);
 int rb_pop(rbtree_t *rbtree, u64 *key, u64 *value);
+int rb_pop_n(rbtree_t *rbtree, u64 n, struct rb_batch *batch);
+int rb_range(rbtree_t *rbtree, u64 lo, u64 hi, struct rb_batch *batch);
+
+/*
+ * In-order iteration. The nodes stay owned by the tree, so the iterator is
+ * invalidated by any insertion or removal.
+ */
+u64 rb_first_internal(rbtree_t *rbtree);
+#define rb_first(rbtree) ((rbnode_t *)rb_first_internal((rbtree)))
+u64 rb_last_internal(rbtree_t *rbtree);
+#define rb_last(rbtree) ((rbnode_t *)rb_last_internal((rbtree)))
+u64 rb_lower_bound_internal(rbtree_t *rbtree, u64 key);
+#define rb_lower_bound(rbtree, key) ((rbnode_t *)rb_lower_bound_internal((rbtree), (key)))
+u64 rb_next_internal(rbnode_t *node);
+#define rb_next(node) ((rbnode_t *)rb_next_internal((node)))
+u64 rb_prev_internal(rbnode_t *node);
+#define rb_prev(node) ((rbnode_t *)rb_prev_internal((node)))
 
 int rb_insert_node(rbtree_t *rbtree, rbnode_t *node);
 int rb_remove_node(rbtree_t *rbtree, rbnode_t *node);
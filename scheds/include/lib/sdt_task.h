@@ -96,7 +96,10 @@ struct scx_buddy_header {
 struct scx_buddy_chunk {
 	/* The order of the current allocation for a item. 4 bits per order. */
 	u8			orders[SCX_BUDDY_CHUNK_ITEMS / 2];
+	/* One bit per item, set if a free block starts at the item. */
+	u64			free[SCX_BUDDY_CHUNK_ITEMS / 64];
 	u64			order_indices[SCX_BUDDY_CHUNK_MAX_ORDER];
+	u64			nr_used_items;
 	scx_buddy_chunk_t	*prev;
 	scx_buddy_chunk_t	*next;
 };
@@ -104,10 +107,12 @@ struct scx_buddy_chunk {
 struct scx_buddy {
 	scx_buddy_chunk_t *first_chunk;		/* Pointer to the chunk linked list. */
 	size_t min_alloc_bytes;			/* Minimum allocation in bytes */
-	struct scx_stk stack;			/* Underlying stack page allocator. */
 	struct bpf_spin_lock lock;
 
-	/* XXXETSAL: Track used pages, used to drain the underlying page stack. */
+	/* Arena usage. Empty chunks are returned to the arena. */
+	u64 nr_chunks;				/* Chunks backing the allocator. */
+	u64 nr_allocs;				/* Live allocations. */
+	u64 bytes_used;				/* Bytes in live allocations, rounded up to the block size. */
 };
 
 int scx_buddy_init(struct scx_buddy *buddy, size_t size);
@@ -116,6 +121,20 @@ void scx_buddy_free_internal(struct scx_buddy *buddy, u64 free);
 u64 scx_buddy_alloc_internal(struct scx_buddy *buddy, size_t size);
 #define scx_buddy_alloc(alloc, size) ((void __arena *)scx_buddy_alloc_internal((alloc), (size)))
 
+/*
+ * General purpose arena allocator. Requests of up to SCX_DYN_MAX_BUDDY_BYTES
+ * come from the buddy allocator, rounded up to a power of two and aligned to
+ * it. Larger ones get whole arena pages of their own, page-aligned and with
+ * one more page for bookkeeping, so they are only bounded by the free space
+ * in the arena. Memory is returned zeroed, and scx_dyn_free() takes either.
+ */
+#define SCX_DYN_MAX_BUDDY_BYTES	(SCX_BUDDY_MIN_ALLOC_BYTES << (SCX_BUDDY_CHUNK_MAX_ORDER - 1))
+
+u64 scx_dyn_alloc_internal(size_t bytes);
+#define scx_dyn_alloc(bytes) ((void __arena *)scx_dyn_alloc_internal((bytes)))
+void scx_dyn_free_internal(u64 addr);
+#define scx_dyn_free(ptr) scx_dyn_free_internal((u64)(ptr))
+
 static inline
 int scx_ffs(__u64 word)
 {
@@ -25,6 +25,9 @@ enum sdt_consts {
 	SDT_TASK_ALLOC_STACK_MAX	= SDT_TASK_ALLOC_STACK_MIN * 5,
 	SDT_TASK_MIN_ELEM_PER_ALLOC 	= 8,
 	SDT_TASK_ALLOC_ATTEMPTS		= 32,
+	SDT_TASK_MAG_SIZE		= 16,
+	SDT_TASK_MAG_BATCH		= SDT_TASK_MAG_SIZE / 2,
+	SDT_TASK_MAG_MAX_ALLOCATORS	= 4,
 };
 
 union sdt_id {
@@ -94,11 +97,33 @@ struct scx_alloc_stats {
 	__u64		free_ops;
 	__u64		active_allocs;
 	__u64		arena_pages_used;
+	__u64		mag_hits;
+	__u64		mag_misses;
+	__u64		mag_refills;
+	__u64		mag_flushes;
+	__u64		mag_flush_errors;	/* flushes that stopped on a failed release */
+};
+
+/*
+ * Per-CPU magazine of freed allocations. Frees push onto it and allocations
+ * pop from it without taking the allocator lock. The entries stay marked as
+ * allocated in the radix tree while cached, and move to and from the tree
+ * SDT_TASK_MAG_BATCH at a time under a single lock acquisition.
+ */
+struct scx_alloc_mag {
+	__u32				busy;
+	__u32				nr;
+	struct sdt_data __arena		*data[SDT_TASK_MAG_SIZE];
+	/* Folded into alloc_stats on the next refill or flush. */
+	__u64				nr_hits;
+	__u64				nr_misses;
+	__u64				nr_frees;
 };
 
 struct scx_allocator {
 	struct sdt_pool	pool;
 	sdt_desc_t	*root;
+	__u32		mag_id;
 };
 
 struct scx_static {
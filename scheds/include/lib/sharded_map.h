@@ -0,0 +1,185 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+/*
+ * Sharded task-tracking map.
+ *
+ * A single BPF_MAP_TYPE_HASH updated from every CPU on every enqueue or
+ * running event turns its bucket locks and element freelist into a point of
+ * contention on large machines. A sharded map splits the key space over
+ * SCX_SHARDED_MAP_NR_SHARDS independent hash maps held in an array of maps.
+ * Keys are spread over the shards by a multiplicative hash, so any CPU can
+ * still look up any key with a single extra array lookup, while concurrent
+ * updates of different keys mostly land on different maps.
+ *
+ * Usage:
+ *
+ *	SCX_SHARDED_MAP_DEFINE(tasks, u32, struct task_info, 65536);
+ *
+ *	info = scx_sharded_map_lookup(&tasks, &pid);
+ *	scx_sharded_map_update(&tasks, &pid, &info, BPF_ANY);
+ *	scx_sharded_map_delete(&tasks, &pid);
+ *
+ * Each shard gets max_entries / SCX_SHARDED_MAP_NR_SHARDS entries plus 25%
+ * headroom, as the hash won't spread the keys perfectly evenly.
+ *
+ * scx_sharded_map_scan() evicts stale entries with a bounded time budget. It
+ * walks the shards round-robin and keeps a resumable cursor per shard, so
+ * consecutive calls cover the whole map and no single call pays for more
+ * than its budget. lib/map_cleanup.h drives it from its timer when
+ * SCX_MAP_CLEANUP_SHARDED is defined.
+ */
+#pragma once
+
+#include <scx/common.bpf.h>
+
+#ifndef SCX_SHARDED_MAP_SHIFT
+#define SCX_SHARDED_MAP_SHIFT	4
+#endif
+
+#define SCX_SHARDED_MAP_NR_SHARDS	(1U << SCX_SHARDED_MAP_SHIFT)
+
+/*
+ * Expand @m once per shard. Shard indices are spelled in binary so that they
+ * can be pasted both into the shard map names and into the 0b literals of
+ * the array-of-maps initializer.
+ */
+#define __SCX_SHARDS_1(m, name, p)	m(name, p##0) m(name, p##1)
+#define __SCX_SHARDS_2(m, name, p)	__SCX_SHARDS_1(m, name, p##0) __SCX_SHARDS_1(m, name, p##1)
+#define __SCX_SHARDS_3(m, name, p)	__SCX_SHARDS_2(m, name, p##0) __SCX_SHARDS_2(m, name, p##1)
+#define __SCX_SHARDS_4(m, name, p)	__SCX_SHARDS_3(m, name, p##0) __SCX_SHARDS_3(m, name, p##1)
+#define __SCX_SHARDS_5(m, name, p)	__SCX_SHARDS_4(m, name, p##0) __SCX_SHARDS_4(m, name, p##1)
+#define __SCX_SHARDS_6(m, name, p)	__SCX_SHARDS_5(m, name, p##0) __SCX_SHARDS_5(m, name, p##1)
+
+#if SCX_SHARDED_MAP_SHIFT == 1
+#define __SCX_SHARDS(m, name)	__SCX_SHARDS_1(m, name, )
+#elif SCX_SHARDED_MAP_SHIFT == 2
+#define __SCX_SHARDS(m, name)	__SCX_SHARDS_2(m, name, )
+#elif SCX_SHARDED_MAP_SHIFT == 3
+#define __SCX_SHARDS(m, name)	__SCX_SHARDS_3(m, name, )
+#elif SCX_SHARDED_MAP_SHIFT == 4
+#define __SCX_SHARDS(m, name)	__SCX_SHARDS_4(m, name, )
+#elif SCX_SHARDED_MAP_SHIFT == 5
+#define __SCX_SHARDS(m, name)	__SCX_SHARDS_5(m, name, )
+#elif SCX_SHARDED_MAP_SHIFT == 6
+#define __SCX_SHARDS(m, name)	__SCX_SHARDS_6(m, name, )
+#else
+#error "SCX_SHARDED_MAP_SHIFT must be between 1 and 6"
+#endif
+
+#define __SCX_SHARD_DECL(name, bits)						\
+	struct name##_shard_def name##_shard_##bits SEC(".maps");
+
+#define __SCX_SHARD_INIT(name, bits)						\
+	[0b##bits] = &name##_shard_##bits,
+
+#define SCX_SHARDED_MAP_DEFINE(name, key_type, value_type, max_ents)		\
+	struct name##_shard_def {						\
+		__uint(type, BPF_MAP_TYPE_HASH);				\
+		__uint(max_entries, (max_ents) / SCX_SHARDED_MAP_NR_SHARDS +	\
+				    (max_ents) / SCX_SHARDED_MAP_NR_SHARDS / 4);\
+		__type(key, key_type);						\
+		__type(value, value_type);					\
+	};									\
+										\
+	__SCX_SHARDS(__SCX_SHARD_DECL, name)					\
+										\
+	struct {								\
+		__uint(type, BPF_MAP_TYPE_ARRAY_OF_MAPS);			\
+		__uint(max_entries, SCX_SHARDED_MAP_NR_SHARDS);			\
+		__type(key, u32);						\
+		__array(values, struct name##_shard_def);			\
+	} name SEC(".maps") = {							\
+		.values = { __SCX_SHARDS(__SCX_SHARD_INIT, name) },		\
+	};									\
+										\
+	static u64 name##_scan_cursor[SCX_SHARDED_MAP_NR_SHARDS];		\
+	static u32 name##_scan_shard
+
+static __always_inline u32 scx_sharded_map_shard(u32 key)
+{
+	return (key * 2654435761U) >> (32 - SCX_SHARDED_MAP_SHIFT);
+}
+
+static __always_inline void *scx_sharded_map_lookup(void *map, u32 *key)
+{
+	u32 shard = scx_sharded_map_shard(*key);
+	void *inner;
+
+	inner = bpf_map_lookup_elem(map, &shard);
+	if (!inner)
+		return NULL;
+
+	return bpf_map_lookup_elem(inner, key);
+}
+
+static __always_inline int scx_sharded_map_update(void *map, u32 *key,
+						  void *val, u64 flags)
+{
+	u32 shard = scx_sharded_map_shard(*key);
+	void *inner;
+
+	inner = bpf_map_lookup_elem(map, &shard);
+	if (!inner)
+		return -ENOENT;
+
+	return bpf_map_update_elem(inner, key, val, flags);
+}
+
+static __always_inline int scx_sharded_map_delete(void *map, u32 *key)
+{
+	u32 shard = scx_sharded_map_shard(*key);
+	void *inner;
+
+	inner = bpf_map_lookup_elem(map, &shard);
+	if (!inner)
+		return -ENOENT;
+
+	return bpf_map_delete_elem(inner, key);
+}
+
+static __always_inline int __scx_sharded_map_scan(void *map, u64 *cursors,
+						  u32 *next_shard,
+						  u64 budget_ns,
+						  u64 max_age_ns,
+						  u32 *evicted)
+{
+	u64 now, deadline = bpf_ktime_get_ns() + budget_ns;
+	int i, ret;
+
+	bpf_for(i, 0, SCX_SHARDED_MAP_NR_SHARDS) {
+		u32 shard = *next_shard & (SCX_SHARDED_MAP_NR_SHARDS - 1);
+		u32 swept = 0;
+		void *inner;
+
+		now = bpf_ktime_get_ns();
+		if (now >= deadline)
+			return -ETIMEDOUT;
+
+		inner = bpf_map_lookup_elem(map, &shard);
+		if (!inner)
+			return -ENOENT;
+
+		ret = __COMPAT_scx_bpf_map_scan_timeout_resume(inner,
+							       &cursors[shard],
+							       deadline - now,
+							       max_age_ns,
+							       &swept);
+		*evicted += swept;
+		/* On -ETIMEDOUT, resume from the same shard next time. */
+		if (ret)
+			return ret;
+
+		*next_shard = shard + 1;
+	}
+
+	return 0;
+}
+
+/*
+ * Evict the entries of sharded map @name older than @max_age_ns, spending at
+ * most @budget_ns. Returns 0 once every shard has been swept to the end,
+ * -ETIMEDOUT if the budget ran out first. Must not be called concurrently on
+ * the same map.
+ */
+#define scx_sharded_map_scan(name, budget_ns, max_age_ns, evicted)		\
+	__scx_sharded_map_scan(&name, name##_scan_cursor, &name##_scan_shard,	\
+			       (budget_ns), (max_age_ns), (evicted))
@@ -0,0 +1,186 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+/*
+ * Lock-free slot allocator for flat task arrays.
+ *
+ * scx_rand and scx_dynamic keep queued tasks in a BPF array and used to hand
+ * out slots by bumping a size counter under a global spinlock, compacting
+ * the array by swapping the last element into every dispatched slot. The
+ * slot allocator replaces both with atomics:
+ *
+ * - Slots that have never been used are handed out by fetch-adding the high
+ *   water mark.
+ * - Freed slots are recycled through a bounded MPMC ring of free indices.
+ *   Every ring cell carries a sequence number telling producers and
+ *   consumers whose turn it is, so neither side needs a lock.
+ *
+ * The array itself is not compacted. Users mark a slot as occupied with
+ * their own per-slot sequence number and sample over [0, scx_slot_hwm()).
+ *
+ * Usage:
+ *
+ *	#define SCX_SLOT_ALLOC_NR	MAX_TASKS
+ *	#include <lib/slot_alloc.h>
+ *
+ * and call scx_slot_alloc_init() from ops.init().
+ */
+#pragma once
+
+#include <scx/common.bpf.h>
+#include <scx/bpf_atomic.h>
+
+#ifndef SCX_SLOT_ALLOC_NR
+#error "define SCX_SLOT_ALLOC_NR to the number of slots before including lib/slot_alloc.h"
+#endif
+
+_Static_assert(!(SCX_SLOT_ALLOC_NR & (SCX_SLOT_ALLOC_NR - 1)),
+	       "SCX_SLOT_ALLOC_NR must be a power of two");
+
+/* Give up on a contended ring operation after this many attempts. */
+#define SCX_SLOT_ALLOC_RETRIES	8
+
+struct scx_slot_cell {
+	u64 seq;
+	u32 slot;
+};
+
+struct {
+	__uint(type, BPF_MAP_TYPE_ARRAY);
+	__uint(max_entries, SCX_SLOT_ALLOC_NR);
+	__type(key, u32);
+	__type(value, struct scx_slot_cell);
+} slot_free_ring SEC(".maps");
+
+struct scx_slot_alloc_stats {
+	u64 nr_fresh;		/* slots handed out from the high water mark */
+	u64 nr_reused;		/* slots handed out from the free ring */
+	u64 nr_full;		/* allocations that failed, all slots in use */
+	u64 nr_free_retries;	/* free pushes that lost a race and went again */
+};
+
+struct scx_slot_alloc_stats slot_alloc_stats;
+
+static u64 slot_free_head;	/* next cell to pop */
+static u64 slot_free_tail;	/* next cell to push */
+static u32 slot_hwm;		/* slots below this have been handed out */
+
+static s32 scx_slot_alloc_init(void)
+{
+	struct scx_slot_cell *cell;
+	u32 i;
+
+	/* Cell i is free for the push at position i. */
+	bpf_for(i, 0, SCX_SLOT_ALLOC_NR) {
+		cell = bpf_map_lookup_elem(&slot_free_ring, &i);
+		if (!cell)
+			return -ENOENT;
+		cell->seq = i;
+	}
+
+	return 0;
+}
+
+/* Upper bound of the slots that may be in use. */
+static __always_inline u32 scx_slot_hwm(void)
+{
+	u32 hwm = READ_ONCE(slot_hwm);
+
+	return hwm < SCX_SLOT_ALLOC_NR ? hwm : SCX_SLOT_ALLOC_NR;
+}
+
+static __always_inline int scx_slot_free_pop(u32 *slot)
+{
+	struct scx_slot_cell *cell;
+	u64 pos, seq;
+	u32 idx;
+	int i;
+
+	bpf_for(i, 0, SCX_SLOT_ALLOC_RETRIES) {
+		pos = READ_ONCE(slot_free_head);
+		idx = pos & (SCX_SLOT_ALLOC_NR - 1);
+		cell = bpf_map_lookup_elem(&slot_free_ring, &idx);
+		if (!cell)
+			return -ENOENT;
+
+		seq = smp_load_acquire(&cell->seq);
+		if ((s64)(seq - (pos + 1)) < 0)
+			return -ENOENT;		/* empty */
+		if (seq != pos + 1)
+			continue;		/* another consumer got it */
+
+		if (cmpxchg(&slot_free_head, pos, pos + 1) != pos)
+			continue;
+
+		*slot = cell->slot;
+		/* Hand the cell to the push one lap ahead. */
+		smp_store_release(&cell->seq, pos + SCX_SLOT_ALLOC_NR);
+		return 0;
+	}
+
+	return -EBUSY;
+}
+
+static __always_inline int scx_slot_free_push(u32 slot)
+{
+	struct scx_slot_cell *cell;
+	u64 pos, seq;
+	u32 idx;
+	int i;
+
+	bpf_for(i, 0, SCX_SLOT_ALLOC_RETRIES) {
+		pos = READ_ONCE(slot_free_tail);
+		idx = pos & (SCX_SLOT_ALLOC_NR - 1);
+		cell = bpf_map_lookup_elem(&slot_free_ring, &idx);
+		if (!cell)
+			return -ENOENT;
+
+		seq = smp_load_acquire(&cell->seq);
+		if ((s64)(seq - pos) < 0)
+			return -ENOSPC;		/* full */
+		if (seq != pos)
+			continue;
+
+		if (cmpxchg(&slot_free_tail, pos, pos + 1) != pos)
+			continue;
+
+		cell->slot = slot;
+		smp_store_release(&cell->seq, pos + 1);
+		return 0;
+	}
+
+	return -EBUSY;
+}
+
+/* Allocate a slot. Returns the slot index or -ENOSPC if all are in use. */
+static __always_inline s32 scx_slot_alloc(void)
+{
+	u32 slot;
+
+	if (!scx_slot_free_pop(&slot)) {
+		__sync_fetch_and_add(&slot_alloc_stats.nr_reused, 1);
+		return slot;
+	}
+
+	slot = __sync_fetch_and_add(&slot_hwm, 1);
+	if (slot >= SCX_SLOT_ALLOC_NR) {
+		__sync_fetch_and_sub(&slot_hwm, 1);
+		__sync_fetch_and_add(&slot_alloc_stats.nr_full, 1);
+		return -ENOSPC;
+	}
+
+	__sync_fetch_and_add(&slot_alloc_stats.nr_fresh, 1);
+	return slot;
+}
+
+static __always_inline void scx_slot_free(u32 slot)
+{
+	/*
+	 * The ring holds every slot, so it can't be full and a push only
+	 * fails when it keeps losing races. Giving up would lose the slot
+	 * until the scheduler is reloaded, so keep going until it lands.
+	 */
+	bpf_repeat(BPF_MAX_LOOPS) {
+		if (scx_slot_free_push(slot) != -EBUSY)
+			break;
+		__sync_fetch_and_add(&slot_alloc_stats.nr_free_retries, 1);
+	}
+}
@@ -30,6 +30,65 @@ struct topology {
 
 extern volatile topo_ptr topo_all;
 
+/*
+ * Flat per-CPU view of the topology, filled in by topo_init() as the CPU
+ * leaves are added. Hot paths get a CPU's core, LLC and node with a single
+ * indexed load instead of chasing the parent pointers of its leaf.
+ */
+struct topo_cpu_info {
+	u16 core_id;
+	u16 llc_id;
+	u16 node_id;
+	u16 valid;
+	scx_bitmap_t llc_mask;
+};
+
+extern struct topo_cpu_info topo_cpus[NR_CPUS];
+
+/* How far apart two CPUs are, lower is closer. */
+enum topo_distance {
+	TOPO_DIST_SELF		= 0,
+	TOPO_DIST_CORE		= 1,	/* SMT siblings */
+	TOPO_DIST_LLC		= 2,
+	TOPO_DIST_NODE		= 3,
+	TOPO_DIST_REMOTE	= 4,
+};
+
+static __always_inline struct topo_cpu_info *topo_cpu_lookup(u32 cpu)
+{
+	if (unlikely(cpu >= NR_CPUS || !topo_cpus[cpu].valid))
+		return NULL;
+
+	return &topo_cpus[cpu];
+}
+
+static __always_inline int topo_cpu_llc_id(u32 cpu)
+{
+	struct topo_cpu_info *info = topo_cpu_lookup(cpu);
+
+	return info ? info->llc_id : -EINVAL;
+}
+
+static __always_inline int topo_cpu_distance(u32 a, u32 b)
+{
+	struct topo_cpu_info *ia = topo_cpu_lookup(a);
+	struct topo_cpu_info *ib = topo_cpu_lookup(b);
+
+	if (!ia || !ib)
+		return -EINVAL;
+
+	if (a == b)
+		return TOPO_DIST_SELF;
+	if (ia->core_id == ib->core_id)
+		return TOPO_DIST_CORE;
+	if (ia->llc_id == ib->llc_id)
+		return TOPO_DIST_LLC;
+	if (ia->node_id == ib->node_id)
+		return TOPO_DIST_NODE;
+
+	return TOPO_DIST_REMOTE;
+}
+
 int topo_init(scx_bitmap_t __arg_arena mask, u64 data_size, u64 id);
 int topo_contains(topo_ptr topo, u32 cpu);
 int topo_cpu_to_llc_id(u32 cpu);
@@ -109,6 +109,8 @@ u64 scx_bpf_now(void) __ksym __weak;
 void scx_bpf_events(struct scx_event_stats *events, size_t events__sz) __ksym __weak;
 u64 scx_bpf_hello_world(void) __ksym;
 int scx_bpf_map_scan_timeout(struct bpf_map *map, u64 timeout_ns, u64 max_age_ns, u32 *evicted) __ksym;
+int scx_bpf_map_scan_timeout_resume(struct bpf_map *map, u64 *cursor, u64 timeout_ns, u64 max_age_ns, u32 *evicted) __ksym __weak;
+s64 bpf_map_sum_elem_count(const struct bpf_map *map) __ksym __weak;
 
 /*
  * Use the following as @it__iter when calling scx_bpf_dsq_move[_vtime]() from
@@ -86,6 +86,22 @@ int bpf_cpumask_populate(struct cpumask *dst, void *src, size_t src__sz) __ksym
 	(bpf_ksym_exists(bpf_cpumask_populate) ?			\
 	 (bpf_cpumask_populate(cpumask, src, size__sz)) : -EOPNOTSUPP)
 
+/*
+ * scx_bpf_map_scan_timeout_resume() takes an opaque @cursor that the kernel
+ * advances as it walks @map. A bounded-time scan that runs out of budget
+ * returns -ETIMEDOUT and leaves @cursor at the next unvisited bucket so the
+ * following call picks up from there instead of rescanning the head of the
+ * table. @cursor wraps back to zero once a sweep completes. Zero-initialize
+ * @cursor before the first call and keep it across calls.
+ *
+ * Kernels without the resumable variant fall back to a scan from the start
+ * of the map on each call and @cursor is left untouched.
+ */
+#define __COMPAT_scx_bpf_map_scan_timeout_resume(map, cursor, timeout_ns, max_age_ns, evicted) \
+	(bpf_ksym_exists(scx_bpf_map_scan_timeout_resume) ?			\
+	 scx_bpf_map_scan_timeout_resume((map), (cursor), (timeout_ns), (max_age_ns), (evicted)) : \
+	 scx_bpf_map_scan_timeout((map), (timeout_ns), (max_age_ns), (evicted)))
+
 #define scx_bpf_dispatch(p, dsq_id, slice, enq_flags)				\
 	_Static_assert(false, "scx_bpf_dispatch() renamed to scx_bpf_dsq_insert()")
 
@@ -0,0 +1,185 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+/*
+ * Userspace collector for the map cleanup event stream.
+ *
+ * Schedulers built with lib/map_cleanup.h report every cleanup sweep on the
+ * map_cleanup_events ring buffer. The collector drains it and writes one CSV
+ * row per sweep. For schedulers without the ring buffer, e.g. the control
+ * builds of the test schedulers, it writes one row per sample with just the
+ * occupancy of the tracked map, so both builds produce comparable files.
+ *
+ * Columns:
+ *
+ *	timestamp_ms,map_entries,scan_ns,visited,evicted_total,evicted,
+ *	timed_out,interval_ns,budget_ns,max_age_ns
+ */
+#ifndef __SCX_MAP_CLEANUP_H
+#define __SCX_MAP_CLEANUP_H
+
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <inttypes.h>
+#include <bpf/bpf.h>
+#include <bpf/libbpf.h>
+#include <lib/map_cleanup_defs.h>
+
+#define MAP_CLEANUP_CSV_HEADER							\
+	"timestamp_ms,map_entries,scan_ns,visited,evicted_total,evicted,"	\
+	"timed_out,interval_ns,budget_ns,max_age_ns\n"
+
+#define MAP_CLEANUP_MAX_KEY_SIZE	64
+
+struct scx_map_cleanup_collector {
+	struct ring_buffer *rb;
+	int map_fd;		/* tracked map, -1 if the scheduler has none */
+	bool sharded;		/* map_fd is an array of maps, see lib/sharded_map.h */
+	FILE *csv;
+	u64 nr_evicted_total;
+};
+
+static inline u64 scx_map_cleanup_now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (u64)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static inline s64 scx_map_cleanup_count_keys(int fd)
+{
+	char key[MAP_CLEANUP_MAX_KEY_SIZE], next[MAP_CLEANUP_MAX_KEY_SIZE];
+	void *prev = NULL;
+	s64 nr = 0;
+
+	while (!bpf_map_get_next_key(fd, prev, next)) {
+		memcpy(key, next, sizeof(key));
+		prev = key;
+		nr++;
+	}
+
+	return nr;
+}
+
+static inline s64 scx_map_cleanup_count_entries(struct scx_map_cleanup_collector *col)
+{
+	__u32 shard, id;
+	s64 nr = 0;
+
+	if (col->map_fd < 0)
+		return 0;
+
+	if (!col->sharded)
+		return scx_map_cleanup_count_keys(col->map_fd);
+
+	for (shard = 0; !bpf_map_lookup_elem(col->map_fd, &shard, &id); shard++) {
+		int fd = bpf_map_get_fd_by_id(id);
+
+		if (fd < 0)
+			continue;
+		nr += scx_map_cleanup_count_keys(fd);
+		close(fd);
+	}
+
+	return nr;
+}
+
+static inline int scx_map_cleanup_handle_event(void *ctx, void *data, size_t size)
+{
+	struct scx_map_cleanup_collector *col = ctx;
+	const struct scx_map_cleanup_event *ev = data;
+	s64 nr_entries;
+
+	if (size < sizeof(*ev))
+		return 0;
+
+	nr_entries = ev->nr_entries;
+	if (nr_entries < 0)
+		nr_entries = scx_map_cleanup_count_entries(col);
+
+	col->nr_evicted_total += ev->nr_evicted;
+
+	fprintf(col->csv, "%" PRIu64 ",%" PRId64 ",%" PRIu64 ",%" PRIu64 ",%" PRIu64
+		",%u,%d,%" PRIu64 ",%" PRIu64 ",%" PRIu64 "\n",
+		ev->ts_ns / 1000000, nr_entries, ev->scan_ns, ev->nr_visited,
+		col->nr_evicted_total, ev->nr_evicted, ev->ret == -ETIMEDOUT,
+		ev->interval_ns, ev->budget_ns, ev->max_age_ns);
+	return 0;
+}
+
+/*
+ * Set up @col for the loaded BPF object @obj, tracking the map named
+ * @map_name, and start writing rows to @csv_path.
+ */
+static inline int scx_map_cleanup_collector_init(struct scx_map_cleanup_collector *col,
+						 struct bpf_object *obj,
+						 const char *map_name,
+						 const char *csv_path)
+{
+	struct bpf_map *map;
+
+	memset(col, 0, sizeof(*col));
+	col->map_fd = -1;
+
+	map = bpf_object__find_map_by_name(obj, map_name);
+	if (map) {
+		if (bpf_map__key_size(map) > MAP_CLEANUP_MAX_KEY_SIZE)
+			return -E2BIG;
+		col->map_fd = bpf_map__fd(map);
+		col->sharded = bpf_map__type(map) == BPF_MAP_TYPE_ARRAY_OF_MAPS;
+	}
+
+	map = bpf_object__find_map_by_name(obj, MAP_CLEANUP_EVENTS_MAP);
+	if (map) {
+		col->rb = ring_buffer__new(bpf_map__fd(map),
+					   scx_map_cleanup_handle_event, col, NULL);
+		if (!col->rb)
+			return -errno;
+	}
+
+	col->csv = fopen(csv_path, "w");
+	if (!col->csv) {
+		ring_buffer__free(col->rb);
+		col->rb = NULL;
+		return -errno;
+	}
+
+	fputs(MAP_CLEANUP_CSV_HEADER, col->csv);
+	return 0;
+}
+
+/*
+ * Write the rows accumulated since the last call. Meant to be called from the
+ * loader's stats loop.
+ */
+static inline void scx_map_cleanup_collector_sample(struct scx_map_cleanup_collector *col)
+{
+	if (!col->csv)
+		return;
+
+	if (col->rb) {
+		ring_buffer__consume(col->rb);
+	} else {
+		fprintf(col->csv, "%" PRIu64 ",%" PRId64 ",0,0,0,0,0,0,0,0\n",
+			scx_map_cleanup_now_ns() / 1000000,
+			scx_map_cleanup_count_entries(col));
+	}
+
+	fflush(col->csv);
+}
+
+static inline void scx_map_cleanup_collector_destroy(struct scx_map_cleanup_collector *col)
+{
+	if (col->rb) {
+		ring_buffer__consume(col->rb);
+		ring_buffer__free(col->rb);
+	}
+	if (col->csv)
+		fclose(col->csv);
+	memset(col, 0, sizeof(*col));
+	col->map_fd = -1;
+}
+
+#endif	/* __SCX_MAP_CLEANUP_H */
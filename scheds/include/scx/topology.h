@@ -0,0 +1,90 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+/*
+ * Userspace helpers for schedulers that shard their queues by topology.
+ *
+ * The loader picks a shard mode with -S llc|node and maps each CPU to the id
+ * of its LLC or NUMA node, as read from sysfs. CPUs with the same id share a
+ * shard. An id that can't be read, e.g. for an offline CPU, is returned as
+ * -1 and left for the caller to place.
+ */
+#ifndef __SCX_TOPOLOGY_H
+#define __SCX_TOPOLOGY_H
+
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <dirent.h>
+#include <linux/types.h>
+
+enum scx_shard_mode {
+	SCX_SHARD_NONE,
+	SCX_SHARD_LLC,
+	SCX_SHARD_NODE,
+};
+
+/* Parse the argument of -S. Returns -EINVAL for anything but llc or node. */
+static inline int scx_shard_mode_parse(const char *str, enum scx_shard_mode *mode)
+{
+	if (!strcmp(str, "llc"))
+		*mode = SCX_SHARD_LLC;
+	else if (!strcmp(str, "node"))
+		*mode = SCX_SHARD_NODE;
+	else
+		return -EINVAL;
+
+	return 0;
+}
+
+static inline int scx_cpu_llc_id(__u32 cpu)
+{
+	char path[128];
+	FILE *fp;
+	int id;
+
+	snprintf(path, sizeof(path),
+		 "/sys/devices/system/cpu/cpu%u/cache/index3/id", cpu);
+	fp = fopen(path, "r");
+	if (!fp)
+		return -1;
+	if (fscanf(fp, "%d", &id) != 1)
+		id = -1;
+	fclose(fp);
+
+	return id;
+}
+
+static inline int scx_cpu_node_id(__u32 cpu)
+{
+	char path[128];
+	struct dirent *ent;
+	DIR *dir;
+	int id = -1;
+
+	snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%u", cpu);
+	dir = opendir(path);
+	if (!dir)
+		return -1;
+	while ((ent = readdir(dir))) {
+		if (sscanf(ent->d_name, "node%d", &id) == 1)
+			break;
+		id = -1;
+	}
+	closedir(dir);
+
+	return id;
+}
+
+/* Domain id of @cpu under @mode. Every CPU is in domain 0 without sharding. */
+static inline int scx_cpu_shard_id(__u32 cpu, enum scx_shard_mode mode)
+{
+	switch (mode) {
+	case SCX_SHARD_LLC:
+		return scx_cpu_llc_id(cpu);
+	case SCX_SHARD_NODE:
+		return scx_cpu_node_id(cpu);
+	default:
+		return 0;
+	}
+}
+
+#endif	/* __SCX_TOPOLOGY_H */
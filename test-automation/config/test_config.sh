@@ -7,17 +7,25 @@ SCHEDULERS="scx_simple scx_cfsish scx_flatcg scx_nest"
 # Workload parameters
 STRESS_NG_PROCESSES=20
 STRESS_NG_DURATION=60
-HACKBENCH_PROCESSES=10
 HACKBENCH_LOOPS=100
+HACKBENCH_GROUPS=4          # hackbench-4 profile in Results/
+SCHBENCH_MESSAGE_THREADS=64 # schbench-64 profile in Results/
+SCHBENCH_DURATION=30
 CUSTOM_CHURN_SPAWNS=1000
 CUSTOM_CHURN_DURATION=30
 
 # Test parameters
 ITERATIONS=3
 METRICS_INTERVAL=2  # seconds between metric samples
-CLEANUP_INTERVAL=1  # seconds (in BPF code)
-MAX_AGE=5           # seconds (stale threshold)
-TIMEOUT_US=100      # microseconds (cleanup budget)
+# The values below mirror the defaults of the map_cleanup_* knobs in
+# scheds/include/lib/map_cleanup.h, which drive the cleanup timer. With
+# map_cleanup_adaptive (on by default) they are only starting points; the
+# timer retunes them from the map fill ratio and eviction yield, see
+# map_cleanup_ctl for the values in effect.
+CLEANUP_INTERVAL=1  # seconds (map_cleanup_interval_ns)
+MAX_AGE=5           # seconds (map_cleanup_max_age_ns, stale threshold)
+TIMEOUT_US=100      # microseconds (map_cleanup_budget_ns, cleanup budget)
+CLEANUP_CPU=0       # CPU the cleanup timer is pinned to (map_cleanup_cpu)
 
 # Map names for each scheduler (for metrics collection)
 declare -A MAP_NAMES
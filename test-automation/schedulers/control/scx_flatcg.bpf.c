@@ -42,6 +42,14 @@
  * The scheduler first picks the cgroup to run and then schedule the tasks
  * within by using nested weighted vtime scheduling by default. The
  * cgroup-internal scheduling can be switched to FIFO with the -f option.
+ *
+ * Cgroups with queued tasks wait on a cgroup vtime ordered rbtree. By default
+ * there's a single one, which makes its lock a point of contention on large
+ * machines as every cgroup enqueue and pick takes it. With the -S option, the
+ * rbtree is sharded per LLC or NUMA node instead. A cgroup is queued on the
+ * shard of the CPU its task is enqueued on and CPUs pick from their own shard
+ * first. As each shard winds its own cgroup vtime, the shards are reconciled
+ * at pick time so that they don't drift apart by more than a few slices.
  */
 #include <scx/common.bpf.h>
 #include "scx_flatcg.h"
@@ -52,6 +60,8 @@
 enum {
 	FALLBACK_DSQ		= 0,
 	CGROUP_MAX_RETRIES	= 1024,
+	/* how many slices a shard's cvtime_now may lag behind before it's served */
+	FCG_SHARD_SLACK_SLICES	= 4,
 };
 
 char _license[] SEC("license") = "GPL";
@@ -59,7 +69,11 @@ char _license[] SEC("license") = "GPL";
 const volatile u32 nr_cpus = 32;	/* !0 for veristat, set during init */
 const volatile u64 cgrp_slice_ns;
 const volatile bool fifo_sched;
+const volatile u32 nr_shards = 1;
+
+u32 RESIZABLE_ARRAY(data, cpu_shard);
 
+/* the furthest cvtime_now across the shards, new cgroups start from here */
 u64 cvtime_now;
 UEI_DEFINE(uei);
 
@@ -82,6 +96,7 @@ static void stat_inc(enum fcg_stat_idx idx)
 struct fcg_cpu_ctx {
 	u64			cur_cgid;
 	u64			cur_at;
+	u32			probe_shard;
 };
 
 struct {
@@ -104,8 +119,22 @@ struct cgv_node {
 	__u64			cgid;
 };
 
-private(CGV_TREE) struct bpf_spin_lock cgv_tree_lock;
-private(CGV_TREE) struct bpf_rb_root cgv_tree __contains(cgv_node, rb_node);
+struct fcg_shard {
+	struct bpf_spin_lock	lock;
+	struct bpf_rb_root	root __contains(cgv_node, rb_node);
+	u64			cvtime_now;
+	u32			nr_queued;
+};
+
+struct {
+	__uint(type, BPF_MAP_TYPE_ARRAY);
+	__type(key, u32);
+	__type(value, struct fcg_shard);
+	__uint(max_entries, FCG_MAX_SHARDS);
+} cgv_shards SEC(".maps");
+
+/* protects ->nr_active, ->weight and ->child_weight_sum of all cgroups */
+private(FCG_WEIGHT) struct bpf_spin_lock weight_lock;
 
 struct cgv_node_stash {
 	struct cgv_node __kptr *node;
@@ -162,6 +191,29 @@ static struct fcg_cpu_ctx *find_cpu_ctx(void)
 	return cpuc;
 }
 
+static u32 cpu_to_shard(s32 cpu)
+{
+	u32 *shard;
+
+	if (nr_shards <= 1)
+		return 0;
+
+	shard = ARRAY_ELEM_PTR(cpu_shard, cpu, nr_cpus);
+	return shard && *shard < nr_shards ? *shard : 0;
+}
+
+static struct fcg_shard *find_shard(u32 shard)
+{
+	struct fcg_shard *sh;
+
+	sh = bpf_map_lookup_elem(&cgv_shards, &shard);
+	if (!sh) {
+		scx_bpf_error("cgv_shards lookup failed for shard %u", shard);
+		return NULL;
+	}
+	return sh;
+}
+
 static struct fcg_cgrp_ctx *find_cgrp_ctx(struct cgroup *cgrp)
 {
 	struct fcg_cgrp_ctx *cgc;
@@ -226,12 +278,12 @@ static void cgrp_refresh_hweight(struct cgroup *cgrp, struct fcg_cgrp_ctx *cgc)
 
 			/*
 			 * We can be opportunistic here and not grab the
-			 * cgv_tree_lock and deal with the occasional races.
+			 * weight_lock and deal with the occasional races.
 			 * However, hweight updates are already cached and
 			 * relatively low-frequency. Let's just do the
 			 * straightforward thing.
 			 */
-			bpf_spin_lock(&cgv_tree_lock);
+			bpf_spin_lock(&weight_lock);
 			is_active = cgc->nr_active;
 			if (is_active) {
 				cgc->hweight_gen = pcgc->hweight_gen;
@@ -239,7 +291,7 @@ static void cgrp_refresh_hweight(struct cgroup *cgrp, struct fcg_cgrp_ctx *cgc)
 					div_round_up(pcgc->hweight * cgc->weight,
 						     pcgc->child_weight_sum);
 			}
-			bpf_spin_unlock(&cgv_tree_lock);
+			bpf_spin_unlock(&weight_lock);
 
 			if (!is_active) {
 				stat_inc(FCG_STAT_HWT_RACE);
@@ -249,7 +301,8 @@ static void cgrp_refresh_hweight(struct cgroup *cgrp, struct fcg_cgrp_ctx *cgc)
 	}
 }
 
-static void cgrp_cap_budget(struct cgv_node *cgv_node, struct fcg_cgrp_ctx *cgc)
+static void cgrp_cap_budget(struct cgv_node *cgv_node, struct fcg_cgrp_ctx *cgc,
+			    u64 now)
 {
 	u64 delta, cvtime, max_budget;
 
@@ -258,7 +311,7 @@ static void cgrp_cap_budget(struct cgv_node *cgv_node, struct fcg_cgrp_ctx *cgc)
 	 * and thus can't be updated and repositioned. Instead, we collect the
 	 * vtime deltas separately and apply it asynchronously here.
 	 */
-	delta = __sync_fetch_and_sub(&cgc->cvtime_delta, cgc->cvtime_delta);
+	delta = __sync_lock_test_and_set(&cgc->cvtime_delta, 0);
 	cvtime = cgv_node->cvtime + delta;
 
 	/*
@@ -268,18 +321,24 @@ static void cgrp_cap_budget(struct cgv_node *cgv_node, struct fcg_cgrp_ctx *cgc)
 	 */
 	max_budget = (cgrp_slice_ns * nr_cpus * cgc->hweight) /
 		(2 * FCG_HWEIGHT_ONE);
-	if (time_before(cvtime, cvtime_now - max_budget))
-		cvtime = cvtime_now - max_budget;
+	if (time_before(cvtime, now - max_budget))
+		cvtime = now - max_budget;
 
 	cgv_node->cvtime = cvtime;
 }
 
-static void cgrp_enqueued(struct cgroup *cgrp, struct fcg_cgrp_ctx *cgc)
+static void cgrp_enqueued(struct cgroup *cgrp, struct fcg_cgrp_ctx *cgc,
+			  u32 shard)
 {
 	struct cgv_node_stash *stash;
 	struct cgv_node *cgv_node;
+	struct fcg_shard *sh;
 	u64 cgid = cgrp->kn->id;
 
+	sh = find_shard(shard);
+	if (!sh)
+		return;
+
 	/* paired with cmpxchg in try_pick_next_cgroup() */
 	if (__sync_val_compare_and_swap(&cgc->queued, 0, 1)) {
 		stat_inc(FCG_STAT_ENQ_SKIP);
@@ -299,10 +358,17 @@ static void cgrp_enqueued(struct cgroup *cgrp, struct fcg_cgrp_ctx *cgc)
 		return;
 	}
 
-	bpf_spin_lock(&cgv_tree_lock);
-	cgrp_cap_budget(cgv_node, cgc);
-	bpf_rbtree_add(&cgv_tree, &cgv_node->rb_node, cgv_node_less);
-	bpf_spin_unlock(&cgv_tree_lock);
+	bpf_spin_lock(&sh->lock);
+	/*
+	 * An empty shard's cvtime_now stops advancing. Catch it up with the
+	 * other shards so that its cgroups don't come back with a head start.
+	 */
+	if (!sh->nr_queued && time_before(sh->cvtime_now, cvtime_now))
+		sh->cvtime_now = cvtime_now;
+	cgrp_cap_budget(cgv_node, cgc, sh->cvtime_now);
+	bpf_rbtree_add(&sh->root, &cgv_node->rb_node, cgv_node_less);
+	sh->nr_queued++;
+	bpf_spin_unlock(&sh->lock);
 }
 
 static void set_bypassed_at(struct task_struct *p, struct fcg_task_ctx *taskc)
@@ -405,7 +471,7 @@ void BPF_STRUCT_OPS(fcg_enqueue, struct task_struct *p, u64 enq_flags)
 					 tvtime, enq_flags);
 	}
 
-	cgrp_enqueued(cgrp, cgc);
+	cgrp_enqueued(cgrp, cgc, cpu_to_shard(scx_bpf_task_cpu(p)));
 out_release:
 	bpf_cgroup_release(cgrp);
 }
@@ -429,7 +495,7 @@ static void update_active_weight_sums(struct cgroup *cgrp, bool runnable)
 	 * In most cases, a hot cgroup would have multiple threads going to
 	 * sleep and waking up while the whole cgroup stays active. In leaf
 	 * cgroups, ->nr_runnable which is updated with __sync operations gates
-	 * ->nr_active updates, so that we don't have to grab the cgv_tree_lock
+	 * ->nr_active updates, so that we don't have to grab the weight_lock
 	 * repeatedly for a busy cgroup which is staying active.
 	 */
 	if (runnable) {
@@ -473,7 +539,7 @@ static void update_active_weight_sums(struct cgroup *cgrp, bool runnable)
 		 * each level but bpf_spin_lock() doesn't want any function
 		 * calls while locked.
 		 */
-		bpf_spin_lock(&cgv_tree_lock);
+		bpf_spin_lock(&weight_lock);
 
 		if (runnable) {
 			if (!cgc->nr_active++) {
@@ -493,7 +559,7 @@ static void update_active_weight_sums(struct cgroup *cgrp, bool runnable)
 			}
 		}
 
-		bpf_spin_unlock(&cgv_tree_lock);
+		bpf_spin_unlock(&weight_lock);
 
 		if (!propagate)
 			break;
@@ -599,35 +665,41 @@ void BPF_STRUCT_OPS(fcg_cgroup_set_weight, struct cgroup *cgrp, u32 weight)
 			return;
 	}
 
-	bpf_spin_lock(&cgv_tree_lock);
+	bpf_spin_lock(&weight_lock);
 	if (pcgc && cgc->nr_active)
 		pcgc->child_weight_sum += (s64)weight - cgc->weight;
 	cgc->weight = weight;
-	bpf_spin_unlock(&cgv_tree_lock);
+	bpf_spin_unlock(&weight_lock);
 }
 
-static bool try_pick_next_cgroup(u64 *cgidp)
+static bool try_pick_next_cgroup(u64 *cgidp, u32 shard)
 {
 	struct bpf_rb_node *rb_node;
 	struct cgv_node_stash *stash;
 	struct cgv_node *cgv_node;
 	struct fcg_cgrp_ctx *cgc;
+	struct fcg_shard *sh;
 	struct cgroup *cgrp;
 	u64 cgid;
 
+	*cgidp = 0;
+
+	sh = find_shard(shard);
+	if (!sh)
+		return true;
+
 	/* pop the front cgroup and wind cvtime_now accordingly */
-	bpf_spin_lock(&cgv_tree_lock);
+	bpf_spin_lock(&sh->lock);
 
-	rb_node = bpf_rbtree_first(&cgv_tree);
+	rb_node = bpf_rbtree_first(&sh->root);
 	if (!rb_node) {
-		bpf_spin_unlock(&cgv_tree_lock);
-		stat_inc(FCG_STAT_PNC_NO_CGRP);
-		*cgidp = 0;
+		bpf_spin_unlock(&sh->lock);
 		return true;
 	}
 
-	rb_node = bpf_rbtree_remove(&cgv_tree, rb_node);
-	bpf_spin_unlock(&cgv_tree_lock);
+	rb_node = bpf_rbtree_remove(&sh->root, rb_node);
+	sh->nr_queued--;
+	bpf_spin_unlock(&sh->lock);
 
 	if (!rb_node) {
 		/*
@@ -642,6 +714,8 @@ static bool try_pick_next_cgroup(u64 *cgidp)
 	cgv_node = container_of(rb_node, struct cgv_node, rb_node);
 	cgid = cgv_node->cgid;
 
+	if (time_before(sh->cvtime_now, cgv_node->cvtime))
+		sh->cvtime_now = cgv_node->cvtime;
 	if (time_before(cvtime_now, cgv_node->cvtime))
 		cvtime_now = cgv_node->cvtime;
 
@@ -682,11 +756,12 @@ static bool try_pick_next_cgroup(u64 *cgidp)
 	 * according to the actual consumption. This prevents lowpri thundering
 	 * herd from saturating the machine.
 	 */
-	bpf_spin_lock(&cgv_tree_lock);
+	bpf_spin_lock(&sh->lock);
 	cgv_node->cvtime += cgrp_slice_ns * FCG_HWEIGHT_ONE / (cgc->hweight ?: 1);
-	cgrp_cap_budget(cgv_node, cgc);
-	bpf_rbtree_add(&cgv_tree, &cgv_node->rb_node, cgv_node_less);
-	bpf_spin_unlock(&cgv_tree_lock);
+	cgrp_cap_budget(cgv_node, cgc, sh->cvtime_now);
+	bpf_rbtree_add(&sh->root, &cgv_node->rb_node, cgv_node_less);
+	sh->nr_queued++;
+	bpf_spin_unlock(&sh->lock);
 
 	*cgidp = cgid;
 	stat_inc(FCG_STAT_PNC_NEXT);
@@ -707,9 +782,10 @@ out_stash:
 	__sync_val_compare_and_swap(&cgc->queued, 1, 0);
 
 	if (scx_bpf_dsq_nr_queued(cgid)) {
-		bpf_spin_lock(&cgv_tree_lock);
-		bpf_rbtree_add(&cgv_tree, &cgv_node->rb_node, cgv_node_less);
-		bpf_spin_unlock(&cgv_tree_lock);
+		bpf_spin_lock(&sh->lock);
+		bpf_rbtree_add(&sh->root, &cgv_node->rb_node, cgv_node_less);
+		sh->nr_queued++;
+		bpf_spin_unlock(&sh->lock);
 		stat_inc(FCG_STAT_PNC_RACE);
 	} else {
 		cgv_node = bpf_kptr_xchg(&stash->node, cgv_node);
@@ -726,6 +802,74 @@ out_free:
 	return false;
 }
 
+/*
+ * Pick from @shard first and then from the other shards in order, so that a
+ * CPU doesn't go idle while any shard has a cgroup queued. The other shards
+ * are skipped without taking their locks if they look empty.
+ */
+static bool pick_next_cgroup(u64 *cgidp, u32 shard)
+{
+	struct fcg_shard *sh;
+	u32 target;
+	int i;
+
+	bpf_for(i, 0, nr_shards) {
+		target = (shard + i) % nr_shards;
+
+		if (i) {
+			sh = bpf_map_lookup_elem(&cgv_shards, &target);
+			if (!sh || !READ_ONCE(sh->nr_queued))
+				continue;
+		}
+
+		if (!try_pick_next_cgroup(cgidp, target))
+			return false;
+
+		if (*cgidp) {
+			if (i)
+				stat_inc(FCG_STAT_PNC_STEAL);
+			return true;
+		}
+	}
+
+	stat_inc(FCG_STAT_PNC_NO_CGRP);
+	return true;
+}
+
+/*
+ * Each shard winds its own cvtime_now from the cgroups it serves, so a shard
+ * with more contention falls behind the others and its cgroups would get less
+ * than their hweight. To bound the error, every pick probes one other shard
+ * round-robin and serves it instead of @own if its cvtime_now lags by more
+ * than FCG_SHARD_SLACK_SLICES slices.
+ */
+static u32 pick_shard(struct fcg_cpu_ctx *cpuc, u32 own)
+{
+	struct fcg_shard *own_sh, *sh;
+	u32 probe;
+
+	if (nr_shards <= 1)
+		return own;
+
+	probe = cpuc->probe_shard++ % nr_shards;
+	if (probe == own)
+		return own;
+
+	own_sh = bpf_map_lookup_elem(&cgv_shards, &own);
+	sh = bpf_map_lookup_elem(&cgv_shards, &probe);
+	if (!own_sh || !sh || !READ_ONCE(sh->nr_queued))
+		return own;
+
+	if (time_before(READ_ONCE(sh->cvtime_now) +
+			cgrp_slice_ns * FCG_SHARD_SLACK_SLICES,
+			READ_ONCE(own_sh->cvtime_now))) {
+		stat_inc(FCG_STAT_PNC_RECONCILE);
+		return probe;
+	}
+
+	return own;
+}
+
 void BPF_STRUCT_OPS(fcg_dispatch, s32 cpu, struct task_struct *prev)
 {
 	struct fcg_cpu_ctx *cpuc;
@@ -733,6 +877,7 @@ void BPF_STRUCT_OPS(fcg_dispatch, s32 cpu, struct task_struct *prev)
 	struct cgroup *cgrp;
 	u64 now = scx_bpf_now();
 	bool picked_next = false;
+	u32 shard;
 
 	cpuc = find_cpu_ctx();
 	if (!cpuc)
@@ -764,15 +909,13 @@ void BPF_STRUCT_OPS(fcg_dispatch, s32 cpu, struct task_struct *prev)
 	cgc = bpf_cgrp_storage_get(&cgrp_ctx, cgrp, 0, 0);
 	if (cgc) {
 		/*
-		 * We want to update the vtime delta and then look for the next
-		 * cgroup to execute but the latter needs to be done in a loop
-		 * and we can't keep the lock held. Oh well...
+		 * The cgroup may be queued on any shard, so no shard lock
+		 * covers this. cgrp_cap_budget() consumes the delta with an
+		 * atomic exchange, which an atomic add here can't race with.
 		 */
-		bpf_spin_lock(&cgv_tree_lock);
 		__sync_fetch_and_add(&cgc->cvtime_delta,
 				     (cpuc->cur_at + cgrp_slice_ns - now) *
 				     FCG_HWEIGHT_ONE / (cgc->hweight ?: 1));
-		bpf_spin_unlock(&cgv_tree_lock);
 	} else {
 		stat_inc(FCG_STAT_CNS_GONE);
 	}
@@ -787,15 +930,17 @@ pick_next_cgroup:
 		return;
 	}
 
+	shard = pick_shard(cpuc, cpu_to_shard(cpu));
+
 	bpf_repeat(CGROUP_MAX_RETRIES) {
-		if (try_pick_next_cgroup(&cpuc->cur_cgid)) {
+		if (pick_next_cgroup(&cpuc->cur_cgid, shard)) {
 			picked_next = true;
 			break;
 		}
 	}
 
 	/*
-	 * This only happens if try_pick_next_cgroup() races against enqueue
+	 * This only happens if pick_next_cgroup() races against enqueue
 	 * path for more than CGROUP_MAX_RETRIES times, which is extremely
 	 * unlikely and likely indicates an underlying bug. There shouldn't be
 	 * any stall risk as the race is against enqueue.
@@ -905,8 +1050,8 @@ void BPF_STRUCT_OPS(fcg_cgroup_exit, struct cgroup *cgrp)
 	u64 cgid = cgrp->kn->id;
 
 	/*
-	 * For now, there's no way find and remove the cgv_node if it's on the
-	 * cgv_tree. Let's drain them in the dispatch path as they get popped
+	 * For now, there's no way find and remove the cgv_node if it's on a
+	 * shard's rbtree. Let's drain them in the dispatch path as they get popped
 	 * off the front of the tree.
 	 */
 	bpf_map_delete_elem(&cgv_node_stash, &cgid);
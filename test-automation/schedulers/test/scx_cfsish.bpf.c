@@ -73,6 +73,10 @@ struct {
     __uint(max_entries, 65536);
 } task_info_map SEC(".maps");
 
+#define SCX_MAP_CLEANUP_TARGET	task_info_map
+#define SCX_MAP_CLEANUP_AGE_OFFSET	offsetof(struct task_info, last_start)
+#include <lib/map_cleanup.h>
+
 struct {
 	__uint(type, BPF_MAP_TYPE_PERCPU_ARRAY);
 	__uint(key_size, sizeof(u32));
@@ -114,13 +118,26 @@ void BPF_STRUCT_OPS(simple_enqueue, struct task_struct *p, u64 enq_flags)
 
 	/* TEST VERSION: Track tasks in map for cleanup */
 	u32 pid = p->pid;
-	struct task_info info = {};
-	info.vruntime = p->scx.dsq_vtime;
-	info.weight = p->scx.weight;
-	info.start = bpf_ktime_get_ns();
-	info.last_start = bpf_ktime_get_ns();
-	info.pid = pid;
-	bpf_map_update_elem(&task_info_map, &pid, &info, BPF_ANY);
+	u64 now = bpf_ktime_get_ns();
+	struct task_info *tinfo = bpf_map_lookup_elem(&task_info_map, &pid);
+	if (tinfo) {
+		u64 prev = tinfo->last_start;
+
+		tinfo->vruntime = p->scx.dsq_vtime;
+		tinfo->weight = p->scx.weight;
+		tinfo->start = now;
+		tinfo->last_start = now;
+		scx_map_cleanup_touch(pid, prev, now);
+	} else {
+		struct task_info info = {};
+		info.vruntime = p->scx.dsq_vtime;
+		info.weight = p->scx.weight;
+		info.start = now;
+		info.last_start = now;
+		info.pid = pid;
+		if (!bpf_map_update_elem(&task_info_map, &pid, &info, BPF_NOEXIST))
+			scx_map_cleanup_touch(pid, 0, now);
+	}
 
 	if (fifo_sched) {
 		scx_bpf_dsq_insert(p, SHARED_DSQ, SCX_SLICE_DFL, enq_flags);
@@ -141,22 +158,8 @@ void BPF_STRUCT_OPS(simple_enqueue, struct task_struct *p, u64 enq_flags)
 
 void BPF_STRUCT_OPS(simple_dispatch, s32 cpu, struct task_struct *prev)
 {
-	/* TEST VERSION: Periodic cleanup of stale map entries */
-	static u64 last_cleanup = 0;
-	u64 now = bpf_ktime_get_ns();
-	u32 evicted = 0;
-	
-	if (now - last_cleanup > 1000000000ULL) {
-		int ret = scx_bpf_map_scan_timeout(&task_info_map, 
-						100000ULL, 
-						5000000000ULL, &evicted);
-		if (ret == 0 && evicted > 0) {
-			bpf_printk("Map cleanup: evicted %u stale entries", evicted);
-		} else if (ret == -ETIMEDOUT) {
-			bpf_printk("Map cleanup: timeout after evicted %u entries", evicted);
-		}
-		last_cleanup = now;
-	}
+	/* TEST VERSION: Stale entries are swept by the map cleanup timer */
+	scx_map_cleanup_arm();
 
 	scx_bpf_dsq_move_to_local(SHARED_DSQ);
 }
@@ -166,8 +169,13 @@ void BPF_STRUCT_OPS(simple_running, struct task_struct *p)
 	/* TEST VERSION: Update last_start timestamp */
 	u32 pid = p->pid;
 	struct task_info *info = bpf_map_lookup_elem(&task_info_map, &pid);
-	if (info)
-		info->last_start = bpf_ktime_get_ns();
+	if (info) {
+		u64 now = bpf_ktime_get_ns();
+		u64 prev = info->last_start;
+
+		info->last_start = now;
+		scx_map_cleanup_touch(pid, prev, now);
+	}
 
 	if (fifo_sched)
 		return;
@@ -206,6 +214,12 @@ void BPF_STRUCT_OPS(simple_enable, struct task_struct *p)
 
 s32 BPF_STRUCT_OPS_SLEEPABLE(simple_init)
 {
+	s32 ret;
+
+	ret = scx_map_cleanup_init();
+	if (ret)
+		return ret;
+
 	return scx_bpf_create_dsq(SHARED_DSQ, -1);
 }
 
@@ -114,6 +114,10 @@ struct {
 	__type(value, struct task_info);
 } tasks SEC(".maps");
 
+#define SCX_MAP_CLEANUP_TARGET	tasks
+#define SCX_MAP_CLEANUP_AGE_OFFSET	offsetof(struct task_info, last_start)
+#include <lib/map_cleanup.h>
+
 struct pcpu_ctx {
 	/* The timer used to compact the core from the primary nest. */
 	struct bpf_timer timer;
@@ -433,27 +437,8 @@ skip_task_ctx:
 
 void BPF_STRUCT_OPS(nest_dispatch, s32 cpu, struct task_struct *prev)
 {
-	/* TEST VERSION: Periodic cleanup of stale map entries */
-	static u64 last_cleanup = 0;
-	u64 cleanup_now = bpf_ktime_get_ns();
-	u32 evicted = 0;
-	
-	if (cleanup_now - last_cleanup > 1000000000ULL) {
-		bpf_printk("Map cleanup: Starting cleanup scan");
-		int ret = scx_bpf_map_scan_timeout(&tasks, 
-						100000ULL, 
-						5000000000ULL, &evicted);
-		if (ret == 0 && evicted > 0) {
-			bpf_printk("Map cleanup: evicted %u stale entries", evicted);
-		} else if (ret == -ETIMEDOUT) {
-			bpf_printk("Map cleanup: timeout after evicted %u entries", evicted);
-		} else if (ret == 0 && evicted == 0) {
-			bpf_printk("Map cleanup: scan completed, no entries evicted (ret=%d)", ret);
-		} else {
-			bpf_printk("Map cleanup: scan failed with ret=%d, evicted=%u", ret, evicted);
-		}
-		last_cleanup = cleanup_now;
-	}
+	/* TEST VERSION: Stale entries are swept by the map cleanup timer */
+	scx_map_cleanup_arm();
 
 	struct pcpu_ctx *pcpu_ctx;
 	struct bpf_cpumask *primary, *reserve;
@@ -520,32 +505,28 @@ void BPF_STRUCT_OPS(nest_running, struct task_struct *p)
 {
 	/* TEST VERSION: Track tasks in map (called for all running tasks) */
 	u32 pid = p->pid;
+	u64 now = bpf_ktime_get_ns();
 	struct task_info *info = bpf_map_lookup_elem(&tasks, &pid);
 	
 	if (info) {
 		/* Task exists in map, just update timestamp */
-		info->last_start = bpf_ktime_get_ns();
-		/* Debug: log occasionally */
-		if (pid % 200 == 0) {
-			bpf_printk("nest_running: Updated task pid=%u", pid);
-		}
+		u64 prev = info->last_start;
+
+		info->last_start = now;
+		scx_map_cleanup_touch(pid, prev, now);
 	} else {
 		/* Task not in map yet, add it */
 		struct task_info new_info = {};
 		new_info.vruntime = p->scx.dsq_vtime;
 		new_info.weight = p->scx.weight;
-		new_info.last_start = bpf_ktime_get_ns();
+		new_info.last_start = now;
 		
-		int ret = bpf_map_update_elem(&tasks, &pid, &new_info, BPF_ANY);
-		if (ret == 0) {
-			/* Debug: log when adding new task */
-			if (pid % 200 == 0) {
-				bpf_printk("nest_running: Added new task pid=%u to map", pid);
-			}
-		} else {
-			/* Log failures (these should be rare) */
-			bpf_printk("nest_running: Failed to add task pid=%u, ret=%d", pid, ret);
-		}
+		/*
+		 * Failures mean the map is full, which shows up in the map
+		 * cleanup statistics.
+		 */
+		if (!bpf_map_update_elem(&tasks, &pid, &new_info, BPF_ANY))
+			scx_map_cleanup_touch(pid, 0, now);
 	}
 
 	/*
@@ -699,10 +680,12 @@ s32 BPF_STRUCT_OPS_SLEEPABLE(nest_init)
 	bpf_timer_init(timer, &stats_timer, CLOCK_BOOTTIME);
 	bpf_timer_set_callback(timer, stats_timerfn);
 	err = bpf_timer_start(timer, sampling_cadence_ns - 5000, 0);
-	if (err)
+	if (err) {
 		scx_bpf_error("Failed to arm stats timer");
+		return err;
+	}
 
-	return err;
+	return scx_map_cleanup_init();
 }
 
 void BPF_STRUCT_OPS(nest_exit, struct scx_exit_info *ei)
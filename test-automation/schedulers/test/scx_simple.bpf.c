@@ -21,6 +21,7 @@
  * Copyright (c) 2022 David Vernet <dvernet@meta.com>
  */
 #include <scx/common.bpf.h>
+#include <lib/sharded_map.h>
 
 char _license[] SEC("license") = "GPL";
 
@@ -50,12 +51,16 @@ struct {
 	__uint(max_entries, 2);			/* [local, global] */
 } stats SEC(".maps");
 
-struct {
-	__uint(type, BPF_MAP_TYPE_HASH);
-	__uint(max_entries, 16384);
-	__type(key, __u32);
-	__type(value, struct task_info);
-} tasks SEC(".maps");
+/*
+ * TEST VERSION: Every CPU updates the map on each enqueue and running event.
+ * Spread it over pid-hashed shards so that they don't all contend on the
+ * same hash table.
+ */
+SCX_SHARDED_MAP_DEFINE(tasks, __u32, struct task_info, 16384);
+
+#define SCX_MAP_CLEANUP_TARGET	tasks
+#define SCX_MAP_CLEANUP_SHARDED
+#include <lib/map_cleanup.h>
 
 static void stat_inc(u32 idx)
 {
@@ -83,11 +88,23 @@ void BPF_STRUCT_OPS(simple_enqueue, struct task_struct *p, u64 enq_flags)
 	stat_inc(1);	/* count global queueing */
 	
 	u32 pid = p->pid;
-	struct task_info info = {};
-	info.vruntime = p->scx.dsq_vtime;
-	info.weight = p->scx.weight;
-	info.last_start = bpf_ktime_get_ns();
-	bpf_map_update_elem(&tasks, &pid, &info, BPF_ANY);
+	u64 now = bpf_ktime_get_ns();
+	struct task_info *tinfo = scx_sharded_map_lookup(&tasks, &pid);
+	if (tinfo) {
+		u64 prev = tinfo->last_start;
+
+		tinfo->vruntime = p->scx.dsq_vtime;
+		tinfo->weight = p->scx.weight;
+		tinfo->last_start = now;
+		scx_map_cleanup_touch(pid, prev, now);
+	} else {
+		struct task_info info = {};
+		info.vruntime = p->scx.dsq_vtime;
+		info.weight = p->scx.weight;
+		info.last_start = now;
+		if (!scx_sharded_map_update(&tasks, &pid, &info, BPF_NOEXIST))
+			scx_map_cleanup_touch(pid, 0, now);
+	}
 	
 	if (fifo_sched) {
 		scx_bpf_dsq_insert(p, SHARED_DSQ, SCX_SLICE_DFL, enq_flags);
@@ -108,22 +125,8 @@ void BPF_STRUCT_OPS(simple_enqueue, struct task_struct *p, u64 enq_flags)
 
 void BPF_STRUCT_OPS(simple_dispatch, s32 cpu, struct task_struct *prev)
 {
-	/* TEST VERSION: Periodic cleanup of stale map entries */
-	static u64 last_cleanup = 0;
-	u64 now = bpf_ktime_get_ns();
-	u32 evicted = 0;
-	
-	if (now - last_cleanup > 1000000000ULL) {
-		int ret = scx_bpf_map_scan_timeout(&tasks, 
-						100000ULL, 
-						5000000000ULL, &evicted);
-		if (ret == 0 && evicted > 0) {
-			bpf_printk("Map cleanup: evicted %u stale entries", evicted);
-		} else if (ret == -ETIMEDOUT) {
-			bpf_printk("Map cleanup: timeout after evicted %u entries", evicted);
-		}
-		last_cleanup = now;
-	}
+	/* TEST VERSION: Stale entries are swept by the map cleanup timer */
+	scx_map_cleanup_arm();
 
 	scx_bpf_dsq_move_to_local(SHARED_DSQ);
 }
@@ -131,9 +134,14 @@ void BPF_STRUCT_OPS(simple_dispatch, s32 cpu, struct task_struct *prev)
 void BPF_STRUCT_OPS(simple_running, struct task_struct *p)
 {
 	u32 pid = p->pid;
-	struct task_info *info = bpf_map_lookup_elem(&tasks, &pid);
-	if (info)
-		info->last_start = bpf_ktime_get_ns();
+	struct task_info *info = scx_sharded_map_lookup(&tasks, &pid);
+	if (info) {
+		u64 now = bpf_ktime_get_ns();
+		u64 prev = info->last_start;
+
+		info->last_start = now;
+		scx_map_cleanup_touch(pid, prev, now);
+	}
 	if (fifo_sched)
 		return;
 
@@ -171,6 +179,12 @@ void BPF_STRUCT_OPS(simple_enable, struct task_struct *p)
 
 s32 BPF_STRUCT_OPS_SLEEPABLE(simple_init)
 {
+	s32 ret;
+
+	ret = scx_map_cleanup_init();
+	if (ret)
+		return ret;
+
 	return scx_bpf_create_dsq(SHARED_DSQ, -1);
 }
 
@@ -20,7 +20,7 @@ OUTPUT_FILE="$RESULTS_DIR/summary_${SCHEDULER}_${WORKLOAD}.txt"
 
 echo "Aggregating results for $SCHEDULER with $WORKLOAD workload..."
 echo "========================================" > "$OUTPUT_FILE"
-echo "Summary: $SCHEDULER - $WORKload" >> "$OUTPUT_FILE"
+echo "Summary: $SCHEDULER - $WORKLOAD" >> "$OUTPUT_FILE"
 echo "Generated: $(date)" >> "$OUTPUT_FILE"
 echo "========================================" >> "$OUTPUT_FILE"
 echo "" >> "$OUTPUT_FILE"
@@ -59,6 +59,55 @@ else
     echo "  No results found" >> "$OUTPUT_FILE"
 fi
 
+# Compare the .metrics files written by run_ab_benchmark.sh, if any. Each
+# metric is reported as mean +/- 95% confidence interval over the runs,
+# followed by the change of the test mean relative to the control mean.
+METRIC_FILES=$(find "$RESULTS_DIR/$SCHEDULER/control" "$RESULTS_DIR/$SCHEDULER/test" \
+                    -name "${WORKLOAD}_run*.metrics" 2>/dev/null | sort)
+if [ -n "$METRIC_FILES" ]; then
+    echo "" >> "$OUTPUT_FILE"
+    echo "A/B METRICS (mean +/- 95% CI):" >> "$OUTPUT_FILE"
+    printf "  %-24s %-36s %-36s %s\n" metric control test delta >> "$OUTPUT_FILE"
+    for f in $METRIC_FILES; do
+        case "$f" in
+            */control/*) variant=control ;;
+            *)           variant=test ;;
+        esac
+        awk -F':' -v v=$variant 'NF == 2 && $2 != "" { print v, $1, $2 }' "$f"
+    done | awk '
+        # Two-sided 95% Student t quantiles by degrees of freedom.
+        BEGIN {
+            split("12.706 4.303 3.182 2.776 2.571 2.447 2.365 2.306 2.262 " \
+                  "2.228 2.201 2.179 2.160 2.145 2.131 2.120 2.110 2.101 " \
+                  "2.093 2.086 2.080 2.074 2.069 2.064 2.060 2.056 2.052 " \
+                  "2.048 2.045 2.042", t, " ")
+        }
+        {
+            key = $2; seen[key] = 1
+            n[$1, key]++; sum[$1, key] += $3; sq[$1, key] += $3 * $3
+        }
+        function stat(v, key) {
+            m = sum[v, key] / n[v, key]
+            ci = 0
+            if (n[v, key] > 1) {
+                var = (sq[v, key] - n[v, key] * m * m) / (n[v, key] - 1)
+                df = n[v, key] - 1
+                ci = (df <= 30 ? t[df] : 1.96) * sqrt(var > 0 ? var : 0) / sqrt(n[v, key])
+            }
+            return sprintf("%12.2f +/- %-10.2f (n=%d)", m, ci, n[v, key])
+        }
+        END {
+            for (key in seen) {
+                c = n["control", key] ? stat("control", key) : "-"
+                cm = n["control", key] ? sum["control", key] / n["control", key] : 0
+                tt = n["test", key] ? stat("test", key) : "-"
+                tm = n["test", key] ? sum["test", key] / n["test", key] : 0
+                d = (cm != 0 && n["test", key]) ? sprintf("%+.2f%%", (tm - cm) * 100 / cm) : "-"
+                printf "  %-24s %-36s %-36s %s\n", key, c, tt, d
+            }
+        }' | sort >> "$OUTPUT_FILE"
+fi
+
 cat "$OUTPUT_FILE"
 echo ""
 echo "Summary saved to: $OUTPUT_FILE"
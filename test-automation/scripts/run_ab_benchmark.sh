@@ -0,0 +1,157 @@
+#!/bin/bash
+# Control-vs-test A/B benchmark
+# Usage: run_ab_benchmark.sh <scheduler> [iterations] [profiles]
+#
+# Alternates the _control and _test builds from build_schedulers.sh for
+# <iterations> rounds (ABBA order, so slow drift of the machine doesn't favor
+# either side) over the profiles in Results/:
+#
+#   hackbench-4-process, hackbench-4-thread, schbench-64, stress-ng-mixed
+#
+# Every run leaves results/<scheduler>/<control|test>/<profile>_run<N>.csv
+# (map cleanup statistics, see scx/map_cleanup.h) and a .metrics file with
+# one KEY:value per line. aggregate_results.sh turns them into a summary with
+# 95% confidence intervals.
+
+set -e
+
+SCHEDULER=$1
+SCRIPT_DIR="$(cd "$(dirname "${BASH_SOURCE[0]}")" && pwd)"
+BASE_DIR="$(cd "$SCRIPT_DIR/.." && pwd)"
+source "$BASE_DIR/config/test_config.sh"
+
+ITERATIONS=${2:-$ITERATIONS}
+PROFILES=${3:-"hackbench-4-process hackbench-4-thread schbench-64 stress-ng-mixed"}
+
+if [ -z "$SCHEDULER" ]; then
+    echo "Usage: $0 <scheduler> [iterations] [profiles]" >&2
+    echo "  scheduler: scx_simple, scx_flatcg, scx_nest" >&2
+    echo "  iterations: A/B rounds per profile (default $ITERATIONS)" >&2
+    echo "  profiles: quoted list (default all)" >&2
+    exit 1
+fi
+
+for tool in bpftool jq bc; do
+    if ! command -v $tool >/dev/null 2>&1; then
+        echo "ERROR: $tool not found" >&2
+        exit 1
+    fi
+done
+
+"$SCRIPT_DIR/build_schedulers.sh" "$SCHEDULER" || exit 1
+
+SCHEDULER_BIN_DIR="$BASE_DIR/../build/scheds/c"
+
+cleanup() {
+    sudo pkill -f "${SCHEDULER}_control" 2>/dev/null || true
+    sudo pkill -f "${SCHEDULER}_test" 2>/dev/null || true
+    sudo pkill -f "hackbench|schbench|stress-ng" 2>/dev/null || true
+    sudo sysctl -q kernel.bpf_stats_enabled=0 2>/dev/null || true
+}
+
+trap cleanup EXIT
+
+# Per-program run_time_ns and run_cnt are only collected with bpf stats on.
+sudo sysctl -q kernel.bpf_stats_enabled=1
+
+# Print "<run_time_ns> <run_cnt>" summed over the scheduler's struct_ops
+# programs whose name ends in @1, or over all of them if @1 is empty.
+ops_stats() {
+    sudo bpftool prog show --json | jq -r --arg op "$1" '
+        [.[] | select(.type == "struct_ops")
+             | select($op == "" or (.name | endswith("_" + $op)))]
+        | "\(map(.run_time_ns // 0) | add // 0) \(map(.run_cnt // 0) | add // 0)"'
+}
+
+# Bytes of locked memory of every map used by the scheduler.
+map_memory() {
+    local total=0 id
+
+    for id in $(sudo bpftool prog show --json |
+                jq -r '[.[] | select(.type == "struct_ops") | .map_ids[]?] | unique | .[]'); do
+        total=$((total + $(sudo bpftool map show id "$id" --json | jq '.bytes_memlock // 0')))
+    done
+    echo $total
+}
+
+# ns per call between two "<run_time_ns> <run_cnt>" snapshots.
+ns_per_call() {
+    echo "$1 $2" | awk '{ cnt = $4 - $2; print (cnt > 0 ? ($3 - $1) / cnt : 0) }'
+}
+
+run_profile() {
+    local profile=$1
+
+    case "$profile" in
+        hackbench-4-process)
+            "$SCRIPT_DIR/workloads/hackbench_workload.sh" "$HACKBENCH_GROUPS" "$HACKBENCH_LOOPS" process ;;
+        hackbench-4-thread)
+            "$SCRIPT_DIR/workloads/hackbench_workload.sh" "$HACKBENCH_GROUPS" "$HACKBENCH_LOOPS" thread ;;
+        schbench-64)
+            "$SCRIPT_DIR/workloads/schbench_workload.sh" "$SCHBENCH_MESSAGE_THREADS" "$SCHBENCH_DURATION" ;;
+        stress-ng-mixed)
+            "$SCRIPT_DIR/workloads/stress_ng_workload.sh" 0 "$STRESS_NG_DURATION" ;;
+        *)
+            echo "ERROR: unknown profile: $profile" >&2
+            return 1 ;;
+    esac
+}
+
+# run_one <variant> <profile> <iteration>
+run_one() {
+    local variant=$1 profile=$2 iter=$3
+    local bin="$SCHEDULER_BIN_DIR/${SCHEDULER}_${variant}"
+    local out_dir="$RESULTS_DIR/$SCHEDULER/$variant"
+    local csv="$out_dir/${profile}_run${iter}.csv"
+    local metrics="$out_dir/${profile}_run${iter}.metrics"
+    local pid all_before all_after disp_before disp_after workload_out
+
+    mkdir -p "$out_dir"
+    echo "  [$variant] $profile run $iter"
+
+    sudo "$bin" -c "$csv" >"/tmp/scheduler_${variant}.log" 2>&1 &
+    pid=$!
+    sleep 2
+
+    if [ "$(cat /sys/kernel/sched_ext/state 2>/dev/null)" != "enabled" ]; then
+        echo "ERROR: $bin failed to load, see /tmp/scheduler_${variant}.log" >&2
+        return 1
+    fi
+
+    all_before=$(ops_stats "")
+    disp_before=$(ops_stats dispatch)
+    workload_out=$(run_profile "$profile")
+    all_after=$(ops_stats "")
+    disp_after=$(ops_stats dispatch)
+
+    {
+        echo "$workload_out" | grep -E '^[A-Z0-9_]+:'
+        echo "OPS_NS_PER_CALL:$(ns_per_call "$all_before" "$all_after")"
+        echo "DISPATCH_NS_PER_CALL:$(ns_per_call "$disp_before" "$disp_after")"
+        echo "MAP_MEMORY_BYTES:$(map_memory)"
+    } >"$metrics"
+
+    sudo kill "$pid" 2>/dev/null || true
+    wait "$pid" 2>/dev/null || true
+
+    awk -F',' 'NR > 1 { if ($2 > max) max = $2; scan += $3 }
+               END { print "MAP_ENTRIES_MAX:" max + 0; print "CLEANUP_SCAN_NS_TOTAL:" scan + 0 }' \
+        "$csv" >>"$metrics"
+    sleep 2
+}
+
+for profile in $PROFILES; do
+    echo "========================================"
+    echo "Profile: $profile"
+    echo "========================================"
+    for iter in $(seq 1 $ITERATIONS); do
+        if [ $((iter % 2)) -eq 1 ]; then
+            run_one control "$profile" "$iter"
+            run_one test "$profile" "$iter"
+        else
+            run_one test "$profile" "$iter"
+            run_one control "$profile" "$iter"
+        fi
+    done
+    "$SCRIPT_DIR/aggregate_results.sh" "$SCHEDULER" "$profile"
+done
@@ -2,8 +2,8 @@
 # Simplified experiment runner for scx_nest with hackbench
 # Usage: run_experiment.sh <scheduler> <workload> <duration> [iterations]
 #
-# To view map cleanup evictions in real-time, run in another terminal:
-#   sudo cat /sys/kernel/debug/tracing/trace_pipe
+# Map cleanup statistics are written by the scheduler to
+# results/<scheduler>/test/<workload>_run<N>.csv, see aggregate_results.sh.
 
 set -e
 
@@ -19,9 +19,6 @@ if [ -z "$SCHEDULER" ] || [ -z "$WORKLOAD" ] || [ -z "$DURATION" ]; then
     echo "  duration: test duration in seconds" >&2
     echo "" >&2
     echo "Example: $0 scx_nest hackbench 60 1" >&2
-    echo "" >&2
-    echo "To view evictions, run in another terminal:" >&2
-    echo "  sudo cat /sys/kernel/debug/tracing/trace_pipe" >&2
     exit 1
 fi
 
@@ -64,16 +61,8 @@ echo "========================================"
 sudo dmesg -C
 echo 3 | sudo tee /proc/sys/vm/drop_caches >/dev/null 2>&1 || true
 
-echo ""
-echo "========================================"
-echo "IMPORTANT: To view map cleanup evictions,"
-echo "run this in ANOTHER terminal:"
-echo ""
-echo "  sudo cat /sys/kernel/debug/tracing/trace_pipe"
-echo ""
-echo "========================================"
-echo ""
-read -p "Press ENTER when trace_pipe is running in another terminal..."
+RESULTS_DIR="$BASE_DIR/results/$SCHEDULER/test"
+mkdir -p "$RESULTS_DIR"
 
 for iter in $(seq 1 $ITERATIONS); do
     echo ""
@@ -88,8 +77,10 @@ for iter in $(seq 1 $ITERATIONS); do
     echo "Duration: ${DURATION}s"
     echo ""
     
+    CSV_FILE="$RESULTS_DIR/${WORKLOAD}_run${iter}.csv"
+
     # Start scheduler
-    sudo "$TEST_BIN" >/tmp/scheduler_test.log 2>&1 &
+    sudo "$TEST_BIN" -c "$CSV_FILE" >/tmp/scheduler_test.log 2>&1 &
     SCHED_PID=$!
     sleep 2
     
@@ -102,13 +93,12 @@ for iter in $(seq 1 $ITERATIONS); do
     # Run workload
     echo ""
     echo "Running hackbench workload for ${DURATION}s..."
-    echo "(Watch trace_pipe in other terminal for eviction messages)"
     echo ""
     
     # Run hackbench in a loop for the duration
     END_TIME=$(($(date +%s) + DURATION))
     while [ $(date +%s) -lt $END_TIME ]; do
-        "$SCRIPT_DIR/workloads/hackbench_workload.sh" "$HACKBENCH_PROCESSES" "$HACKBENCH_LOOPS" 2>/dev/null || true
+        "$SCRIPT_DIR/workloads/hackbench_workload.sh" "$HACKBENCH_GROUPS" "$HACKBENCH_LOOPS" 2>/dev/null || true
     done
     
     # Stop scheduler
@@ -118,7 +108,7 @@ for iter in $(seq 1 $ITERATIONS); do
     wait $SCHED_PID 2>/dev/null || true
     
     echo ""
-    echo "Iteration $iter completed."
+    echo "Iteration $iter completed, statistics in $CSV_FILE"
     sleep 2
 done
 
@@ -126,7 +116,6 @@ echo ""
 echo "=========================================="
 echo "Experiment completed!"
 echo ""
-echo "Check your trace_pipe terminal for output like:"
-echo "  Map cleanup: evicted X stale entries"
-echo "  Map cleanup: timeout after evicted X entries"
+echo "Summarize with:"
+echo "  $SCRIPT_DIR/aggregate_results.sh $SCHEDULER $WORKLOAD"
 echo "=========================================="
@@ -99,7 +99,7 @@ for iter in $(seq 1 $ITERATIONS); do
             WORKLOAD_PID=$!
             ;;
         hackbench)
-            "$SCRIPT_DIR/workloads/hackbench_workload.sh" "$HACKBENCH_PROCESSES" "$HACKBENCH_LOOPS" &
+            "$SCRIPT_DIR/workloads/hackbench_workload.sh" "$HACKBENCH_GROUPS" "$HACKBENCH_LOOPS" &
             WORKLOAD_PID=$!
             ;;
         custom-churn)
@@ -187,7 +187,7 @@ for iter in $(seq 1 $ITERATIONS); do
             WORKLOAD_PID=$!
             ;;
         hackbench)
-            "$SCRIPT_DIR/workloads/hackbench_workload.sh" "$HACKBENCH_PROCESSES" "$HACKBENCH_LOOPS" &
+            "$SCRIPT_DIR/workloads/hackbench_workload.sh" "$HACKBENCH_GROUPS" "$HACKBENCH_LOOPS" &
             WORKLOAD_PID=$!
             ;;
         custom-churn)
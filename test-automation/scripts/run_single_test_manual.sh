@@ -82,7 +82,7 @@ case "$WORKLOAD" in
         WORKLOAD_PID=$!
         ;;
     hackbench)
-        "$SCRIPT_DIR/workloads/hackbench_workload.sh" "$HACKBENCH_PROCESSES" "$HACKBENCH_LOOPS" &
+        "$SCRIPT_DIR/workloads/hackbench_workload.sh" "$HACKBENCH_GROUPS" "$HACKBENCH_LOOPS" &
         WORKLOAD_PID=$!
         ;;
     custom-churn)
@@ -1,20 +1,30 @@
 #!/bin/bash
 # Hackbench workload generator
-# Usage: hackbench_workload.sh <processes> <loops>
+# Usage: hackbench_workload.sh <groups> <loops> [process|thread]
 
 set -e
 
-PROCESSES=${1:-10}
+NR_GROUPS=${1:-4}
 LOOPS=${2:-100}
+MODE=${3:-process}
+
+case "$MODE" in
+    process) MODE_FLAG=-P ;;
+    thread)  MODE_FLAG=-T ;;
+    *)
+        echo "ERROR: unknown hackbench mode: $MODE" >&2
+        exit 1
+        ;;
+esac
 
 if ! command -v hackbench >/dev/null 2>&1; then
     echo "ERROR: hackbench not found. Install with: sudo apt-get install rt-tests" >&2
     exit 1
 fi
 
-echo "[$(date +%H:%M:%S)] Starting hackbench: -p $PROCESSES -l $LOOPS"
+echo "[$(date +%H:%M:%S)] Starting hackbench: -g $NR_GROUPS -l $LOOPS $MODE_FLAG"
 START_TIME=$(date +%s.%N)
-hackbench -p "$PROCESSES" -l "$LOOPS" >/tmp/hackbench_output.log 2>&1
+hackbench -g "$NR_GROUPS" -l "$LOOPS" "$MODE_FLAG" >/tmp/hackbench_output.log 2>&1
 END_TIME=$(date +%s.%N)
 DURATION=$(echo "$END_TIME - $START_TIME" | bc)
 
@@ -0,0 +1,36 @@
+#!/bin/bash
+# Schbench workload generator, same profile as Results/schbench-64.html
+# Usage: schbench_workload.sh <message_threads> <duration>
+#
+# Prints the final wakeup latency percentiles (usec) and the average RPS.
+
+set -e
+
+MESSAGE_THREADS=${1:-64}
+DURATION=${2:-30}
+
+if ! command -v schbench >/dev/null 2>&1; then
+    echo "ERROR: schbench not found. Build it from https://git.kernel.org/pub/scm/linux/kernel/git/mason/schbench.git" >&2
+    exit 1
+fi
+
+echo "[$(date +%H:%M:%S)] Starting schbench: -m $MESSAGE_THREADS -F 128 -L -r $DURATION"
+schbench -m "$MESSAGE_THREADS" -F 128 -L -r "$DURATION" >/tmp/schbench_output.log 2>&1
+
+# schbench prints intermediate reports as well, the last one is the summary.
+awk '
+    /Wakeup Latencies/  { sec = "WAKEUP" }
+    /Request Latencies/ { sec = "REQUEST" }
+    /RPS percentiles/   { sec = "RPS" }
+    sec == "WAKEUP" && /50\.0th:/ { p50 = $0; sub(/.*50\.0th: */, "", p50); sub(/ .*/, "", p50) }
+    sec == "WAKEUP" && /99\.0th:/ { p99 = $0; sub(/.*99\.0th: */, "", p99); sub(/ .*/, "", p99) }
+    sec == "WAKEUP" && /99\.9th:/ { p999 = $0; sub(/.*99\.9th: */, "", p999); sub(/ .*/, "", p999) }
+    /average rps:/ { rps = $NF }
+    END {
+        print "WAKEUP_P50_US:" p50
+        print "WAKEUP_P99_US:" p99
+        print "WAKEUP_P999_US:" p999
+        print "RPS:" rps
+    }
+' /tmp/schbench_output.log
+echo "[$(date +%H:%M:%S)] Schbench completed"
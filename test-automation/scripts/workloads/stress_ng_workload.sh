@@ -0,0 +1,27 @@
+#!/bin/bash
+# Stress-NG workload generator, same profile as Results/stress-ng-mixed.html
+# Usage: stress_ng_workload.sh <instances> <duration>
+#
+# Runs the mixed scheduler stressor and prints its real time bogo ops/s.
+
+set -e
+
+INSTANCES=${1:-0}
+DURATION=${2:-60}
+
+if ! command -v stress-ng >/dev/null 2>&1; then
+    echo "ERROR: stress-ng not found. Install with: sudo apt-get install stress-ng" >&2
+    exit 1
+fi
+
+echo "[$(date +%H:%M:%S)] Starting stress-ng: --schedmix $INSTANCES --timeout ${DURATION}s"
+stress-ng --schedmix "$INSTANCES" --timeout "${DURATION}s" --metrics-brief \
+    >/tmp/stress_ng_output.log 2>&1
+
+# stress-ng: info:  [pid] schedmix  <bogo ops> <real> <usr> <sys> <bogo ops/s real> ...
+awk '{
+    for (i = 1; i <= NF; i++)
+        if ($i == "schedmix" && $(i + 5) ~ /^[0-9.]+$/)
+            print "BOGO_OPS_PER_SEC:" $(i + 5)
+}' /tmp/stress_ng_output.log
+echo "[$(date +%H:%M:%S)] Stress-NG completed"